@@ -6,11 +6,17 @@
    References: BLPP paper and machsuif's implementation.
    
 */
+#include <stdint.h>
+#include <functional>
 #include <list>
+#include <map>
+#include <memory>
 #include <vector>
 #include "llvm/Pass.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Dominators.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Support/Allocator.h"
 
 using namespace llvm;
 typedef enum {
@@ -20,10 +26,22 @@ typedef enum {
   INVALID
 } AnnoteType;
 
+/* The edges into or out of a node: a slice of the CSR edge arrays of its
+   function, which are rebuilt when the graph changes (BLPP::BuildCSR).
+   It can be iterated like the edge lists it replaces.
+*/
+struct BLPPEdgeRange {
+  typedef struct TagBLPPEdge **iterator;
+  struct TagBLPPEdge **beBeginPP, **beEndPP;
+  iterator begin() const { return beBeginPP; }
+  iterator end() const { return beEndPP; }
+  size_t size() const { return beEndPP - beBeginPP; }
+};
+
 typedef struct {
   bool isVisited; /* For DFS's */
   unsigned int siNumPaths;
-  std::list<struct TagBLPPEdge*> lOutEdges, lInEdges;
+  BLPPEdgeRange lOutEdges, lInEdges;
   unsigned int uiNodeID;
   void *vNodeDataP;
 } BLPPNode;
@@ -31,6 +49,8 @@ typedef struct {
 struct TagBLPPEdge {
   BLPPNode *nodeHeadP, *nodeTailP;
   signed int siEdgeVal, siIncrement, siReset;
+  uint64_t uLWeight; /* Estimated execution count, for ChooseST */
+  uint32_t uiSuccNum; /* Successor number of the CFG edge in its tail */
   bool isChord, isReset, isInst /* has this edge been already instrumented? */; 
   struct TagBLPPEdge* beDummyMatchP;
   AnnoteType atKind;
@@ -43,46 +63,230 @@ typedef struct {
   BLPPNode **bnPP;
 } BLPPPath;
 
-/* This class is more for code reuse than for anything else. */
+/* Frames of the explicit DFS stacks of BLPP. A block whose successors are
+   being visited by CreateBLPPGraph:
+*/
+typedef struct {
+  BasicBlock *psBB;
+  BLPPNode *bnNodeP;
+  uint32_t uiNextSucc;
+} BLPPBuildFrame;
+
+/* A node whose edges are being visited by AssignEdgeVals (out edges) or
+   CountPathsTo (in edges), with the paths counted so far:
+*/
+typedef struct {
+  BLPPNode *bnNodeP;
+  BLPPEdgeRange::iterator itNext;
+  uint64_t uLNumPaths;
+} BLPPPathFrame;
+
+/* A node reached by DFS_ST through a tree edge:
+*/
+typedef struct {
+  BLPPNode *bnNodeP;
+  BLPPEdge *beTreeP;
+  signed int siEvents;
+} BLPPTreeFrame;
 
-class BLPP : public FunctionPass {
+namespace llvm {
+  class BlockFrequencyInfo;
+  class BranchProbabilityInfo;
+  namespace legacy {
+    class FunctionPassManager;
+  }
+}
+class BLPPDB;
+
+/* The BL graph of one function, with its path numbering and annotations.
+   It is computed when constructed and holds no state of other functions;
+   BLPPWrapperPass keeps the one of the function it last ran on, and
+   BLPPAnalysis those of the new pass manager. The estimates it is given
+   are only read while it is constructed.
+*/
+
+class BLPP {
 
   BLPPNode **bnTempPathPP;
+  /* Nodes, edges and CSR edge arrays; freed together with the graph */
+  BumpPtrAllocator sArena;
+  /* CSR edge arrays (see BuildCSR), with room for uiCSRSize edges each */
+  BLPPEdge **beOutPP, **beInPP;
+  uint32_t uiCSRSize;
   typedef std::map<const BasicBlock*, BLPPNode*> MapBBToBLPPNode;
   MapBBToBLPPNode mBBToBLPPNode;
   DominatorTree sDT; //Dominator tree for the function
   uint32_t uiNodeID;
   Function *psCurFunc;
+  /* Sources of edge weights: static estimates, or an earlier profile */
+  BlockFrequencyInfo *psBFI;
+  BranchProbabilityInfo *psBPI;
+  BLPPDB *bdbWeightsP;
+  uint32_t uiFuncID; /* psCurFunc's ID in bdbWeightsP */
+  /* Set by AssignEdgeVals when a node has more than -blppmaxpaths paths */
+  bool isPathOverflow;
+  /* CFG edges of the current function, for edge profiling */
+  std::vector<BLPPEdge*> vCFGEdges;
+  /* DFS stacks, reserved to the size of the function */
+  std::vector<BLPPBuildFrame> vBuildStack;
+  std::vector<BLPPPathFrame> vPathStack;
+  std::vector<BLPPTreeFrame> vTreeStack;
   
 
   /* These are utility functions */
   void ComputeChordIncrements();
   void ChooseST();
+  void ChooseSTInOrder(std::vector<BLPPEdge*> &vEdges);
+  void ChooseMaxWeightST(std::vector<BLPPEdge*> &vEdges,
+                         bool isWeighted = true);
+  void GetFunctionEdges(std::vector<BLPPEdge*> &vEdges);
+  uint64_t EstimateIncrements(std::vector<BLPPEdge*> &vEdges);
+  uint64_t EstimateEdgeWeight(BasicBlock *psBB, signed int siSucc);
+  void WeighEdgesFromProfile();
+  void HandlePathOverflow();
+  bool TruncatePaths();
+  void CutPathsAt(BLPPNode *bnCutP);
+  uint64_t CountPathsTo(BLPPNode *bnCurrentP, std::vector<uint64_t> &vPathsTo);
+  void PushPathFrame(BLPPNode *bnNodeP, BLPPEdgeRange &lEdges,
+                     uint64_t uLNumPaths);
+  signed int WrapPathSum(int64_t siPathSum);
   void DFS_ST(signed int siEvents, BLPPNode *bnCurP,
               BLPPEdge *beP);
   signed int Dir(BLPPEdge *be1P, BLPPEdge *be2P);
   void AssociateAnnotations();
   void CreateBLPPGraph(BasicBlock *psCurNode);
+  void EnterBLPPNode(BasicBlock *psCurNode);
+  void BuildCSR();
   BLPPNode* CreateBLPPNode(BasicBlock *psBB, uint32_t uiNodeID);
   BLPPEdge* CreateBLPPEdge(BLPPNode *psTail, BLPPNode *psHead);
 
  public:
   std::vector<BLPPNode*>svNodes;
-  std::list<BLPPEdge*>lEdges;
+  /* Edges of the current function, in the order they were created */
+  std::vector<BLPPEdge*>lEdges;
   BLPPNode *bnEntryP, *bnExitP;
+  /* BLPP_FUNC_* flags of the current function; with BLPP_FUNC_HASHED, path
+     IDs are path sums masked with uLHashMask
+  */
+  uint32_t uiPathFlags;
+  uint64_t uLHashMask;
 
-  BLPP() : FunctionPass(ID), bnTempPathPP(nullptr), psCurFunc(nullptr) {};
+  BLPP(Function &f, BlockFrequencyInfo *psBFI, BranchProbabilityInfo *psBPI,
+    BLPPDB *bdbWeightsP, uint32_t uiFuncID);
   void InitDFS();
   void MarkBLPPAnnotations();
   void AssignEdgeVals(BLPPNode *bnCurrentP = nullptr);
   BLPPPath RegeneratePath(signed int siPathID);
+  std::vector<BLPPEdge*>& ChooseEdgeCounters();
+  void ComputeEdgeCounts(std::vector<uint64_t> &vCounts);
+  ~BLPP();
+  
+};
+
+/* Where the graphs of a module get their edge weights: -blppstprofile,
+   with the IDs of the functions of the module last looked up in it as
+   assigned by BLPPInstrumentation, or else the static estimates they are
+   built with. Shared by the graphs a pass computes.
+*/
+
+class BLPPWeights {
+
+  BLPPDB *bdbWeightsP;
+  std::map<const Function*, uint32_t> mFunctionIDs;
+  const Module *psIDModule;
+  uint32_t GetFunctionID(Function &f);
+
+ public:
+  BLPPWeights() : bdbWeightsP(nullptr), psIDModule(nullptr) {};
+  static bool NeedsEstimates();
+  BLPP* BuildGraph(Function &f, BlockFrequencyInfo *psBFI,
+    BranchProbabilityInfo *psBPI);
+  ~BLPPWeights();
+
+};
+
+/* The legacy pass computing the BLPP graph of each function. The graph of
+   the previous function is freed when the pass runs again or its results
+   are released, so memory follows the largest function, not the module.
+*/
+
+class BLPPWrapperPass : public FunctionPass {
+
+  BLPP *bpGraphP;
+  BLPPWeights sWeights;
+
+ public:
+  BLPPWrapperPass() : FunctionPass(ID), bpGraphP(nullptr) {};
+  BLPP &getBLPP() { return *bpGraphP; }
   virtual bool runOnFunction(Function &f);
-  virtual void getAnalysisUsage(AnalysisUsage &AU)
-  {
-  }
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
+  virtual void releaseMemory();
   virtual const char* getPassName() {return "blpp";}
   static char ID;
-  ~BLPP();
-  
+  ~BLPPWrapperPass();
+
+};
+
+/* BlockFrequencyInfo and BranchProbabilityInfo are legacy passes only. For
+   passes of the new pass manager, this computes them for a function in a
+   legacy function pass manager of its own, and hands them to a callback
+   while they are live.
+   LLVM 3.6's new pass manager has no analyses computing them, and can't
+   run legacy passes or hand out their results, so BLPPAnalysis has no
+   other way to weigh its spanning tree. The estimates only live for the
+   duration of the callback, and the graph built from them is cached as
+   the analysis result, so nothing of the legacy pass manager escapes it.
+   Once the new pass manager has its own block frequency analysis, this
+   class can go, and BLPPAnalysis::run can get them from its manager.
+*/
+
+class BLPPEstimator {
+
+  legacy::FunctionPassManager *psFPM;
+  FunctionPass *psEstimatePass;
+  const Module *psModule;
+
+ public:
+  typedef std::function<void (BlockFrequencyInfo&, BranchProbabilityInfo&)>
+    EstimateUser;
+  BLPPEstimator() : psFPM(nullptr), psEstimatePass(nullptr),
+    psModule(nullptr) {};
+  void Run(Function &f, const EstimateUser &fnUser);
+  ~BLPPEstimator();
+
+};
+
+/* The analysis computing BLPP graphs for the new pass manager. Graphs are
+   cached by the FunctionAnalysisManager until their function changes, so
+   the passes of a pipeline share them. Register it with
+   FAM.registerPass(BLPPAnalysis()); module passes reach it through the
+   FunctionAnalysisManagerModuleProxy.
+*/
+
+class BLPPAnalysis {
+
+  static char PassID;
+  /* Shared by the copies the pass manager makes of the pass */
+  std::shared_ptr<BLPPWeights> psWeights;
+  std::shared_ptr<BLPPEstimator> psEstimator;
+
+ public:
+  /* The graph is kept by pointer, as results are moved by the pass
+     manager
+  */
+  class Result {
+    std::unique_ptr<BLPP> bpGraphP;
+   public:
+    explicit Result(BLPP *bpGraphP) : bpGraphP(bpGraphP) {};
+    Result(Result &&sOther) : bpGraphP(std::move(sOther.bpGraphP)) {};
+    BLPP &getBLPP() { return *bpGraphP; }
+  };
+
+  BLPPAnalysis() : psWeights(new BLPPWeights()),
+    psEstimator(new BLPPEstimator()) {};
+  static void *ID() { return (void*) &PassID; }
+  static StringRef name() { return "BLPPAnalysis"; }
+  Result run(Function &f);
+
 };
 #endif
@@ -1,15 +1,49 @@
 #include "llvm/Analysis/BLPP.h"
+#include "llvm/Analysis/BLPPDB.h"
+#include "llvm/Analysis/blpp_if.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
 #include <iostream>
 
 /* This file contains the implementation for blpp.h */
 using namespace llvm;
-char BLPP::ID = 0;
-static RegisterPass<BLPP>
+char BLPPWrapperPass::ID = 0;
+static RegisterPass<BLPPWrapperPass>
 BLPPRegistration("blpp", "instrument code for BL path profiling");
-/* This function marks all vertices in BLPP graph as unvisited.
+char BLPPAnalysis::PassID;
+
+static cl::opt<bool>
+bUnweightedST("blppunweightedst", cl::init(false),
+  cl::desc("Choose the spanning tree in CFG order, ignoring how often "
+           "edges are taken"));
+static cl::opt<std::string>
+sSTProfile("blppstprofile", cl::value_desc("filename"),
+  cl::desc("Weigh edges for the spanning tree by their counts in an "
+           "earlier profile, instead of static frequency estimates"));
+static cl::opt<unsigned>
+uiMaxPaths("blppmaxpaths", cl::init(0x7FFFFFFF), cl::value_desc("n"),
+  cl::desc("Functions with more paths than this have their paths truncated "
+           "at merge points, or hashed with -blpphashpaths"));
+static cl::opt<bool>
+bHashPaths("blpphashpaths", cl::init(false),
+  cl::desc("Number the paths of functions with more than -blppmaxpaths "
+           "paths modulo 2^-blpphashbits instead of truncating them"));
+static cl::opt<unsigned>
+uiHashBits("blpphashbits", cl::init(16), cl::value_desc("bits"),
+  cl::desc("Bits of the path IDs of hashed functions (at most 30)"));
+static cl::opt<bool>
+bSTReport("blppstreport", cl::init(false),
+  cl::desc("Report the estimated number of increments executed with the "
+           "CFG order and the chosen spanning trees"));
+/* This function marks all vertices in the current function's BLPP graph as
+   unvisited.
    Inputs, Return Value:
      None
    SideEffects:
@@ -26,10 +60,11 @@ void BLPP::InitDFS() {
 
 
 /* This function assigns edge values for BLPP graph. It does this
-   while leaving a node in DFS.
+   while leaving a node in DFS. The DFS keeps its own stack, so that large
+   functions don't overflow the native one.
 
    Input:
-     bnCurNodeP  -> Node being visited.
+     bnCurNodeP  -> Node to start from; the entry node if NULL
 
    Return Value:
      None
@@ -44,7 +79,6 @@ void BLPP::InitDFS() {
 void BLPP::AssignEdgeVals(BLPPNode *bnCurrentP) {
   BLPPNode *bnSuccP;
   BLPPEdge *beOutP;
-  signed int siNumPaths;
 
   if (NULL == bnCurrentP) {
     InitDFS();
@@ -53,28 +87,58 @@ void BLPP::AssignEdgeVals(BLPPNode *bnCurrentP) {
 
   assert((false == bnCurrentP->isVisited) && "EdgeVals: Trying to visit again");
   bnCurrentP->isVisited = true;
-
-  if (0 == (bnCurrentP->lOutEdges).size()) {
-    bnCurrentP->siNumPaths = 1;
-  } else {
-    siNumPaths = 0;
-    for (std::list<BLPPEdge*>::iterator 
-           it = (bnCurrentP->lOutEdges).begin(); 
-         it != (bnCurrentP->lOutEdges).end(); it++) {
-      beOutP = *it;
+  vPathStack.clear();
+  PushPathFrame(bnCurrentP, bnCurrentP->lOutEdges, 0);
+  while (!vPathStack.empty()) {
+    BLPPPathFrame &bfCurP = vPathStack.back();
+    bnCurrentP = bfCurP.bnNodeP;
+    if (bfCurP.itNext != bnCurrentP->lOutEdges.end()) {
+      beOutP = *bfCurP.itNext;
       bnSuccP = beOutP->nodeHeadP;
       if (false == bnSuccP->isVisited) {
-        AssignEdgeVals(bnSuccP);
+        /* Come back to this edge once the successor is done */
+        bnSuccP->isVisited = true;
+        PushPathFrame(bnSuccP, bnSuccP->lOutEdges, 0);
+        continue;
       }
-      beOutP->siEdgeVal = siNumPaths;
-      siNumPaths = siNumPaths + bnSuccP->siNumPaths;
+      beOutP->siEdgeVal = (signed int) bfCurP.uLNumPaths;
+      bfCurP.uLNumPaths = bfCurP.uLNumPaths + bnSuccP->siNumPaths;
+      if (uiPathFlags & BLPP_FUNC_HASHED) {
+        bfCurP.uLNumPaths &= uLHashMask;
+      } else if (bfCurP.uLNumPaths > uiMaxPaths) {
+        /* Too many paths to number; the counts are only kept from growing */
+        isPathOverflow = true;
+        bfCurP.uLNumPaths = uiMaxPaths;
+      }
+      bfCurP.itNext++;
+      continue;
     }
-    bnCurrentP->siNumPaths = siNumPaths;
-  }
-#if 1
-  printf("Number of paths from %u to exit: %d\n", bnCurrentP->uiNodeID, 
-         bnCurrentP->siNumPaths);
+
+    if (0 == (bnCurrentP->lOutEdges).size()) {
+      bnCurrentP->siNumPaths = 1;
+    } else {
+      bnCurrentP->siNumPaths = bfCurP.uLNumPaths;
+    }
+    vPathStack.pop_back();
+#if 0
+    printf("Number of paths from %u to exit: %d\n", bnCurrentP->uiNodeID, 
+           bnCurrentP->siNumPaths);
 #endif
+  }
+}
+
+/* This function starts visiting a node in AssignEdgeVals or CountPathsTo.
+
+   Inputs:
+     bnNodeP    -> Node
+     lEdges     -> Its edges to visit
+     uLNumPaths -> Initial path count
+*/
+
+void BLPP::PushPathFrame(BLPPNode *bnNodeP, BLPPEdgeRange &lEdges,
+                         uint64_t uLNumPaths) {
+  BLPPPathFrame bfNew = {bnNodeP, lEdges.begin(), uLNumPaths};
+  vPathStack.push_back(bfNew);
 }
 
 /* This function chooses a spanning tree, and computes increments for chords
@@ -93,7 +157,7 @@ void BLPP::AssignEdgeVals(BLPPNode *bnCurrentP) {
 void BLPP::ComputeChordIncrements() {
   BLPPEdge *beCurP;
 
-  for (std::list<BLPPEdge*>::iterator it = lEdges.begin();
+  for (std::vector<BLPPEdge*>::iterator it = lEdges.begin();
        it != lEdges.end(); it++) {
     beCurP = *it;
     if (true == beCurP->isChord) {
@@ -105,29 +169,153 @@ void BLPP::ComputeChordIncrements() {
   DFS_ST(0, bnEntryP, NULL);
 
   /* Finish computing increments */
-  for (std::list<BLPPEdge*>::iterator it = lEdges.begin();
+  for (std::vector<BLPPEdge*>::iterator it = lEdges.begin();
        it != lEdges.end(); it++) {
     beCurP = *it;
     if (true == beCurP->isChord) {
-      beCurP->siIncrement = beCurP->siIncrement + beCurP->siEdgeVal;
+      beCurP->siIncrement = WrapPathSum((int64_t) beCurP->siIncrement +
+                                        beCurP->siEdgeVal);
     }
   }
 }
 
 /* This function chooses a spanning tree for the BLPP graph. The graph is
-   treated as an undirected graph!
+   treated as an undirected graph! Increments are placed on chords, so the
+   tree keeps the most frequently taken edges (the maximum weight spanning
+   tree of Ball and Larus), unless -blppunweightedst is given.
 
    Input, Return Value:
      None
 
    SideEffects:
-     isChord is set for each edge
+     isChord is set for each edge of the current function
 
    PreConditions:
      BLPP Graph must be cyclic (the only backedge is the exit->entry edge)
 */
 
 void BLPP::ChooseST() {
+  std::vector<BLPPEdge*> vEdges;
+  uint64_t uLInOrder = 0;
+
+  GetFunctionEdges(vEdges);
+  if (bUnweightedST || bSTReport) {
+    ChooseSTInOrder(vEdges);
+    uLInOrder = EstimateIncrements(vEdges);
+  }
+  if (!bUnweightedST) {
+    ChooseMaxWeightST(vEdges);
+  }
+  if (bSTReport) {
+    errs() << "BLPP: " << psCurFunc->getName() << ": estimated increments: "
+      << uLInOrder << " in CFG order, " << EstimateIncrements(vEdges)
+      << " with the chosen spanning tree\n";
+  }
+}
+
+/* This function collects the edges of the current function's BLPP graph.
+
+   Inputs:
+     vEdges -> Receives the edges
+*/
+
+void BLPP::GetFunctionEdges(std::vector<BLPPEdge*> &vEdges) {
+  for (std::vector<BLPPNode*>::iterator it = svNodes.begin();
+       it != svNodes.end(); it++) {
+    vEdges.insert(vEdges.end(), (*it)->lOutEdges.begin(),
+                  (*it)->lOutEdges.end());
+  }
+}
+
+/* This function returns the estimated number of increments executed, that
+   is the total weight of the chords.
+*/
+
+uint64_t BLPP::EstimateIncrements(std::vector<BLPPEdge*> &vEdges) {
+  uint64_t uLSum = 0;
+  for (std::vector<BLPPEdge*>::iterator it = vEdges.begin();
+       it != vEdges.end(); it++) {
+    if ((*it)->isChord) {
+      uLSum += (*it)->uLWeight;
+    }
+  }
+  return uLSum;
+}
+
+/* This function returns the representative of a node's component, for
+   ChooseMaxWeightST.
+*/
+
+static uint32_t FindComponent(std::vector<uint32_t> &vParent, uint32_t uiNode) {
+  while (vParent[uiNode] != uiNode) {
+    vParent[uiNode] = vParent[vParent[uiNode]];
+    uiNode = vParent[uiNode];
+  }
+  return uiNode;
+}
+
+static bool IsHeavier(const BLPPEdge *be1P, const BLPPEdge *be2P) {
+  return be1P->uLWeight > be2P->uLWeight;
+}
+
+/* This function chooses a maximum weight spanning tree (Kruskal). The
+   exit->entry edge is always in the tree; edges of equal weight are
+   considered in CFG order.
+
+   Inputs:
+     vEdges     -> Edges of the current function
+     isWeighted -> false to consider all edges of equal weight, so that the
+                   tree only depends on the CFG
+
+   SideEffects:
+     isChord is set for each edge
+*/
+
+void BLPP::ChooseMaxWeightST(std::vector<BLPPEdge*> &vEdges,
+                             bool isWeighted) {
+  std::vector<BLPPEdge*> vSorted(vEdges);
+  std::vector<uint32_t> vParent(uiNodeID);
+  BLPPEdge *beCurP;
+  uint32_t uiTail, uiHead;
+
+  for (uint32_t i = 0; i < uiNodeID; i++) {
+    vParent[i] = i;
+  }
+  vParent[bnExitP->uiNodeID] = bnEntryP->uiNodeID;
+  if (isWeighted) {
+    std::stable_sort(vSorted.begin(), vSorted.end(), IsHeavier);
+  }
+
+  for (std::vector<BLPPEdge*>::iterator it = vSorted.begin();
+       it != vSorted.end(); it++) {
+    beCurP = *it;
+    beCurP->siIncrement = 0;
+    if ((beCurP->nodeTailP == bnExitP) && (beCurP->nodeHeadP == bnEntryP)) {
+      beCurP->isChord = false;
+      continue;
+    }
+    uiTail = FindComponent(vParent, beCurP->nodeTailP->uiNodeID);
+    uiHead = FindComponent(vParent, beCurP->nodeHeadP->uiNodeID);
+    if (uiTail == uiHead) {
+      beCurP->isChord = true;
+    } else {
+      vParent[uiTail] = uiHead;
+      beCurP->isChord = false;
+    }
+  }
+}
+
+/* This function chooses the spanning tree from the edges in CFG order, as
+   done before edges had weights.
+
+   Inputs:
+     vEdges -> Edges of the current function
+
+   SideEffects:
+     isChord is set for each edge
+*/
+
+void BLPP::ChooseSTInOrder(std::vector<BLPPEdge*> &vEdges) {
   BLPPEdge *beCurP;
   BLPPNode *bnHeadP, *bnTailP;
 
@@ -138,8 +326,8 @@ void BLPP::ChooseST() {
   bnEntryP->isVisited = true;
   bnExitP->isVisited = true;
   
-  for (std::list<BLPPEdge*>::iterator it = lEdges.begin(); 
-       it != lEdges.end(); it++) {
+  for (std::vector<BLPPEdge*>::iterator it = vEdges.begin(); 
+       it != vEdges.end(); it++) {
     beCurP = *it;
     bnHeadP = beCurP->nodeHeadP;
     bnTailP = beCurP->nodeTailP;
@@ -160,11 +348,14 @@ void BLPP::ChooseST() {
 
 
 /* This function computes increments, less their edge values, for chords 
-   in one pass. It actually does this by a DFS of ST.
+   in one pass. It actually does this by a DFS of ST. The chords incident to
+   a node are found among its own edges, not by a scan of all edges. Nodes are
+   visited from an explicit stack; the order doesn't matter, since each
+   node's events only depend on its parent's, and increments are sums.
    
    Inputs:
      siEvents       -> Edge Value for the tree edge
-     bnCurP         -> Current Node being handled
+     bnCurP         -> Node to start from
      beP            -> The incoming tree edge into the source of the
                        tree edge
    
@@ -179,42 +370,62 @@ void BLPP::DFS_ST(signed int siEvents, BLPPNode *bnCurP,
                  BLPPEdge *beP) {
 
   BLPPEdge *beCurP;
-
-  for (std::list<BLPPEdge*>::iterator 
-         it = (bnCurP->lInEdges).begin(); 
-       it != (bnCurP->lInEdges).end(); it++) {
-
-    beCurP = *it; /* f: tgt(f) = bnCurP */
-    assert((bnCurP == beCurP->nodeHeadP) && "DFS_ST: Edge, Node Inconsistency\n");
-
-    if ((false == beCurP->isChord) && (beP != beCurP)) {
-      /* f is in ST, and f is not beP */
-      DFS_ST(Dir(beP, beCurP) * siEvents + beCurP->siEdgeVal, 
-             beCurP->nodeTailP, beCurP);
+  BLPPTreeFrame btfCur = {bnCurP, beP, siEvents};
+
+  vTreeStack.clear();
+  vTreeStack.push_back(btfCur);
+  while (!vTreeStack.empty()) {
+    btfCur = vTreeStack.back();
+    vTreeStack.pop_back();
+    bnCurP = btfCur.bnNodeP;
+    beP = btfCur.beTreeP;
+    siEvents = btfCur.siEvents;
+
+    for (BLPPEdgeRange::iterator 
+           it = (bnCurP->lInEdges).begin(); 
+         it != (bnCurP->lInEdges).end(); it++) {
+
+      beCurP = *it; /* f: tgt(f) = bnCurP */
+      assert((bnCurP == beCurP->nodeHeadP) && "DFS_ST: Edge, Node Inconsistency\n");
+
+      if ((false == beCurP->isChord) && (beP != beCurP)) {
+        /* f is in ST, and f is not beP */
+        BLPPTreeFrame btfNext = {beCurP->nodeTailP, beCurP,
+                                 WrapPathSum((int64_t) Dir(beP, beCurP) *
+                                             siEvents + beCurP->siEdgeVal)};
+        vTreeStack.push_back(btfNext);
+      }
     }
-  }
 
-  for (std::list<BLPPEdge*>::iterator
-         it = (bnCurP->lOutEdges).begin(); 
-       it != (bnCurP->lOutEdges).end(); it++) {
+    for (BLPPEdgeRange::iterator
+           it = (bnCurP->lOutEdges).begin(); 
+         it != (bnCurP->lOutEdges).end(); it++) {
 
-    beCurP = *it; /* f: src(f) = bnCurP */
-    assert((bnCurP == beCurP->nodeTailP) && "DFS_ST: Edge, Node Inconsistency\n");
+      beCurP = *it; /* f: src(f) = bnCurP */
+      assert((bnCurP == beCurP->nodeTailP) && "DFS_ST: Edge, Node Inconsistency\n");
 
-    if ((false == beCurP->isChord) && (beP != beCurP)) {
-      /* f is in ST, and f is not beP */
-      DFS_ST(Dir(beP, beCurP) * siEvents + beCurP->siEdgeVal,
-             beCurP->nodeHeadP, beCurP);
+      if ((false == beCurP->isChord) && (beP != beCurP)) {
+        /* f is in ST, and f is not beP */
+        BLPPTreeFrame btfNext = {beCurP->nodeHeadP, beCurP,
+                                 WrapPathSum((int64_t) Dir(beP, beCurP) *
+                                             siEvents + beCurP->siEdgeVal)};
+        vTreeStack.push_back(btfNext);
+      }
     }
-  }
 
-  for (std::list<BLPPEdge*>::iterator it = lEdges.begin();
-       it != lEdges.end(); it++) {
-    beCurP = *it;
-    if ((true == beCurP->isChord) /* Chord edges */ && 
-        ((bnCurP == beCurP->nodeHeadP) || (bnCurP == beCurP->nodeTailP))) {
-      /* incident to bnCurP */
-      beCurP->siIncrement = beCurP->siIncrement + Dir(beP, beCurP) * siEvents;
+    /* Chords incident to bnCurP; the graph has no self loops, so each is
+       on one of the two lists
+    */
+    for (uint32_t i = 0; i < 2; i++) {
+      BLPPEdgeRange &lIncident = (0 == i) ? bnCurP->lInEdges : bnCurP->lOutEdges;
+      for (BLPPEdgeRange::iterator it = lIncident.begin();
+           it != lIncident.end(); it++) {
+        beCurP = *it;
+        if (true == beCurP->isChord) {
+          beCurP->siIncrement = WrapPathSum((int64_t) beCurP->siIncrement +
+                                            Dir(beP, beCurP) * siEvents);
+        }
+      }
     }
   }
 
@@ -279,7 +490,7 @@ void BLPP::AssociateAnnotations() {
   while (lWS.size() > 0) {
     bnCurP = lWS.back();
     lWS.pop_back();
-    for (std::list<BLPPEdge*>::iterator 
+    for (BLPPEdgeRange::iterator 
            it = (bnCurP->lOutEdges).begin();
          it != (bnCurP->lOutEdges).end();
          it++) {
@@ -328,7 +539,7 @@ void BLPP::AssociateAnnotations() {
     bnCurP = lWS.back();
     lWS.pop_back();
 
-    for (std::list<BLPPEdge*>::iterator 
+    for (BLPPEdgeRange::iterator 
            it = (bnCurP->lInEdges).begin();
          it != (bnCurP->lInEdges).end();
          it++) {
@@ -371,7 +582,7 @@ void BLPP::AssociateAnnotations() {
   }
 
   /* Register increment code for all other chords */
-  for (std::list<BLPPEdge*>::iterator it = lEdges.begin();
+  for (std::vector<BLPPEdge*>::iterator it = lEdges.begin();
        it != lEdges.end(); it++) {
     beCurP = *it;
     if ((false != beCurP->isChord) && (false == beCurP->isInst) &&
@@ -380,6 +591,7 @@ void BLPP::AssociateAnnotations() {
       beCurP->atKind = PATH_SUM_INCR;
       beCurP->siReset = 0;
     }
+#if 0
     if (beCurP->isInst)
     {
       std::cout << "Edge from " << beCurP->nodeTailP->uiNodeID << " to " << beCurP->nodeHeadP->uiNodeID << ";InstKind: " << beCurP->atKind << ":" << beCurP->siIncrement << ":" <<  beCurP->siReset << ":";
@@ -388,10 +600,195 @@ void BLPP::AssociateAnnotations() {
       else
         std::cout << "Dummy\n";
     }
+#endif
   }
 
 }
 
+/* This function returns a path sum, or an increment of it, as kept in
+   the graph: reduced modulo the hash size for hashed functions.
+*/
+
+signed int BLPP::WrapPathSum(int64_t siPathSum) {
+  if (uiPathFlags & BLPP_FUNC_HASHED) {
+    return (signed int) (siPathSum & (int64_t) uLHashMask);
+  }
+  return (signed int) siPathSum;
+}
+
+/* This function deals with a function whose paths overflowed
+   -blppmaxpaths in AssignEdgeVals. Paths are truncated at merge points
+   (as in Practical Path Profiling) until they fit, unless -blpphashpaths
+   is given or that doesn't help; then path IDs are numbered modulo
+   2^-blpphashbits, which bounds the counters of the function but makes
+   paths sharing an ID indistinguishable.
+
+   Inputs, Return Value:
+     None
+
+   SideEffects:
+     Edge values are reassigned; uiPathFlags is set
+*/
+
+void BLPP::HandlePathOverflow() {
+  if (!bHashPaths && TruncatePaths()) {
+    uiPathFlags = BLPP_FUNC_TRUNCATED;
+    errs() << "BLPP: " << psCurFunc->getName() << ": more than "
+      << uiMaxPaths << " paths; truncated to " << bnEntryP->siNumPaths
+      << "\n";
+    return;
+  }
+  uiPathFlags |= BLPP_FUNC_HASHED;
+  uLHashMask = (1ULL << std::min(30U, (unsigned) uiHashBits)) - 1;
+  AssignEdgeVals(nullptr);
+  bnEntryP->siNumPaths = uLHashMask + 1;
+  errs() << "BLPP: " << psCurFunc->getName() << ": more than "
+    << uiMaxPaths << " paths; path IDs hashed to " << bnEntryP->siNumPaths
+    << " values\n";
+}
+
+/* This function counts the paths from the entry to a node, up to
+   -blppmaxpaths + 1, by a DFS over incoming edges.
+
+   Inputs:
+     bnCurrentP -> Node
+     vPathsTo   -> Counts by node ID, 0 where not counted yet
+
+   Return Value:
+     The count
+*/
+
+uint64_t BLPP::CountPathsTo(BLPPNode *bnCurrentP,
+                            std::vector<uint64_t> &vPathsTo) {
+  if (0 != vPathsTo[bnCurrentP->uiNodeID]) {
+    return vPathsTo[bnCurrentP->uiNodeID];
+  }
+
+  /* The graph is a DAG, so nodes on the stack are never reached again */
+  vPathStack.clear();
+  PushPathFrame(bnCurrentP, bnCurrentP->lInEdges,
+                (bnCurrentP == bnEntryP) ? 1 : 0);
+  while (!vPathStack.empty()) {
+    BLPPPathFrame &bfCurP = vPathStack.back();
+    BLPPNode *bnNodeP = bfCurP.bnNodeP;
+    if (bfCurP.itNext != bnNodeP->lInEdges.end()) {
+      BLPPNode *bnPredP = (*bfCurP.itNext)->nodeTailP;
+      if (0 == vPathsTo[bnPredP->uiNodeID]) {
+        PushPathFrame(bnPredP, bnPredP->lInEdges,
+                      (bnPredP == bnEntryP) ? 1 : 0);
+        continue;
+      }
+      bfCurP.uLNumPaths = std::min(bfCurP.uLNumPaths +
+                                   vPathsTo[bnPredP->uiNodeID],
+                                   (uint64_t) uiMaxPaths + 1);
+      bfCurP.itNext++;
+      continue;
+    }
+    vPathsTo[bnNodeP->uiNodeID] = bfCurP.uLNumPaths;
+    vPathStack.pop_back();
+  }
+  return vPathsTo[bnCurrentP->uiNodeID];
+}
+
+/* This function truncates paths at merge points until the function has at
+   most -blppmaxpaths paths. Each time, the paths are cut at the node where
+   that saves the most paths: a node with m paths reaching it and n paths
+   from it to the exit is on m * n paths, and on m + n once its incoming
+   edges end paths and it starts new ones.
+
+   Input:
+     None
+
+   Return Value:
+     true if the paths fit, false if no cut helps any more
+
+   SideEffects:
+     Edges into the chosen nodes are replaced by dummy edge pairs, and edge
+     values are reassigned
+*/
+
+bool BLPP::TruncatePaths() {
+  while (isPathOverflow) {
+    std::vector<uint64_t> vPathsTo(uiNodeID, 0);
+    BLPPNode *bnCutP = NULL;
+    uint64_t uLBestGain = 0;
+
+    for (std::vector<BLPPNode*>::iterator it = svNodes.begin();
+         it != svNodes.end(); it++) {
+      BLPPNode *bnCurP = *it;
+      bool hasCFGEdge = false;
+      if ((bnCurP == bnEntryP) || (bnCurP == bnExitP) ||
+          (bnCurP->lInEdges.size() < 2)) {
+        continue;
+      }
+      for (BLPPEdgeRange::iterator eit = bnCurP->lInEdges.begin();
+           eit != bnCurP->lInEdges.end(); eit++) {
+        hasCFGEdge |= (NULL == (*eit)->beDummyMatchP);
+      }
+      uint64_t uLTo = CountPathsTo(bnCurP, vPathsTo);
+      uint64_t uLFrom = bnCurP->siNumPaths;
+      uint64_t uLThrough = uLTo * uLFrom;
+      if (hasCFGEdge && (uLThrough > uLTo + uLFrom) &&
+          (uLThrough - (uLTo + uLFrom) > uLBestGain)) {
+        uLBestGain = uLThrough - (uLTo + uLFrom);
+        bnCutP = bnCurP;
+      }
+    }
+    if (NULL == bnCutP) {
+      return false;
+    }
+    CutPathsAt(bnCutP);
+    uiPathFlags |= BLPP_FUNC_TRUNCATED;
+    isPathOverflow = false;
+    AssignEdgeVals(nullptr);
+  }
+  return true;
+}
+
+/* This function makes paths end before a node and start at it, by
+   replacing each CFG edge into it with a pair of dummy edges, as is done
+   for back edges.
+
+   Inputs:
+     bnCutP -> Node
+
+   SideEffects:
+     The CSR edge arrays are rebuilt
+*/
+
+void BLPP::CutPathsAt(BLPPNode *bnCutP) {
+  for (BLPPEdgeRange::iterator it = bnCutP->lInEdges.begin();
+       it != bnCutP->lInEdges.end(); it++) {
+    BLPPEdge *beCurP = *it;
+    if (NULL != beCurP->beDummyMatchP) {
+      continue;
+    }
+    BLPPNode *bnTailP = beCurP->nodeTailP;
+
+    BLPPEdge *beFromEntryP = CreateBLPPEdge(bnEntryP, bnCutP);
+    BLPPEdge *beToExitP = CreateBLPPEdge(bnTailP, bnExitP);
+    beFromEntryP->beDummyMatchP = beToExitP;
+    beToExitP->beDummyMatchP = beFromEntryP;
+    beFromEntryP->uLWeight = beToExitP->uLWeight = beCurP->uLWeight;
+    beFromEntryP->uiSuccNum = beToExitP->uiSuccNum = beCurP->uiSuccNum;
+    lEdges.push_back(beFromEntryP);
+    lEdges.push_back(beToExitP);
+  }
+
+  /* The replaced edges are the CFG edges into the node; they are dropped
+     in one pass, keeping the order of the others
+  */
+  std::vector<BLPPEdge*>::iterator itOut = lEdges.begin();
+  for (std::vector<BLPPEdge*>::iterator it = lEdges.begin();
+       it != lEdges.end(); it++) {
+    if (((*it)->nodeHeadP != bnCutP) || (NULL != (*it)->beDummyMatchP)) {
+      *itOut++ = *it;
+    }
+  }
+  lEdges.erase(itOut, lEdges.end());
+  BuildCSR();
+}
+
 /* This function marks edges with BLPP annotations.
 
    Inputs, Return Value:
@@ -405,11 +802,19 @@ void BLPP::MarkBLPPAnnotations() {
   /* First, assign a unique path number to each path from entry to exit, and 
      assign edge values to compute path ID
   */
+  uiPathFlags = 0;
+  isPathOverflow = false;
   AssignEdgeVals(nullptr);
+  if (isPathOverflow) {
+    HandlePathOverflow();
+  }
+  if (bdbWeightsP && !(uiPathFlags & BLPP_FUNC_HASHED)) {
+    WeighEdgesFromProfile();
+  }
 
   /* For efficient instrumentation: 1.Create an edge from exit to entry */
   BLPPEdge *beBackP;
-  beBackP = new BLPPEdge;
+  beBackP = sArena.Allocate<BLPPEdge>();
   beBackP->nodeHeadP = bnEntryP;
   beBackP->nodeTailP = bnExitP;
   beBackP->beDummyMatchP = NULL; 
@@ -419,11 +824,12 @@ void BLPP::MarkBLPPAnnotations() {
   beBackP->isChord = false;
   beBackP->isReset = false;
   beBackP->siIncrement = 0;
+  beBackP->uLWeight = 0;
+  beBackP->uiSuccNum = 0;
   beBackP->atKind = INVALID;
   
-  (bnExitP->lOutEdges).push_back(beBackP);
-  (bnEntryP->lInEdges).push_back(beBackP);
   lEdges.push_back(beBackP);
+  BuildCSR();
 
   /* 2. spanning tree */
   ChooseST();
@@ -456,6 +862,8 @@ BLPPPath BLPP::RegeneratePath(signed int siPathID) {
     bnTempPathPP = new BLPPNode* [svNodes.size()];
   }
 
+  assert((siPathID >= 0) && ((unsigned int) siPathID < bnEntryP->siNumPaths)
+         && "Path ID out of range");
   /* Start from the initial node */
   bnCurrentP = bnEntryP;
   while (bnCurrentP != bnExitP) 
@@ -465,7 +873,7 @@ BLPPPath BLPP::RegeneratePath(signed int siPathID) {
     */
     signed int siLargestEventNum = -1;
     eNextEdgeP = NULL;
-    for (std::list<BLPPEdge*>::iterator it = 
+    for (BLPPEdgeRange::iterator it = 
            (bnCurrentP->lOutEdges).begin(); 
          it != (bnCurrentP->lOutEdges).end();
          it++)
@@ -495,6 +903,7 @@ BLPPPath BLPP::RegeneratePath(signed int siPathID) {
 
     bnCurrentP = (eNextEdgeP->nodeHeadP);
   } 
+  assert((0 == siPathID) && "Path ID doesn't end at the exit");
   #if 0
   assert(NULL != eNextEdgeP && "null edge before encountering exit node\n");
 
@@ -514,10 +923,223 @@ BLPPPath BLPP::RegeneratePath(signed int siPathID) {
 
 }
 
+/* This function chooses the CFG edges of the current function that count
+   their executions in edge profiles (Knuth). They are the chords of a
+   spanning tree of the CFG itself, with the back edges in place of their
+   dummy edges; the counts of the tree edges follow from them by flow
+   conservation (ComputeEdgeCounts). Edges to the exit node are returns,
+   and the exit->entry edge counts calls. Profiles only hold the counts,
+   so the tree is chosen in CFG order, whatever the edge weights (or
+   -blppstprofile, -blppunweightedst) the profile is read with.
+
+   Inputs:
+     None
+
+   Return Value:
+     The CFG edges, with isChord set for those that count; counter i of an
+     edge profile is that of edge i. They are replaced by the next call.
+
+   Preconditions:
+     MarkBLPPAnnotations has run for the current function
+*/
+std::vector<BLPPEdge*>& BLPP::ChooseEdgeCounters() {
+  std::vector<BLPPEdge*> vEdges;
+
+  vCFGEdges.clear();
+  GetFunctionEdges(vEdges);
+  for (std::vector<BLPPEdge*>::iterator it = vEdges.begin();
+       it != vEdges.end(); it++) {
+    BLPPEdge *beCFGP;
+    if ((*it)->beDummyMatchP && (*it)->nodeHeadP != bnExitP) {
+      /* Entry->header; the back edge is made from the tail->exit edge */
+      continue;
+    }
+    beCFGP = sArena.Allocate<BLPPEdge>();
+    *beCFGP = **it;
+    beCFGP->beDummyMatchP = nullptr;
+    beCFGP->atKind = INVALID;
+    if ((*it)->beDummyMatchP) {
+      beCFGP->nodeHeadP = (*it)->beDummyMatchP->nodeHeadP;
+    }
+    vCFGEdges.push_back(beCFGP);
+  }
+
+  ChooseMaxWeightST(vCFGEdges, false);
+  return vCFGEdges;
+}
+
+/* This function derives the counts of all CFG edges from those of the
+   chords, by flow conservation: a node with one edge of unknown count
+   gives it the difference of its known inflow and outflow.
+
+   Inputs:
+     vCounts -> The counts of the edges of ChooseEdgeCounters; those of the
+                chords are read, the others set
+
+   Preconditions:
+     ChooseEdgeCounters has been called for the current function
+*/
+void BLPP::ComputeEdgeCounts(std::vector<uint64_t> &vCounts) {
+  std::vector<int64_t> vBalance(uiNodeID, 0); /* inflow - outflow, known */
+  std::vector<uint32_t> vUnknown(uiNodeID, 0);
+  std::vector<std::vector<uint32_t> > vIncident(uiNodeID);
+  std::vector<bool> vKnown(vCFGEdges.size());
+  std::vector<uint32_t> vReady;
+
+  vCounts.resize(vCFGEdges.size(), 0);
+  for (uint32_t i = 0; i < vCFGEdges.size(); i++) {
+    uint32_t uiTail = vCFGEdges[i]->nodeTailP->uiNodeID;
+    uint32_t uiHead = vCFGEdges[i]->nodeHeadP->uiNodeID;
+    vKnown[i] = vCFGEdges[i]->isChord;
+    if (vKnown[i]) {
+      vBalance[uiTail] -= vCounts[i];
+      vBalance[uiHead] += vCounts[i];
+    } else {
+      vUnknown[uiTail]++;
+      vUnknown[uiHead]++;
+      vIncident[uiTail].push_back(i);
+      vIncident[uiHead].push_back(i);
+    }
+  }
+  for (uint32_t n = 0; n < uiNodeID; n++) {
+    if (1 == vUnknown[n]) {
+      vReady.push_back(n);
+    }
+  }
+
+  /* The tree edges form a tree, so its leaves can always be solved */
+  while (!vReady.empty()) {
+    uint32_t n = vReady.back(), i = 0;
+    vReady.pop_back();
+    if (1 != vUnknown[n]) {
+      continue;
+    }
+    for (std::vector<uint32_t>::iterator it = vIncident[n].begin();
+         it != vIncident[n].end(); it++) {
+      if (!vKnown[*it]) {
+        i = *it;
+        break;
+      }
+    }
+    uint32_t uiTail = vCFGEdges[i]->nodeTailP->uiNodeID;
+    uint32_t uiHead = vCFGEdges[i]->nodeHeadP->uiNodeID;
+    int64_t siCount = (n == uiTail) ? vBalance[n] : -vBalance[n];
+    assert((siCount >= 0) && "Edge counts don't conserve flow");
+    vCounts[i] = siCount;
+    vKnown[i] = true;
+    vBalance[uiTail] -= siCount;
+    vBalance[uiHead] += siCount;
+    vUnknown[uiTail]--;
+    vUnknown[uiHead]--;
+    if (1 == vUnknown[uiTail]) {
+      vReady.push_back(uiTail);
+    }
+    if (1 == vUnknown[uiHead]) {
+      vReady.push_back(uiHead);
+    }
+  }
+}
+
+/* This function weighs the edges of the current function by how often the
+   paths through them were taken in the profile given by -blppstprofile.
+   Paths are decoded as in RegeneratePath; paths the graph doesn't have
+   (the profile is of another version of the function) are ignored.
+
+   Inputs, Return Value:
+     None
+
+   SideEffects:
+     uLWeight is set for each edge of the current function
+
+   Preconditions:
+     Edge values must have been assigned, and back edges not yet added
+*/
+void BLPP::WeighEdgesFromProfile()
+{
+  std::vector<BLPPEdge*> vEdges;
+  std::vector<PathCount> vPaths;
+
+  GetFunctionEdges(vEdges);
+  for (std::vector<BLPPEdge*>::iterator it = vEdges.begin();
+       it != vEdges.end(); it++)
+    (*it)->uLWeight = 0;
+  if (!bdbWeightsP->was_called(uiFuncID) ||
+      (bdbWeightsP->get_flags(uiFuncID) & BLPP_FUNC_HASHED))
+    return;
+
+  bdbWeightsP->read_paths(uiFuncID, vPaths);
+  for (std::vector<PathCount>::iterator it = vPaths.begin();
+       it != vPaths.end(); it++)
+  {
+    if (it->first >= bnEntryP->siNumPaths)
+      continue;
+    int64_t siPathID = it->first;
+    BLPPNode *bnCurrentP = bnEntryP;
+    while (bnCurrentP != bnExitP)
+    {
+      BLPPEdge *eNextEdgeP = NULL;
+      for (BLPPEdgeRange::iterator eit = bnCurrentP->lOutEdges.begin();
+           eit != bnCurrentP->lOutEdges.end(); eit++)
+      {
+        if (((*eit)->siEdgeVal <= siPathID) &&
+            ((NULL == eNextEdgeP) ||
+             ((*eit)->siEdgeVal > eNextEdgeP->siEdgeVal)))
+          eNextEdgeP = *eit;
+      }
+      if (NULL == eNextEdgeP)
+        break;
+      eNextEdgeP->uLWeight += it->second;
+      siPathID -= eNextEdgeP->siEdgeVal;
+      bnCurrentP = eNextEdgeP->nodeHeadP;
+    }
+  }
+}
+
+/* This function returns the ID BLPPInstrumentation gives a function: its
+   position among the functions defined in its module.
+*/
+uint32_t BLPPWeights::GetFunctionID(Function &f)
+{
+  if (f.getParent() != psIDModule)
+  {
+    uint32_t i = 0;
+    mFunctionIDs.clear();
+    for (Module::iterator it = f.getParent()->begin();
+         it != f.getParent()->end(); it++)
+    {
+      if (!it->isDeclaration())
+        mFunctionIDs[&*it] = i++;
+    }
+    psIDModule = f.getParent();
+  }
+  return mFunctionIDs[&f];
+}
+
+/* This function estimates how often a CFG edge is taken, from the block
+   frequency and branch probability analyses.
+   Inputs:
+     psBB   -> Source of the edge
+     siSucc -> Successor index of the edge, or -1 for the edge to exit
+   Return Value:
+     Estimated frequency, relative to the function entry; 0 if there are
+     no estimates
+*/
+uint64_t BLPP::EstimateEdgeWeight(BasicBlock *psBB, signed int siSucc)
+{
+  if (nullptr == psBFI)
+    return 0;
+  BlockFrequency sFreq = psBFI->getBlockFreq(psBB);
+  if (siSucc >= 0)
+    sFreq *= psBPI->getEdgeProbability(psBB, (unsigned) siSucc);
+  return sFreq.getFrequency();
+}
+
 BLPPNode* BLPP::CreateBLPPNode(BasicBlock *psBB, uint32_t uiNodeID)
 {
-  BLPPNode *psBLPPNode = new BLPPNode;
+  BLPPNode *psBLPPNode = sArena.Allocate<BLPPNode>();
   psBLPPNode->isVisited = false;
+  psBLPPNode->lOutEdges.beBeginPP = psBLPPNode->lOutEdges.beEndPP = nullptr;
+  psBLPPNode->lInEdges.beBeginPP = psBLPPNode->lInEdges.beEndPP = nullptr;
   psBLPPNode->siNumPaths = 0;
   psBLPPNode->uiNodeID = uiNodeID;
   psBLPPNode->vNodeDataP = psBB;
@@ -526,27 +1148,83 @@ BLPPNode* BLPP::CreateBLPPNode(BasicBlock *psBB, uint32_t uiNodeID)
 
 BLPPEdge* BLPP::CreateBLPPEdge(BLPPNode *psTail, BLPPNode *psHead)
 {
-  BLPPEdge *psEdge = new BLPPEdge;
+  BLPPEdge *psEdge = sArena.Allocate<BLPPEdge>();
   psEdge->nodeHeadP = psHead;
   psEdge->nodeTailP = psTail;
   psEdge->siEdgeVal = psEdge->siIncrement = psEdge->siReset = 0;
+  psEdge->uLWeight = 0;
+  psEdge->uiSuccNum = 0;
   psEdge->isChord = psEdge->isInst = psEdge->isReset = false;
   psEdge->atKind = INVALID;
-  psHead->lInEdges.push_back(psEdge);
-  psTail->lOutEdges.push_back(psEdge);
   psEdge->beDummyMatchP = nullptr;
+#if 0
   std::cout << "Edge from " << psTail->uiNodeID << " to " << psHead->uiNodeID
     << "\n";
+#endif
   return psEdge;
 }
 
+/* This function lays out the edges of the current function in two CSR
+   arrays, grouped by tail and by head node ID, and points the edge ranges
+   of its nodes into them. Edges keep the order of lEdges within a node, as
+   the path numbering depends on it. The arrays are refilled in place, and
+   only replaced (from the arena) when the graph has outgrown them, so the
+   ranges of earlier graphs of the function do not stay valid.
 
+   Inputs, Return Value:
+     None
 
-void BLPP::CreateBLPPGraph(BasicBlock *psCurNode)
+   SideEffects:
+     lOutEdges and lInEdges are set for each node of the current function
+*/
+void BLPP::BuildCSR()
+{
+  uint32_t uiNumEdges = lEdges.size();
+  /* Each cut adds edges; doubling keeps the arrays of a series of cuts */
+  if (uiNumEdges > uiCSRSize) {
+    uiCSRSize = std::max(uiNumEdges, 2 * uiCSRSize);
+    beOutPP = sArena.Allocate<BLPPEdge*>(uiCSRSize);
+    beInPP = sArena.Allocate<BLPPEdge*>(uiCSRSize);
+  }
+  std::vector<uint32_t> vOutStart(uiNodeID + 1, 0), vInStart(uiNodeID + 1, 0);
+
+  for (std::vector<BLPPEdge*>::iterator it = lEdges.begin();
+       it != lEdges.end(); it++)
+  {
+    vOutStart[(*it)->nodeTailP->uiNodeID + 1]++;
+    vInStart[(*it)->nodeHeadP->uiNodeID + 1]++;
+  }
+  for (uint32_t i = 0; i < uiNodeID; i++)
+  {
+    vOutStart[i + 1] += vOutStart[i];
+    vInStart[i + 1] += vInStart[i];
+  }
+  for (std::vector<BLPPNode*>::iterator it = svNodes.begin();
+       it != svNodes.end(); it++)
+  {
+    uint32_t i = (*it)->uiNodeID;
+    (*it)->lOutEdges.beBeginPP = (*it)->lOutEdges.beEndPP =
+      beOutPP + vOutStart[i];
+    (*it)->lInEdges.beBeginPP = (*it)->lInEdges.beEndPP = beInPP + vInStart[i];
+  }
+  for (std::vector<BLPPEdge*>::iterator it = lEdges.begin();
+       it != lEdges.end(); it++)
+  {
+    *(*it)->nodeTailP->lOutEdges.beEndPP++ = *it;
+    *(*it)->nodeHeadP->lInEdges.beEndPP++ = *it;
+  }
+}
+
+/* This function creates the node of a block when CreateBLPPGraph first
+   reaches it, and pushes it on the DFS stack.
+*/
+void BLPP::EnterBLPPNode(BasicBlock *psCurNode)
 {
   /* Assign an id for this node */
+#if 0
   std::cout << "uiNodeID:" << uiNodeID <<"\n";
     psCurNode->dump();
+#endif
   BLPPNode *psBLPPNode = CreateBLPPNode(psCurNode, uiNodeID++);
   mBBToBLPPNode[psCurNode] = psBLPPNode;
   svNodes.push_back(psBLPPNode);
@@ -558,74 +1236,261 @@ void BLPP::CreateBLPPGraph(BasicBlock *psCurNode)
     svNodes.push_back(bnExitP);
   }
 
-  TerminatorInst *psTermInst = psCurNode->getTerminator();
-  switch (psTermInst->getOpcode())
+  switch (psCurNode->getTerminator()->getOpcode())
   {
     case Instruction::Ret:
+    case Instruction::Br:
+    case Instruction::Switch:
+      break;
+    default:
+    {
+      assert(0 && "Unhandled terminator instruction");
+    }
+  }
+  BLPPBuildFrame bbfNew = {psCurNode, psBLPPNode, 0};
+  vBuildStack.push_back(bbfNew);
+}
+
+/* This function creates the BLPP graph of the current function, by a DFS
+   of its CFG from psCurNode. Nodes are numbered in preorder, and the edges
+   out of a block are created in successor order, each once the DFS has
+   returned from its head. The DFS keeps its own stack, so that large
+   functions don't overflow the native one.
+*/
+void BLPP::CreateBLPPGraph(BasicBlock *psCurNode)
+{
+  vBuildStack.clear();
+  EnterBLPPNode(psCurNode);
+  while (!vBuildStack.empty())
+  {
+    BLPPBuildFrame &bbfCur = vBuildStack.back();
+    psCurNode = bbfCur.psBB;
+    BLPPNode *psCurBLPPNode = bbfCur.bnNodeP;
+    TerminatorInst *psTermInst = psCurNode->getTerminator();
+    if (Instruction::Ret == psTermInst->getOpcode())
     {
       assert(0 == psTermInst->getNumSuccessors());
-      BLPPEdge *psEdge = CreateBLPPEdge(mBBToBLPPNode[psCurNode], bnExitP);
+      BLPPEdge *psEdge = CreateBLPPEdge(psCurBLPPNode, bnExitP);
+      psEdge->uLWeight = EstimateEdgeWeight(psCurNode, -1);
       lEdges.push_back(psEdge);
-      break;
+      vBuildStack.pop_back();
+      continue;
     }
-    case Instruction::Br:
+    if (bbfCur.uiNextSucc == psTermInst->getNumSuccessors())
     {
-      for (uint32_t i = 0, uiNSucc = psTermInst->getNumSuccessors(); 
-        i < uiNSucc; i++)
-      {
-        BasicBlock *psSucc = psTermInst->getSuccessor(i);
-        if (mBBToBLPPNode.find(psSucc) == mBBToBLPPNode.end())
-          CreateBLPPGraph(psSucc);
-        if (sDT.dominates(psSucc, psCurNode))
-        {
-          /* Create dummy edges */
-          BLPPEdge *psFromEntry = CreateBLPPEdge(bnEntryP, mBBToBLPPNode[psSucc]);
-          BLPPEdge *psToExit = CreateBLPPEdge(mBBToBLPPNode[psCurNode], bnExitP);
-          psFromEntry->beDummyMatchP = psToExit;
-          psToExit->beDummyMatchP = psFromEntry;
-          lEdges.push_back(psFromEntry);
-          lEdges.push_back(psToExit);
-        }
-        else
-        {
-          BLPPEdge *psEdge = CreateBLPPEdge(mBBToBLPPNode[psCurNode], 
-            mBBToBLPPNode[psSucc]);
-          lEdges.push_back(psEdge);
-        }
-      }
-      break;
+      vBuildStack.pop_back();
+      continue;
     }
-    default:
+
+    uint32_t i = bbfCur.uiNextSucc;
+    BasicBlock *psSucc = psTermInst->getSuccessor(i);
+    MapBBToBLPPNode::iterator itSucc = mBBToBLPPNode.find(psSucc);
+    if (itSucc == mBBToBLPPNode.end())
     {
-      assert(0 && "Unhandled terminator instruction");
+      /* Come back to this successor once its subgraph is done */
+      EnterBLPPNode(psSucc);
+      continue;
+    }
+    bbfCur.uiNextSucc++;
+    uint64_t uLWeight = EstimateEdgeWeight(psCurNode, i);
+    if (sDT.dominates(psSucc, psCurNode))
+    {
+      /* Create dummy edges */
+      BLPPEdge *psFromEntry = CreateBLPPEdge(bnEntryP, itSucc->second);
+      BLPPEdge *psToExit = CreateBLPPEdge(psCurBLPPNode, bnExitP);
+      psFromEntry->beDummyMatchP = psToExit;
+      psToExit->beDummyMatchP = psFromEntry;
+      psFromEntry->uLWeight = psToExit->uLWeight = uLWeight;
+      psFromEntry->uiSuccNum = psToExit->uiSuccNum = i;
+      lEdges.push_back(psFromEntry);
+      lEdges.push_back(psToExit);
+    }
+    else
+    {
+      BLPPEdge *psEdge = CreateBLPPEdge(psCurBLPPNode, itSucc->second);
+      psEdge->uLWeight = uLWeight;
+      psEdge->uiSuccNum = i;
+      lEdges.push_back(psEdge);
     }
   }
 }
 
 
-bool BLPP::runOnFunction(Function &func)
+/* This constructor computes the BLPP graph of a function.
+   Inputs:
+     f           -> Function
+     psBFI       -> Block frequencies to weigh edges by, or nullptr
+     psBPI       -> Branch probabilities, given with psBFI
+     bdbWeightsP -> Profile to weigh edges by instead (-blppstprofile), or
+                    nullptr
+     uiFuncID    -> The function's ID in bdbWeightsP
+*/
+BLPP::BLPP(Function &f, BlockFrequencyInfo *psBFI,
+           BranchProbabilityInfo *psBPI, BLPPDB *bdbWeightsP,
+           uint32_t uiFuncID) :
+  bnTempPathPP(nullptr), beOutPP(nullptr), beInPP(nullptr), uiCSRSize(0),
+  psCurFunc(&f), psBFI(psBFI), psBPI(psBPI),
+  bdbWeightsP(bdbWeightsP), uiFuncID(uiFuncID), isPathOverflow(false),
+  uiPathFlags(0), uLHashMask(0)
 {
-  psCurFunc = &func;
   DominatorTreeAnalysis sDTA;
-  sDT = sDTA.run(func);
+  sDT = sDTA.run(f);
   uiNodeID = 0;
-  CreateBLPPGraph(&(func.getEntryBlock()));
+  /* The DFS stacks hold at most a frame per node */
+  vBuildStack.reserve(f.size());
+  vPathStack.reserve(f.size() + 1);
+  vTreeStack.reserve(f.size() + 1);
+  CreateBLPPGraph(&(f.getEntryBlock()));
+  BuildCSR();
   MarkBLPPAnnotations();
-  return false;
 }
 
 BLPP::~BLPP()
 {
-  for (std::vector<BLPPNode*>::iterator it = svNodes.begin(); it != svNodes.end();
-    it++)
+  /* The graph is freed with sArena */
+  if (bnTempPathPP)
+    delete [] bnTempPathPP;
+}
+
+/* This function says whether graphs are weighed by static estimates, which
+   their builders must then be given.
+*/
+bool BLPPWeights::NeedsEstimates()
+{
+  return sSTProfile.empty() && (!bUnweightedST || bSTReport);
+}
+
+/* This function computes the BLPP graph of a function, weighed by
+   -blppstprofile if given.
+   Inputs:
+     f     -> Function
+     psBFI -> Block frequencies, if NeedsEstimates(); nullptr otherwise
+     psBPI -> Branch probabilities, given with psBFI
+   Return Value:
+     The graph, owned by the caller
+*/
+BLPP* BLPPWeights::BuildGraph(Function &f, BlockFrequencyInfo *psBFI,
+                              BranchProbabilityInfo *psBPI)
+{
+  if (!sSTProfile.empty() && (nullptr == bdbWeightsP))
+    bdbWeightsP = new BLPPDB(sSTProfile.c_str());
+  return new BLPP(f, psBFI, psBPI, bdbWeightsP,
+                  bdbWeightsP ? GetFunctionID(f) : 0);
+}
+
+BLPPWeights::~BLPPWeights()
+{
+  delete bdbWeightsP;
+}
+
+bool BLPPWrapperPass::runOnFunction(Function &func)
+{
+  BlockFrequencyInfo *psBFI = nullptr;
+  BranchProbabilityInfo *psBPI = nullptr;
+
+  releaseMemory();
+  if (BLPPWeights::NeedsEstimates())
   {
-    delete *it;
+    psBFI = &getAnalysis<BlockFrequencyInfo>();
+    psBPI = &getAnalysis<BranchProbabilityInfo>();
   }
-  for (std::list<BLPPEdge*>::iterator it = lEdges.begin(); it != lEdges.end();
-    it++)
+  bpGraphP = sWeights.BuildGraph(func, psBFI, psBPI);
+  return false;
+}
+
+void BLPPWrapperPass::getAnalysisUsage(AnalysisUsage &AU) const
+{
+  if (BLPPWeights::NeedsEstimates())
   {
-    delete *it;
+    AU.addRequired<BlockFrequencyInfo>();
+    AU.addRequired<BranchProbabilityInfo>();
   }
-  if (bnTempPathPP)
-    delete [] bnTempPathPP;
+  AU.setPreservesAll();
+}
+
+/* Frees the graph of the function the pass last ran on */
+void BLPPWrapperPass::releaseMemory()
+{
+  delete bpGraphP;
+  bpGraphP = nullptr;
+}
+
+BLPPWrapperPass::~BLPPWrapperPass()
+{
+  releaseMemory();
+}
+
+namespace {
+/* The pass BLPPEstimator runs after the estimates, which hands them to
+   the estimator's caller
+*/
+class BLPPEstimatePass : public FunctionPass {
+ public:
+  const BLPPEstimator::EstimateUser *pfnUser;
+  BLPPEstimatePass() : FunctionPass(ID), pfnUser(nullptr) {};
+  virtual bool runOnFunction(Function &f)
+  {
+    (*pfnUser)(getAnalysis<BlockFrequencyInfo>(),
+               getAnalysis<BranchProbabilityInfo>());
+    return false;
+  }
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const
+  {
+    AU.addRequired<BlockFrequencyInfo>();
+    AU.addRequired<BranchProbabilityInfo>();
+    AU.setPreservesAll();
+  }
+  static char ID;
+};
+}
+char BLPPEstimatePass::ID = 0;
+
+/* This function computes the static estimates of a function, and calls
+   back with them. The pass manager computing them is kept for the next
+   function of the same module.
+   Inputs:
+     f      -> Function
+     fnUser -> Called with its block frequencies and branch probabilities,
+               which are freed when it returns
+*/
+void BLPPEstimator::Run(Function &f, const EstimateUser &fnUser)
+{
+  if (f.getParent() != psModule)
+  {
+    delete psFPM;
+    psFPM = new legacy::FunctionPassManager(f.getParent());
+    psEstimatePass = new BLPPEstimatePass();
+    psFPM->add(psEstimatePass);
+    psFPM->doInitialization();
+    psModule = f.getParent();
+  }
+  static_cast<BLPPEstimatePass*>(psEstimatePass)->pfnUser = &fnUser;
+  psFPM->run(f);
+}
+
+BLPPEstimator::~BLPPEstimator()
+{
+  /* The pass manager owns the pass */
+  delete psFPM;
+}
+
+/* This function computes the BLPP graph of a function. It doesn't take
+   the AnalysisManager, as none of its analyses are used: the estimates
+   come from BLPPEstimator.
+   Inputs:
+     f -> Function
+   Return Value:
+     The graph, owned by the result
+*/
+BLPPAnalysis::Result BLPPAnalysis::run(Function &f)
+{
+  BLPP *bpGraphP = nullptr;
+
+  if (!BLPPWeights::NeedsEstimates())
+    return Result(psWeights->BuildGraph(f, nullptr, nullptr));
+  psEstimator->Run(f, [&](BlockFrequencyInfo &sBFI,
+                          BranchProbabilityInfo &sBPI) {
+    bpGraphP = psWeights->BuildGraph(f, &sBFI, &sBPI);
+  });
+  return Result(bpGraphP);
 }
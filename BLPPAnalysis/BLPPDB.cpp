@@ -1,7 +1,11 @@
 #include "llvm/Analysis/BLPPDB.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
 #define DEBUG_BDB 1
 
+/* Index entries made from the headers of v1 profiles */
+#define BLPPDB_ENC_V1 ((uint32_t) BLPP_ENC_MASK)
+
 using namespace llvm;
 static cl::opt<std::string>
   sProfileData("blppdata", cl::value_desc("filename"),
@@ -14,23 +18,45 @@ BLPPDB::BLPPDB() : FunctionPass(ID) {
   init(sProfileData.c_str());
 }
 
+BLPPDB::BLPPDB(const char *fDBNameP) : FunctionPass(ID) {
+  uiFnID = 0;
+  init(fDBNameP);
+}
+
 /* This function initializes the database. It reads the header of the
-	 path profile and stores it in bhP, and avoids the need to call
+	 path profile and stores it in bfiP, and avoids the need to call
 	 fseek each time context is set to find the offset in the profile
 	 where information about the paths of a particular function is
-	 stored.
+	 stored. Both v1 and v2 profiles are accepted.
 	 Inputs:
 	 fDBNameP -> The database file.
 	 Return Value:
 	 None
 */
 void BLPPDB::init(const char *fDBNameP) {
+	BLPPProfHdr bph;
 	BLPPDBHdr hdr;
+	BLPPDBHdr *bhP;
+	BLPPSampleTrailer bst;
+	unsigned int i;
 
 	fDBP = fopen(fDBNameP, "rb");
 	assert(NULL != fDBP && "Can't open Path Profile");
 
 	uiCurFnID = 0;
+	uiSampleRate = 1;
+	fseek(fDBP, 0, SEEK_SET);
+	if ((1 == fread(&bph, sizeof(bph), 1, fDBP)) &&
+			(BLPP_PROF_MAGIC == bph.uiMagic)) {
+		assert((BLPP_PROF_VERSION == bph.uiVersion) && "Unknown profile version");
+		uiNumFuncs = bph.uiNumFuncs;
+		uiSampleRate = bph.uiSampleRate;
+		bfiP = new BLPPFuncIndex[uiNumFuncs];
+		fseek(fDBP, bph.uiHdrSize, SEEK_SET);
+		fread(bfiP, sizeof(BLPPFuncIndex), uiNumFuncs, fDBP);
+		return;
+	}
+
 	fseek(fDBP, 0, SEEK_SET);
 	fread(&hdr, BLPPDB_HDR_SIZE, 1, fDBP);
 	uiNumFuncs = (hdr.uiOffset / sizeof(hdr));
@@ -40,9 +66,84 @@ void BLPPDB::init(const char *fDBNameP) {
 	fread(bhP, BLPPDB_HDR_SIZE, uiNumFuncs, fDBP);
 
 	uiNumFuncs--; /* since the last entry is actually a dummy entry */
+	bfiP = new BLPPFuncIndex[uiNumFuncs];
+	for (i = 0; i < uiNumFuncs; i++) {
+		bfiP[i].uLOffset = bhP[i].uiOffset;
+		bfiP[i].uLSize = bhP[i].uiNumPaths * sizeof(BLPPProfInfo);
+		bfiP[i].uiNumPaths = bhP[i].uiNumPaths;
+		bfiP[i].uiEncoding = BLPPDB_ENC_V1;
+	}
+	delete [] bhP;
+
+	/* v1 profiles of sampled builds end with their sampling rate */
+	if ((0 == fseek(fDBP, -(long) sizeof(bst), SEEK_END)) &&
+			(1 == fread(&bst, sizeof(bst), 1, fDBP)) &&
+			(BLPP_SAMPLE_MAGIC == bst.uiMagic) && (bst.uiSampleRate > 1)) {
+		uiSampleRate = bst.uiSampleRate;
+	}
 	
 }
 
+void BLPPDB::read_paths(unsigned int uiFID, std::vector<PathCount> &vPaths) {
+	BLPPFuncIndex &bfi = bfiP[uiFID];
+	std::vector<uint8_t> vBuf(bfi.uLSize);
+	const uint8_t *pucP, *pucEnd;
+	uint64_t uLPathID = 0, uLDelta, uLCount;
+	uint32_t uiRate = blpp_func_rate(get_flags(uiFID), uiSampleRate);
+	unsigned int i;
+
+	vPaths.clear();
+	if (0 == bfi.uLSize) {
+		return;
+	}
+	fseek(fDBP, bfi.uLOffset, SEEK_SET);
+	if (1 != fread(&vBuf[0], bfi.uLSize, 1, fDBP)) {
+		assert(0 && "Truncated path profile");
+		return;
+	}
+
+	switch (bfi.uiEncoding & BLPP_ENC_MASK) {
+	case BLPPDB_ENC_V1:
+		for (i = 0; i < bfi.uiNumPaths; i++) {
+			BLPPProfInfo *bpP = (BLPPProfInfo*) &vBuf[i * sizeof(BLPPProfInfo)];
+			/* Memory mapped profiles (-blppmmap) have a record for every path,
+				 executed or not
+			*/
+			if (bpP->uiExecCount) {
+				vPaths.push_back(PathCount(bpP->uLPathID, bpP->uiExecCount));
+			}
+		}
+		break;
+	case BLPP_ENC_DENSE:
+		for (i = 0; i < bfi.uiNumPaths; i++) {
+			uLCount = ((uint64_t*) &vBuf[0])[i];
+			if (uLCount) {
+				vPaths.push_back(PathCount(i, uLCount));
+			}
+		}
+		break;
+	case BLPP_ENC_VARINT:
+		pucP = &vBuf[0];
+		pucEnd = pucP + vBuf.size();
+		for (i = 0; (i < bfi.uiNumPaths) && (NULL != pucP); i++) {
+			pucP = blpp_get_varint(pucP, pucEnd, &uLDelta);
+			if (NULL != pucP) {
+				pucP = blpp_get_varint(pucP, pucEnd, &uLCount);
+			}
+			assert((NULL != pucP) && "Corrupt path profile");
+			uLPathID += uLDelta;
+			vPaths.push_back(PathCount(uLPathID, uLCount));
+		}
+		break;
+	default:
+		assert(0 && "Unknown path encoding");
+	}
+
+	for (i = 0; i < vPaths.size(); i++) {
+		vPaths[i].second *= uiRate;
+	}
+}
+
 	/* This function returns 1 iff the input function was ever executed in
 		 the profile run. Otherwise it returns 0.
 		 Inputs:
@@ -54,9 +155,16 @@ void BLPPDB::init(const char *fDBNameP) {
 		   None
 	*/
 
+uint32_t BLPPDB::get_flags(unsigned int uiFnID) {
+	if (uiFnID >= uiNumFuncs) {
+		return 0;
+	}
+	return bfiP[uiFnID].uiEncoding & ~BLPP_ENC_MASK;
+}
+
 unsigned int BLPPDB::was_called (unsigned int uiFnID) {
 	unsigned int uiRetVal;
-	if ( (uiFnID >= uiNumFuncs) || (0 == bhP[uiFnID].uiNumPaths) ) {
+	if ( (uiFnID >= uiNumFuncs) || (0 == bfiP[uiFnID].uiNumPaths) ) {
 		uiRetVal = 0;
 	} else {
 		uiRetVal = 1;
@@ -77,11 +185,24 @@ void BLPPDB::set_context(unsigned int uiFID)
 }
 
 bool BLPPDB::runOnFunction(Function &sCurFun) {
+	read_function(sCurFun, getAnalysis<BLPPWrapperPass>().getBLPP());
+	return false;
+}
+
+/* This function reads the paths of the next function of the profile. It
+	 regenerates each path with the function's BLPP graph, and counts the
+	 blocks and edges it takes.
+	 Inputs:
+	 sCurFun -> The function
+	 bp      -> Its BLPP graph
+	 Return Value:
+	 None
+*/
+void BLPPDB::read_function(Function &sCurFun, BLPP &bp) {
 	/* Index into the header to find where the information for the 
 		 function starts
 	*/
-	BLPPDBHdr hdr;
-	BLPPProfInfo profInfo;
+	std::vector<PathCount> vPaths;
 	AnnotatedPath apWithFreq;
 	unsigned int i;
 	char *scHashKeyP = new char[BLPPDB_MAX_KEY_LEN];
@@ -91,34 +212,68 @@ bool BLPPDB::runOnFunction(Function &sCurFun) {
 	#endif
 
 
-	/* Initialize the BLPP Path Regenerator */
-  BLPP &bp = getAnalysis<BLPP>();
-
-	lSuccessorFreqP = new std::list<EdgeFreq> [sCurFun.size()];
+	/* Node IDs include the exit node */
+	lSuccessorFreqP = new std::list<EdgeFreq> [sCurFun.size() + 1];
 	
 	if (uiFnID < uiNumFuncs) {
 
-		hdr = bhP[uiFnID];
-		printf("Function ID: %d %d\n", hdr.uiFunctionID, uiFnID);
-		printf("Offset in file: %d\n", hdr.uiOffset);
-		printf("Number of paths: %d\n", hdr.uiNumPaths);
+		printf("Function ID: %d\n", uiFnID);
+		printf("Offset in file: %lu\n", (unsigned long) bfiP[uiFnID].uLOffset);
+		printf("Number of paths: %d\n", bfiP[uiFnID].uiNumPaths);
 		
 		/* Now index into the function info */
-		fseek(fDBP, hdr.uiOffset, SEEK_SET);
+		read_paths(uiFnID, vPaths);
+		if (get_flags(uiFnID) & BLPP_FUNC_HASHED) {
+			/* Path IDs were reduced modulo the hash size, and can't be decoded */
+			printf("Path IDs hashed; not decoded\n");
+			vPaths.clear();
+		}
 		
-		uiNodeFrequencyP = new uint32_t[sCurFun.size()];
-		for (i = 0; i < sCurFun.size(); i++) {
-			uiNodeFrequencyP[i] = 0;
+		uLNodeFrequencyP = new uint64_t[sCurFun.size() + 1];
+		for (i = 0; i <= sCurFun.size(); i++) {
+			uLNodeFrequencyP[i] = 0;
+		}
+
+		if (BLPP_STRATEGY_EDGE ==
+				(get_flags(uiFnID) & BLPP_FUNC_STRATEGY_MASK)) {
+			/* Edge profile: the counted edges give the counts of the others */
+			std::vector<BLPPEdge*> &vEdges = bp.ChooseEdgeCounters();
+			std::vector<uint64_t> vCounts(vEdges.size(), 0);
+
+			for (i = 0; i < vPaths.size(); i++) {
+				/* Only chords are counted; other counters are of another CFG */
+				if ((vPaths[i].first >= vEdges.size()) ||
+						!vEdges[vPaths[i].first]->isChord) {
+					report_fatal_error(Twine("BLPP: edge profile of ") +
+														 sCurFun.getName() +
+														 " doesn't match its CFG");
+				}
+				vCounts[vPaths[i].first] = vPaths[i].second;
+			}
+			bp.ComputeEdgeCounts(vCounts);
+			for (i = 0; i < vEdges.size(); i++) {
+				BLPPNode *bnTailP = vEdges[i]->nodeTailP;
+				BLPPNode *bnHeadP = vEdges[i]->nodeHeadP;
+				if (bnTailP == bp.bnExitP) {
+					continue;
+				}
+				uLNodeFrequencyP[bnTailP->uiNodeID] += vCounts[i];
+				if (bnHeadP != bp.bnExitP) {
+					increment_edge_frequency(bnTailP->uiNodeID, bnHeadP->uiNodeID,
+																	 vCounts[i]);
+				}
+			}
+			vPaths.clear();
 		}
 
 		/* Do for each path */
-		for (i = 0; i < hdr.uiNumPaths; i++) {
+		for (i = 0; i < vPaths.size(); i++) {
 			std::map<std::string, std::list<AnnotatedPath> >::iterator it;
-			fread(&profInfo, sizeof(BLPPProfInfo), 1, fDBP);
+			uint64_t uLPathID = vPaths[i].first, uLExecCount = vPaths[i].second;
 			
 			/* Regenerate the path */
-			apWithFreq.bPath = bp.RegeneratePath(profInfo.uLPathID);
-			apWithFreq.flExecFreq = profInfo.uiExecCount;
+			apWithFreq.bPath = bp.RegeneratePath(uLPathID);
+			apWithFreq.flExecFreq = uLExecCount;
 
 #if 0
 			if ((unsigned int) -1 != uiBackEdgeTarget) {
@@ -127,25 +282,25 @@ bool BLPPDB::runOnFunction(Function &sCurFun) {
 				*/
 				increment_edge_frequency
 					(apWithFreq.bPath.uiVerticesP[apWithFreq.bPath.uiNumNodes - 1],
-					 uiBackEdgeTarget, profInfo.uiExecCount);
+					 uiBackEdgeTarget, uLExecCount);
 			}
 #endif
 			
 #if DEBUG_BDB
-			printf("Path ID: %lu;", profInfo.uLPathID);
+			printf("Path ID: %lu;", uLPathID);
 #endif
 
 			for (j = 0; j < apWithFreq.bPath.uiNumNodes; j++) {
 
 				/* One point for v[j] in the path */
-				uiNodeFrequencyP[apWithFreq.bPath.bnPP[j]->uiNodeID] += 
-					profInfo.uiExecCount;
+				uLNodeFrequencyP[apWithFreq.bPath.bnPP[j]->uiNodeID] += 
+					uLExecCount;
 
 				if (j != 0) {
 					/* One point for edge v[j-1] to v[j] */
 					increment_edge_frequency(apWithFreq.bPath.bnPP[j-1]->uiNodeID,
 																	 apWithFreq.bPath.bnPP[j]->uiNodeID,
-																	 profInfo.uiExecCount);
+																	 uLExecCount);
 				}
 
 #if DEBUG_BDB
@@ -185,7 +340,6 @@ bool BLPPDB::runOnFunction(Function &sCurFun) {
 	}
 
   uiFnID++;
-  return false;
 	/*bp.clean_context();*/ /* We have got all the information needed - Path,
 												 Edge and Block Profile.
 											*/
@@ -283,8 +437,8 @@ BLPPDB::get_hot_paths(unsigned int uiSrcNode,
 		   The last set_context call must have been for the function in which
 			 the basic block is present. That context should not have been cleared.
 	*/
-uint32_t BLPPDB::get_block_frequency (unsigned int uiNode) {
-	return uiNodeFrequencyP[uiNode];
+uint64_t BLPPDB::get_block_frequency (unsigned int uiNode) {
+	return uLNodeFrequencyP[uiNode];
 }
 
 	/* This function returns the number of times, the specified edge was 
@@ -298,20 +452,20 @@ uint32_t BLPPDB::get_block_frequency (unsigned int uiNode) {
 		   The last set_context call must have been for the function in which
 			 the basic block is present. That context should not have been cleared.
 	*/
-	uint32_t BLPPDB::get_edge_frequency(unsigned int uiSrcNode, 
+	uint64_t BLPPDB::get_edge_frequency(unsigned int uiSrcNode, 
 																			unsigned int uiTargetNode) {
 
 		/* Initialize to 0 incase the edge was never executed */
-		uint32_t uiFreq = 0;
+		uint64_t uLFreq = 0;
 
 		for (std::list<EdgeFreq>::iterator it = 
 					 lSuccessorFreqP[uiSrcNode].begin(); it != lSuccessorFreqP[uiSrcNode].end();
 				 it++) {
 			if ((*it).uiTarget == uiTargetNode) {
-				uiFreq = (*it).uiFreq;
+				uLFreq = (*it).uLFreq;
 			}
 		}
-		return uiFreq;
+		return uLFreq;
 	}
 
 
@@ -340,7 +494,7 @@ void BLPPDB::clean_context() {
 	}
 
 	ht.clear();
-	delete [] uiNodeFrequencyP;
+	delete [] uLNodeFrequencyP;
 	delete [] lSuccessorFreqP;
 }
 
@@ -348,14 +502,14 @@ void BLPPDB::clean_context() {
 		 Inputs:
 		   uiSrc       -> Source node of the edge
 			 uiTarget    -> Target node 
-			 uiCount     -> By how much to increment 
+			 uLCount     -> By how much to increment 
 		 Return Value:
 		   None
 		 Side Effects:
 		   Increments the edge frequency of the edge (lSuccessorFreqP)
 	*/
  void BLPPDB::increment_edge_frequency(unsigned int uiSrc, unsigned int uiTarget,
-															 unsigned int uiCount) {
+															 uint64_t uLCount) {
 	/* Index into the source */
 	unsigned int uiFound = 0;
 
@@ -364,7 +518,7 @@ void BLPPDB::clean_context() {
 			 it++) {
 		if ((*it).uiTarget == uiTarget) {
 			uiFound = 1;
-			(*it).uiFreq = (*it).uiFreq + uiCount;
+			(*it).uLFreq = (*it).uLFreq + uLCount;
 		}
 	}
 
@@ -372,7 +526,7 @@ void BLPPDB::clean_context() {
 		/* First time this edge is taken. Initialize! */
 		EdgeFreq efTemp;
 		efTemp.uiTarget = uiTarget;
-		efTemp.uiFreq = uiCount;
+		efTemp.uLFreq = uLCount;
 		lSuccessorFreqP[uiSrc].push_back(efTemp);
 	}
 }
@@ -380,10 +534,16 @@ void BLPPDB::clean_context() {
 
 
 BLPPDB::~BLPPDB() {
-	delete [] bhP;
+	delete [] bfiP;
 	fclose(fDBP);
 }
 
 char BLPPDB::ID = 0;
 static RegisterPass<BLPPDB> BLPPDBRegistration("blpp_db", "analyze path profile");
 
+char BLPPDBAnalysis::PassID;
+
+BLPPDBAnalysis::Result BLPPDBAnalysis::run(Module &m) {
+	return Result(new BLPPDB());
+}
+
@@ -0,0 +1,122 @@
+/* This program times the BLPP analysis on synthetic CFGs of 10^3 to 10^6
+   edges, to see how its time per edge changes with the size of a function.
+   The CFGs are trees of switches, as in large machine-generated functions:
+   each switch has width cases, and depth levels of switches lead to a
+   common return block, so a function has about width^depth paths.
+
+   Usage: BLPPGraphBench [BLPP options, e.g. -blppunweightedst]
+*/
+#include "llvm/Analysis/BLPP.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace llvm;
+
+static double elapsed(const struct timespec &tsStart) {
+  struct timespec tsEnd;
+  clock_gettime(CLOCK_MONOTONIC, &tsEnd);
+  return (tsEnd.tv_sec - tsStart.tv_sec) +
+    (tsEnd.tv_nsec - tsStart.tv_nsec) * 1e-9;
+}
+
+/* This function fills psBB with a switch tree of the given depth, whose
+   leaves branch to psJoin.
+   Return Value:
+     The number of CFG edges added
+*/
+static uint64_t make_switch_tree(BasicBlock *psBB, BasicBlock *psJoin,
+                                 Value *psCond, uint32_t uiWidth,
+                                 uint32_t uiDepth) {
+  IRBuilder<> sBuilder(psBB);
+  uint64_t uLEdges;
+
+  if (0 == uiDepth) {
+    sBuilder.CreateBr(psJoin);
+    return 1;
+  }
+  SwitchInst *psSwitch = sBuilder.CreateSwitch(psCond, psJoin, uiWidth);
+  uLEdges = uiWidth + 1;
+  for (uint32_t i = 0; i < uiWidth; i++) {
+    BasicBlock *psCase = BasicBlock::Create(psBB->getContext(), "",
+                                            psBB->getParent(), psJoin);
+    psSwitch->addCase(sBuilder.getInt32(i), psCase);
+    uLEdges += make_switch_tree(psCase, psJoin, psCond, uiWidth, uiDepth - 1);
+  }
+  return uLEdges;
+}
+
+/* This function creates a function i32 (i32) made of a switch tree.
+   Inputs:
+     uLEdges -> Receives the number of CFG edges, counting the return
+*/
+static Function *make_function(Module &m, uint32_t uiWidth, uint32_t uiDepth,
+                               uint64_t &uLEdges) {
+  LLVMContext &sContext = m.getContext();
+  Type *psInt32Ty = Type::getInt32Ty(sContext);
+  FunctionType *psFnTy = FunctionType::get(psInt32Ty,
+                                           ArrayRef<Type*>(&psInt32Ty, 1),
+                                           false);
+  Function *f = Function::Create(psFnTy, GlobalValue::ExternalLinkage,
+                                 "switches", &m);
+  BasicBlock *psEntry = BasicBlock::Create(sContext, "entry", f);
+  BasicBlock *psJoin = BasicBlock::Create(sContext, "join", f);
+
+  IRBuilder<>(psJoin).CreateRet(ConstantInt::get(psInt32Ty, 0));
+  uLEdges = make_switch_tree(psEntry, psJoin, &*f->arg_begin(), uiWidth,
+                             uiDepth) + 1;
+  return f;
+}
+
+int main(int argc, char **argv) {
+  PassRegistry &sRegistry = *PassRegistry::getPassRegistry();
+  uint32_t auiDepths[] = {1, 2};
+  double aflSizes[] = {1e3, 1e4, 1e5, 1e6};
+  int siNull = open("/dev/null", O_WRONLY);
+  int siStdout = dup(1), siStderr = dup(2);
+
+  initializeCore(sRegistry);
+  initializeAnalysis(sRegistry);
+  cl::ParseCommandLineOptions(argc, argv, "BLPP scaling benchmark\n");
+
+  for (uint32_t d = 0; d < sizeof(auiDepths) / sizeof(auiDepths[0]); d++) {
+    for (uint32_t s = 0; s < sizeof(aflSizes) / sizeof(aflSizes[0]); s++) {
+      LLVMContext sContext;
+      Module m("bench", sContext);
+      uint32_t uiWidth = (uint32_t) pow(aflSizes[s] / 2, 1.0 / auiDepths[d]);
+      uint64_t uLEdges;
+      Function *f = make_function(m, uiWidth, auiDepths[d], uLEdges);
+      legacy::FunctionPassManager sFPM(&m);
+      struct timespec tsStart;
+      double flTime;
+
+      sFPM.add(new BLPPWrapperPass());
+      sFPM.doInitialization();
+      /* BLPP traces the graph on stdout and stderr */
+      fflush(stdout);
+      dup2(siNull, 1);
+      dup2(siNull, 2);
+      clock_gettime(CLOCK_MONOTONIC, &tsStart);
+      sFPM.run(*f);
+      flTime = elapsed(tsStart);
+      fflush(stdout);
+      dup2(siStdout, 1);
+      dup2(siStderr, 2);
+      sFPM.doFinalization();
+
+      printf("depth %u, width %u: %llu edges, %.3f s, %.1f ns/edge\n",
+             auiDepths[d], uiWidth, (unsigned long long) uLEdges, flTime,
+             flTime * 1e9 / uLEdges);
+    }
+  }
+  return 0;
+}
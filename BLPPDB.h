@@ -6,6 +6,7 @@
 #include "llvm/Analysis/blpp_if.h"
 #include <map>
 #include <string>
+#include <vector>
 
 #define BLPPDB_MAX_KEY_LEN        (50)
 
@@ -35,9 +36,12 @@ hash <const char *> hashstr;
 
 typedef struct {
 	uint32_t uiTarget;
-	uint32_t  uiFreq;
+	uint64_t  uLFreq;
 } EdgeFreq;
 
+/* A path ID and its execution count */
+typedef std::pair<uint64_t, uint64_t> PathCount;
+
 
 class BLPPDB : public FunctionPass {
  protected:
@@ -55,19 +59,27 @@ class BLPPDB : public FunctionPass {
 		 a while when both bp and edge/node profile are both valid. But once 
 		 edge/node/path profile information has been gathered, bp can be freed.
 	*/
-	uint32_t *uiNodeFrequencyP; /* Indexed by BB ID's */
+	uint64_t *uLNodeFrequencyP; /* Indexed by BB ID's */
   uint32_t uiFnID;
 	/* A list of successors and edge frequencies, for each node */
 	std::list<EdgeFreq> *lSuccessorFreqP; 
 
-	/* Profile Header and number of functions */
-	BLPPDBHdr *bhP;
+	/* Where the paths of each function are, and number of functions. The
+		 headers of v1 profiles are converted to v2 index entries.
+	*/
+	BLPPFuncIndex *bfiP;
 	unsigned int uiNumFuncs;
+	/* Counts are scaled by this, for profiles of sampled builds */
+	unsigned int uiSampleRate;
 	
 	
  public:
   static char ID;
   BLPPDB();
+	/* This constructor opens a profile other than -blppdata, for reading
+		 paths with read_paths only.
+	*/
+	BLPPDB(const char *fDBNameP);
 	~BLPPDB();
 
 	/* This function initializes the database.
@@ -78,9 +90,23 @@ class BLPPDB : public FunctionPass {
 	*/
 	void init(const char *fDBNameP);
   virtual bool runOnFunction(Function &f);
+
+	/* This function reads the paths of the next function of the profile,
+		 and derives its block and edge frequencies, for the queries below.
+		 runOnFunction reads them with the graph of the legacy BLPP pass.
+		 Inputs:
+		   sCurFun -> The function
+			 bp      -> Its BLPP graph
+		 Return Value:
+		   None
+		 Side Effects:
+		   The next call reads the function after it, unless set_context is
+			 called
+	*/
+	void read_function(Function &sCurFun, BLPP &bp);
   virtual void getAnalysisUsage(AnalysisUsage &AU) const
   {
-    AU.addRequired<BLPP>();
+    AU.addRequired<BLPPWrapperPass>();
   }
 	/* This function returns 1 iff the input function was ever executed in
 		 the profile run. Otherwise it returns 0.
@@ -95,6 +121,14 @@ class BLPPDB : public FunctionPass {
 
 	unsigned int was_called (unsigned int uiFnID);
 
+	/* This function returns how the paths of a function were numbered.
+		 Inputs:
+		   uiFnID      -> Function ID
+		 Return Value:
+		   BLPP_FUNC_* flags (blpp_if.h)
+	*/
+	uint32_t get_flags(unsigned int uiFnID);
+
 
 	/* This function sets the context for the queries, which are context
 		 sensitive. The context is defined by the function id and the 
@@ -128,7 +162,7 @@ class BLPPDB : public FunctionPass {
 		   The last set_context call must have been for the function in which
 			 the basic block is present. That context should not have been cleared.
 	*/
-	uint32_t get_block_frequency (unsigned int uiNode);
+	uint64_t get_block_frequency (unsigned int uiNode);
 
 	/* This function returns the number of times, the specified edge was 
 		 taken in the profile run.
@@ -141,7 +175,7 @@ class BLPPDB : public FunctionPass {
 		   The last set_context call must have been for the function in which
 			 the basic block is present. That context should not have been cleared.
 	*/
-	uint32_t get_edge_frequency(unsigned int uiSrcNode, 
+	uint64_t get_edge_frequency(unsigned int uiSrcNode, 
 															unsigned int uiTargetNode);
 
 	/* This function cleans up the data structures created for the current context 
@@ -156,6 +190,16 @@ class BLPPDB : public FunctionPass {
 
 	void clean_context();		 
 
+	/* This function reads the executed paths of a function, in either
+		 format, scaled by the sampling rate.
+		 Inputs:
+		   uiFID  -> Function ID
+			 vPaths -> Receives the executed paths and their counts
+		 Return Value:
+		   None
+	*/
+	void read_paths(unsigned int uiFID, std::vector<PathCount> &vPaths);
+
  private:
 	/* This is a helper function that sorts all paths between a source and
 		 destination in the decreasing order of execution frequencies; It also
@@ -173,14 +217,36 @@ class BLPPDB : public FunctionPass {
 		 Inputs:
 		   uiSrc      -> Source node of the edge
 			 uiTarget   -> Target node 
-			 uiCount    -> By how much to increment
+			 uLCount    -> By how much to increment
 		 Return Value:
 		   None
 		 Side Effects:
 		   Increments the edge frequency of the edge (lSuccessorFreqP)
 	*/
 	void increment_edge_frequency(unsigned int uiSrc, unsigned int uiTarget,
-																unsigned int uiCount);
+																uint64_t uLCount);
+
+};
+
+/* The profile named by -blppdata, for the new pass manager. Passes read
+	 the paths of a function with read_function, giving it the function's
+	 BLPPAnalysis graph. Register it with MAM.registerPass(BLPPDBAnalysis()).
+*/
+class BLPPDBAnalysis {
+	static char PassID;
+
+ public:
+	class Result {
+		std::unique_ptr<BLPPDB> bdbP;
+	 public:
+		explicit Result(BLPPDB *bdbP) : bdbP(bdbP) {};
+		Result(Result &&sOther) : bdbP(std::move(sOther.bdbP)) {};
+		BLPPDB &getBLPPDB() { return *bdbP; }
+	};
+
+	static void *ID() { return (void*) &PassID; }
+	static StringRef name() { return "BLPPDBAnalysis"; }
+	Result run(Module &m);
 };
 
 /* This function normalizes the execution path count for a list of paths.
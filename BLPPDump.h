@@ -16,3 +16,14 @@ public:
   virtual const char *getPassName() {return "BLPPDump";}
   static char ID; 
 };
+
+/* BLPPDump for the new pass manager. It needs BLPPDBAnalysis registered
+   with the ModuleAnalysisManager, and BLPPAnalysis with the
+   FunctionAnalysisManager, whose graphs it shares with other passes.
+*/
+class BLPPDumpPass
+{
+public:
+  PreservedAnalyses run(Module &m, ModuleAnalysisManager *psAM);
+  static StringRef name() {return "BLPPDumpPass";}
+};
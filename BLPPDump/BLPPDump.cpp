@@ -22,3 +22,21 @@ bool BLPPDump::runOnModule(Module &m)
 char BLPPDump::ID = 0;
 static RegisterPass<BLPPDump> BLPPDumpRegistration ("blppdump", "dump profile info");
 
+PreservedAnalyses BLPPDumpPass::run(Module &m, ModuleAnalysisManager *psAM)
+{
+  FunctionAnalysisManager &sFAM =
+    psAM->getResult<FunctionAnalysisManagerModuleProxy>(m).getManager();
+  BLPPDB &bdb = psAM->getResult<BLPPDBAnalysis>(m).getBLPPDB();
+  uint32_t i = 0;
+  for (Module::iterator it = m.begin(); it != m.end(); it++)
+  {
+    Function &f = *it;
+    if (f.isDeclaration()) continue;
+    bdb.set_context(i);
+    bdb.read_function(f, sFAM.getResult<BLPPAnalysis>(f).getBLPP());
+    if (bdb.was_called(i))
+      std::cout << "Function " << i << " was called\n";
+    i++;
+  }
+  return PreservedAnalyses::all();
+}
@@ -2,30 +2,167 @@
 #define BLPPINSTRUMENTATION_H
 
 #include "llvm/Analysis/BLPP.h"
+#include "llvm/Analysis/BLPPDB.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 using namespace llvm;
+
+/* An instrumented function, as listed in the module descriptor. uiCounters
+   says how its paths are counted (BLPP_COUNTERS_* in blpp_if.h). For
+   BLPP_COUNTERS_DENSE, psCounters is the counter array indexed by the path
+   sum; for BLPP_COUNTERS_MAPPED (-blppmmap), it is the pointer through which
+   the function reaches its counters in the memory mapped profile.
+*/
+typedef struct {
+  uint32_t uiProcID;
+  uint32_t uiNumPaths;
+  uint32_t uiCounters;
+  uint32_t uiFlags;
+  GlobalVariable *psCounters;
+  std::string sName;
+} FunctionDescInfo;
+
+/* A back edge of a sampled function. psExitBranch is the branch that takes
+   the back edge in the instrumented version, after the path has been
+   counted; siPathSum is the path sum the header starts with afterwards.
+*/
+typedef struct {
+  BasicBlock *psTail, *psHead;
+  TerminatorInst *psExitBranch;
+  int64_t siPathSum;
+  uint32_t uiSuccNum;
+} SampledBackEdge;
+
+/* A conditional branch whose successor edges update the path sum, but
+   don't count paths (-blppselectincr). apsEdges[i] is the BLPP edge to
+   successor i; the new path sum is selected before the branch.
+*/
+typedef struct {
+  BranchInst *psBranch;
+  BLPPEdge *apsEdges[2];
+} SelectBranch;
+
+/* A back edge counting paths into a counter array, whose predicted hot
+   path is counted in a register instead (-blpphotloops). psIsHot compares
+   the path ID with the hot path's, where the counter would be incremented.
+*/
+typedef struct {
+  ICmpInst *psIsHot;
+  Value *psPathID;
+  BasicBlock *psHeader;
+} HotLoopRead;
+
+/* Ways to instrument a function under -blppbudget, from the most to the
+   least precise
+*/
+enum {
+  BUDGET_EXACT = 0,   /* Every path, in a counter array or a path table */
+  BUDGET_SAMPLED,
+  BUDGET_EDGE,        /* Edge counts only */
+  BUDGET_NONE,
+  BUDGET_LEVELS
+};
+
+/* Estimates for a function, per call: dBase instructions executed, and
+   adCost instructions added by instrumenting it at each level
+*/
+typedef struct {
+  double dBase;
+  double adCost[BUDGET_LEVELS];
+  uint32_t uiLevel; /* Chosen level */
+} FunctionCost;
+
 class BLPPInstrumentation : public ModulePass
 {
   protected:
-    Value *psRecordEntry, *psRecordExit, *psRecordPathSum;
+    Value *psRecordPathSum, *psRegisterModule;
+    Value *psThreadCounters, *psTableMiss;
+    StructType *psPathTableTy;
+    GlobalVariable *psSampleCountdown, *psIDBase;
+    Constant *psEmptyTable, *psEnabled;
+    std::vector<FunctionDescInfo> vFuncDescs;
+    /* Instrumented critical edges, folded into selects or split */
+    uint32_t uiFoldedEdges, uiSplitEdges;
+    /* Function selection (-blppinclude, -blppexclude, -blpphotprofile) */
+    Regex *psIncludeRE, *psExcludeRE;
+    BLPPDB *bdbHotP;
+    bool IsSelected(Function &f, uint32_t uiProcID);
+    bool IsHotEnough(Function &f);
+    /* The new pass manager's analyses, while BLPPInstrumentationPass runs
+       the pass; the legacy pass manager's otherwise
+    */
+    FunctionAnalysisManager *psFAM;
+    BLPPEstimator *psEstimator;
+    BLPP& GetBLPP(Function &f);
+    /* Rate of the sampled functions of the module */
+    uint32_t uiRate;
+    void EstimateCost(Function &f, BLPP &bp, FunctionCost &sCost);
+    void ChooseStrategies(Module &m, std::vector<uint32_t> &vStrategies);
     void replaceTarget(TerminatorInst *psTerm, BasicBlock *psOldTarget, 
       BasicBlock *psNewTarget);
-    void InstrumentFunction(Function &f, uint32_t uiProcID, BLPP &bp);
+    void InstrumentFunction(Function &f, uint32_t uiProcID, BLPP &bp,
+      uint32_t uiStrategy);
+    void InstrumentEdges(Function &f, uint32_t uiProcID, BLPP &bp);
     void replacePhiUsesWith(BasicBlock *psChild,
       BasicBlock *psOldParent,  BasicBlock *psNewParent);
+    void EmitModuleDescriptor(Module &m, uint64_t uLBuildID);
+    Value* LoadFunctionID(uint32_t uiProcID, Instruction *psInsertionPt);
+    LoadInst* LoadThreadCounters(Function &f, uint32_t uiProcID,
+      uint32_t uiNumPaths);
+    void GuardThreadCounters(LoadInst *psBase, uint32_t uiProcID,
+      uint32_t uiNumPaths);
+    GlobalVariable* CreatePathTable(Function &f, uint32_t uiProcID);
+    void InlineTableProbe(CallInst *psMiss);
+    GlobalVariable* CreateMappedCounters(Function &f, uint32_t uiProcID,
+      uint32_t uiNumPaths, uint32_t uiFlags);
+    void EmitIncrement(Value *psCounter, bool isAtomic, 
+      Instruction *psInsertionPt);
+    void CollectSelectBranches(Function &f, BLPP &bp,
+      std::vector<SelectBranch> &vBranches);
+    void EmitSelectIncrement(SelectBranch &sBranch, Value *psPathSumVar);
+    void PromotePathSum(Function &f, AllocaInst *psPathSumVar,
+      std::vector<BinaryOperator*> &vIncrements);
+    int64_t PredictHotPath(BLPP &bp, BLPPEdge *psToExit, uint32_t uiProcID);
+    void EmitHotPathCounters(Function &f, std::vector<HotLoopRead> &vReads,
+      Value *psCounters);
+    void EmitSwitchIncrement(SwitchInst *psSwitch,
+      std::vector<BLPPEdge*> &vEdges, Value *psPathSumVar, uint32_t uiProcID);
+    BranchInst* CloneCheckingVersion(Function &f, 
+      ValueToValueMapTy &mChecking);
+    void CloneToggledVersion(Function &f, std::vector<BasicBlock*> &vOff);
+    void AddToggledVersion(Function &f, std::vector<BasicBlock*> &vOff);
+    void EmitSampleCheck(BranchInst *psBranch, BasicBlock *psSampled,
+      BasicBlock *psUnsampled);
 
  
   public:
     BLPPInstrumentation();
+    ~BLPPInstrumentation();
     virtual bool runOnModule(Module &m);
-    BasicBlock* splitEdge(BasicBlock *psTail, BasicBlock *psHead);
-    virtual void getAnalysisUsage(AnalysisUsage &AU) const
-    {
-      AU.addRequired<BLPP>();
-    }
+    bool runOnModule(Module &m, FunctionAnalysisManager &sFAM);
+    BasicBlock* splitEdge(BasicBlock *psTail, BasicBlock *psHead,
+      int32_t siSuccNum = -1);
+    virtual void getAnalysisUsage(AnalysisUsage &AU) const;
     virtual const char *getPassName() {return "BLPPInstrumentation";}
     static char ID;
     
 };
+
+/* BLPPInstrumentation for the new pass manager. Graphs come from
+   BLPPAnalysis, which must be registered with the FunctionAnalysisManager,
+   so they are computed once per function for all the passes sharing it.
+*/
+class BLPPInstrumentationPass
+{
+    std::shared_ptr<BLPPInstrumentation> psInstrP;
+
+  public:
+    BLPPInstrumentationPass() : psInstrP(new BLPPInstrumentation()) {}
+    PreservedAnalyses run(Module &m, ModuleAnalysisManager *psAM);
+    static StringRef name() {return "BLPPInstrumentationPass";}
+};
 #endif
 
 
@@ -1,10 +1,1112 @@
 #include "llvm/Transforms/BLPPInstrumentation.h"
+#include "llvm/Analysis/blpp_if.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Scalar.h"
+#include <algorithm>
+#include <map>
+#include <queue>
+#include <set>
 using namespace llvm;
+
+/* Estimated instructions executed by instrumentation, for -blppbudget */
+#define BLPP_COST_INCR    (1)  /* Path sum add */
+#define BLPP_COST_DENSE   (4)  /* counters[pathsum]++ */
+#define BLPP_COST_TABLE   (8)  /* Inlined path table probe */
+#define BLPP_COST_CALL    (30) /* __record_path_sum */
+#define BLPP_COST_CHECK   (5)  /* Sampling countdown */
+
+/* Rate of the functions -blppbudget samples, without -blppsamplerate */
+#define BLPP_BUDGET_SAMPLE_RATE (100)
+
+static cl::opt<unsigned>
+  uiDenseLimit("blppdenselimit", cl::init(4096), cl::value_desc("paths"),
+  cl::desc("functions with fewer paths than this get an inline counter "
+           "array instead of calls to __record_path_sum"));
+
+static cl::opt<bool>
+  bThreaded("blppthreaded", cl::init(false),
+  cl::desc("give each thread its own counter arrays, for programs that "
+           "run instrumented code on several threads"));
+
+static cl::opt<bool>
+  bPathTable("blpppathtable", cl::init(true),
+  cl::desc("count the paths of functions above -blppdenselimit in an "
+           "inline open addressing table instead of calling "
+           "__record_path_sum"));
+
+static cl::opt<bool>
+  bMmap("blppmmap", cl::init(false),
+  cl::desc("keep the counters of functions below -blppdenselimit in a "
+           "memory mapped prof.res, so that the profile survives crashes"));
+
+static cl::opt<unsigned>
+  uiSampleRate("blppsamplerate", cl::init(1), cl::value_desc("n"),
+  cl::desc("count only one in every n paths: functions get an uninstrumented "
+           "checking version, and a countdown at entry and at loop headers "
+           "decides when to run the instrumented version"));
+
+static cl::opt<unsigned>
+  uiSwitchTableLimit("blppswitchtable", cl::init(1024), cl::value_desc("n"),
+  cl::desc("switches whose case values span fewer than n values get their "
+           "path sum increments from a table; wider switches get a block "
+           "per instrumented case"));
+
+static cl::opt<bool>
+  bSelectIncr("blppselectincr", cl::init(false),
+  cl::desc("update the path sum for both edges of a conditional branch with "
+           "a select before the branch, instead of splitting critical edges "
+           "for the updates; edges that count paths are still split"));
+
+static cl::opt<std::string>
+  sInclude("blppinclude", cl::value_desc("regex"),
+  cl::desc("instrument only functions whose names match the regex"));
+
+static cl::opt<std::string>
+  sExclude("blppexclude", cl::value_desc("regex"),
+  cl::desc("don't instrument functions whose names match the regex"));
+
+static cl::opt<unsigned>
+  uiMinFreq("blppminfreq", cl::init(0), cl::value_desc("n"),
+  cl::desc("instrument only functions whose hottest block is estimated to "
+           "run at least n times per call"));
+
+static cl::opt<std::string>
+  sHotProfile("blpphotprofile", cl::value_desc("filename"),
+  cl::desc("instrument only functions with at least -blpphotcount paths "
+           "counted in this profile of an earlier build"));
+
+static cl::opt<unsigned>
+  uiHotCount("blpphotcount", cl::init(1), cl::value_desc("n"),
+  cl::desc("paths a function needs in -blpphotprofile to be instrumented"));
+
+static cl::opt<bool>
+  bHotLoops("blpphotloops", cl::init(false),
+  cl::desc("count the predicted hot path of each loop without calls in a "
+           "register, flushed to its counter when the loop is left"));
+
+static cl::opt<bool>
+  bEdgeOnly("blppedgeonly", cl::init(false),
+  cl::desc("count CFG edges instead of paths, on the chords of a spanning "
+           "tree; BLPPDB derives the other edge and block counts"));
+
+static cl::opt<double>
+  dBudget("blppbudget", cl::init(0), cl::value_desc("percent"),
+  cl::desc("choose per function between counting every path, sampling, "
+           "counting edges and no instrumentation, so that the estimated overhead stays "
+           "within this percentage of the instructions executed"));
+
+static cl::opt<bool>
+  bToggle("blpptoggle", cl::init(false),
+  cl::desc("keep an uninstrumented version of every instrumented function, "
+           "run while the runtime's __blpp_enabled flag is 0"));
+
+static cl::opt<bool>
+  bStats("blppstats", cl::init(false),
+  cl::desc("report how many functions were instrumented and, with "
+           "-blppselectincr, how many critical edges were split"));
+
 BLPPInstrumentation::BLPPInstrumentation() : ModulePass(ID)
 {
-  psRecordEntry = psRecordExit = psRecordPathSum = nullptr;
+  psIncludeRE = psExcludeRE = nullptr;
+  bdbHotP = nullptr;
+  uiRate = 1;
+  uiFoldedEdges = uiSplitEdges = 0;
+  psRecordPathSum = psRegisterModule = nullptr;
+  psThreadCounters = psTableMiss = nullptr;
+  psPathTableTy = nullptr;
+  psEmptyTable = psEnabled = nullptr;
+  psSampleCountdown = psIDBase = nullptr;
+  psFAM = nullptr;
+  psEstimator = nullptr;
+}
+
+/* This function returns true if instrumenting the edge from tail to head
+   needs a new basic block (see splitEdge).
+*/
+static bool isCriticalEdge(BasicBlock *psTail, BasicBlock *psHead)
+{
+  return psHead && !psTail->getUniqueSuccessor() &&
+    !psHead->getUniquePredecessor();
+}
+
+/* This function finds the range of a switch's case values, if its path sum
+   increments can be looked up in a table (-blppswitchtable).
+   Inputs:
+     psSwitch -> The switch
+     siMin    -> Receives the smallest case value
+     uLRange  -> Receives the number of values from the smallest case value
+                 to the largest
+   Return Value:
+     true if the switch gets a table
+*/
+static bool GetCaseRange(SwitchInst *psSwitch, int64_t &siMin,
+  uint64_t &uLRange)
+{
+  int64_t siMax = INT64_MIN;
+  if ((0 == psSwitch->getNumCases()) ||
+    (psSwitch->getCondition()->getType()->getIntegerBitWidth() > 64))
+    return false;
+  siMin = INT64_MAX;
+  for (SwitchInst::CaseIt it = psSwitch->case_begin();
+    it != psSwitch->case_end(); ++it)
+  {
+    int64_t siValue = it.getCaseValue()->getSExtValue();
+    siMin = std::min(siMin, siValue);
+    siMax = std::max(siMax, siValue);
+  }
+  uLRange = (uint64_t) siMax - (uint64_t) siMin;
+  if (uLRange >= uiSwitchTableLimit)
+    return false;
+  uLRange++;
+  return true;
+}
+
+/* The value an edge adds to the path sum, in a switch table */
+static int64_t TableIncrement(BLPPEdge *psEdge)
+{
+  return (psEdge && (INVALID != psEdge->atKind)) ? psEdge->siIncrement : 0;
+}
+
+/* This function applies the path sum increments of a switch's successor
+   edges with one table lookup before the switch, instead of a block per
+   case:
+     pathsum += table[cond - min < range ? cond - min : range]
+   where the last entry is the default's increment. Edges that initialize
+   the path sum only leave blocks reached from the entry without any
+   increment, where the path sum is still 0, so their values are added as
+   well. Edges that count paths get their increment here and count in a
+   block of their own.
+   Inputs:
+     psSwitch     -> The switch, for which GetCaseRange succeeded
+     vEdges       -> BLPP edges by successor number
+     psPathSumVar -> The path sum variable
+     uiProcID     -> ID of the function, for naming the table
+*/
+void BLPPInstrumentation::EmitSwitchIncrement(SwitchInst *psSwitch,
+  std::vector<BLPPEdge*> &vEdges, Value *psPathSumVar, uint32_t uiProcID)
+{
+  LLVMContext &sContext = psSwitch->getContext();
+  IntegerType *psInt64Ty = IntegerType::get(sContext, 64);
+  std::vector<uint64_t> vTable;
+  int64_t siMin;
+  uint64_t uLRange;
+  bool isNeeded = false;
+
+  GetCaseRange(psSwitch, siMin, uLRange);
+  vTable.assign(uLRange + 1, TableIncrement(vEdges[0]));
+  for (SwitchInst::CaseIt it = psSwitch->case_begin();
+    it != psSwitch->case_end(); ++it)
+    vTable[it.getCaseValue()->getSExtValue() - siMin] =
+      TableIncrement(vEdges[it.getSuccessorIndex()]);
+  for (uint64_t i = 0; i < vTable.size(); i++)
+    isNeeded |= (0 != vTable[i]);
+  if (!isNeeded)
+    return;
+
+  ArrayType *psTableTy = ArrayType::get(psInt64Ty, vTable.size());
+  GlobalVariable *psTable = new GlobalVariable
+    (*psSwitch->getParent()->getParent()->getParent(), psTableTy, true,
+    GlobalValue::InternalLinkage, ConstantDataArray::get(sContext, vTable),
+    "blpp.switch." + Twine(uiProcID));
+  Value *psIndex = CastInst::CreateIntegerCast(psSwitch->getCondition(),
+    psInt64Ty, true, "", psSwitch);
+  psIndex = BinaryOperator::Create(Instruction::BinaryOps::Sub, psIndex,
+    ConstantInt::get(psInt64Ty, siMin), "", psSwitch);
+  Value *psInRange = new ICmpInst(psSwitch, ICmpInst::ICMP_ULT, psIndex,
+    ConstantInt::get(psInt64Ty, uLRange));
+  psIndex = SelectInst::Create(psInRange, psIndex,
+    ConstantInt::get(psInt64Ty, uLRange), "", psSwitch);
+  Value *apsIdx[2] = {ConstantInt::get(psInt64Ty, 0), psIndex};
+  Value *psSlot = GetElementPtrInst::CreateInBounds(psTable,
+    ArrayRef<Value*>(apsIdx, 2), "", psSwitch);
+  Value *psIncrement = new LoadInst(psSlot, "", psSwitch);
+  Value *psCurPathSum = new LoadInst(psPathSumVar, "", psSwitch);
+  new StoreInst(BinaryOperator::Create(Instruction::BinaryOps::Add,
+    psCurPathSum, psIncrement, "", psSwitch), psPathSumVar, psSwitch);
+}
+
+BLPPInstrumentation::~BLPPInstrumentation()
+{
+  delete psIncludeRE;
+  delete psExcludeRE;
+  delete bdbHotP;
+  delete psEstimator;
+}
+
+void BLPPInstrumentation::getAnalysisUsage(AnalysisUsage &AU) const
+{
+  if (uiMinFreq > 0)
+    AU.addRequired<BlockFrequencyInfo>();
+  AU.addRequired<BLPPWrapperPass>();
+}
+
+/* This function decides whether a function is instrumented, from the
+   selection options: its name, its estimated hotness and its paths in an
+   earlier profile. Functions that are not keep their ID, so that the
+   profile of a selective build numbers functions as a full build does.
+   Inputs:
+     f        -> Function
+     uiProcID -> Its ID
+   Return Value:
+     true if it is to be instrumented
+*/
+bool BLPPInstrumentation::IsSelected(Function &f, uint32_t uiProcID)
+{
+  if (psIncludeRE && !psIncludeRE->match(f.getName()))
+    return false;
+  if (psExcludeRE && psExcludeRE->match(f.getName()))
+    return false;
+  if ((uiMinFreq > 0) && !IsHotEnough(f))
+    return false;
+  if (bdbHotP)
+  {
+    std::vector<PathCount> vPaths;
+    uint64_t uLCount = 0;
+    if (bdbHotP->was_called(uiProcID))
+      bdbHotP->read_paths(uiProcID, vPaths);
+    for (std::vector<PathCount>::iterator it = vPaths.begin();
+      it != vPaths.end(); it++)
+      uLCount += it->second;
+    if (uLCount < uiHotCount)
+      return false;
+  }
+  return true;
+}
+
+/* This function says whether the hottest block of a function is estimated
+   to run at least -blppminfreq times per call.
+*/
+static bool HasHotBlock(Function &f, BlockFrequencyInfo &sBFI)
+{
+  uint64_t uLMaxFreq = 0;
+  for (Function::iterator it = f.begin(); it != f.end(); it++)
+    uLMaxFreq = std::max(uLMaxFreq, sBFI.getBlockFreq(&*it).getFrequency());
+  return (uLMaxFreq >= sBFI.getEntryFreq() * uiMinFreq);
+}
+
+/* HasHotBlock, with the block frequencies of the pass manager running the
+   pass: the new one has none, so they are computed by psEstimator
+*/
+bool BLPPInstrumentation::IsHotEnough(Function &f)
+{
+  bool isHot = false;
+
+  if (nullptr == psFAM)
+    return HasHotBlock(f, getAnalysis<BlockFrequencyInfo>(f));
+  if (nullptr == psEstimator)
+    psEstimator = new BLPPEstimator();
+  psEstimator->Run(f, [&](BlockFrequencyInfo &sBFI,
+    BranchProbabilityInfo &sBPI) { isHot = HasHotBlock(f, sBFI); });
+  return isHot;
+}
+
+/* This function returns the BLPP graph of a function, from whichever pass
+   manager runs the pass. Under the legacy one, the next call may free it.
+*/
+BLPP& BLPPInstrumentation::GetBLPP(Function &f)
+{
+  if (psFAM)
+    return psFAM->getResult<BLPPAnalysis>(f).getBLPP();
+  return getAnalysis<BLPPWrapperPass>(f).getBLPP();
+}
+
+/* This function estimates what a function costs per call, uninstrumented
+   and at each level of -blppbudget, from the edge weights BLPP chose the
+   spanning tree with: the executed chords, path counters, and the checks of
+   sampled versions at entry and on back edges.
+   Inputs:
+     f     -> Function
+     bp    -> Its BLPP graph
+     sCost -> Receives the estimates
+*/
+void BLPPInstrumentation::EstimateCost(Function &f, BLPP &bp,
+  FunctionCost &sCost)
+{
+  uint32_t uiNumPaths = bp.bnEntryP->siNumPaths;
+  double dRead = (uiNumPaths < uiDenseLimit) ? BLPP_COST_DENSE :
+    (bPathTable ? BLPP_COST_TABLE : BLPP_COST_CALL);
+  double dEntry = 0, dBase = 0, dExact = 0, dBackEdges = 0, dEdges = 0;
+  std::vector<BLPPEdge*> &vCFGEdges = bp.ChooseEdgeCounters();
+
+  for (std::vector<BLPPEdge*>::iterator it = vCFGEdges.begin();
+    it != vCFGEdges.end(); it++)
+  {
+    if ((*it)->isChord)
+      dEdges += (*it)->uLWeight * BLPP_COST_DENSE;
+  }
+
+  /* The exit node has no block */
+  for (std::vector<BLPPNode*>::iterator itN = bp.svNodes.begin();
+    itN != bp.svNodes.end(); itN++)
+  {
+    BasicBlock *psBB = static_cast<BasicBlock*>((*itN)->vNodeDataP);
+    double dFreq = 0;
+    for (BLPPEdgeRange::iterator it = (*itN)->lOutEdges.begin();
+      it != (*itN)->lOutEdges.end(); it++)
+    {
+      BLPPEdge *psEdge = *it;
+      double dCost = psEdge->siIncrement ? BLPP_COST_INCR : 0;
+      if (PATH_SUM_READ == psEdge->atKind)
+        dCost += dRead;
+      else if (PATH_SUM_INCR != psEdge->atKind)
+        dCost = 0;
+      dExact += dCost * psEdge->uLWeight;
+      if (psEdge->beDummyMatchP && psEdge->nodeHeadP->vNodeDataP)
+        continue;
+      /* CFG edges out of the block; back edges are the edges to exit */
+      dFreq += psEdge->uLWeight;
+      if (psEdge->beDummyMatchP)
+        dBackEdges += psEdge->uLWeight;
+    }
+    if (psBB)
+      dBase += dFreq * psBB->size();
+    if (*itN == bp.bnEntryP)
+      dEntry = dFreq;
+  }
+
+  /* Per call; functions estimated never to run cost nothing */
+  std::fill(sCost.adCost, sCost.adCost + BUDGET_LEVELS, 0.0);
+  sCost.dBase = 0;
+  sCost.uiLevel = BUDGET_EXACT;
+  if (0 == dEntry)
+    return;
+  sCost.dBase = dBase / dEntry;
+  sCost.adCost[BUDGET_EXACT] = dExact / dEntry;
+  sCost.adCost[BUDGET_SAMPLED] = sCost.adCost[BUDGET_EXACT];
+  if (uiRate > 1)
+    sCost.adCost[BUDGET_SAMPLED] = (1 + dBackEdges / dEntry) *
+      BLPP_COST_CHECK + sCost.adCost[BUDGET_EXACT] / uiRate;
+  sCost.adCost[BUDGET_EDGE] = dEdges / dEntry;
+  if (bEdgeOnly)
+  {
+    /* Edges are all that is counted */
+    sCost.adCost[BUDGET_EXACT] = sCost.adCost[BUDGET_SAMPLED] =
+      sCost.adCost[BUDGET_EDGE];
+  }
+}
+
+/* This function chooses how to instrument each function (-blppbudget). All
+   functions start out counting every path; then, while the estimated
+   overhead of the module exceeds the budget, the function whose next
+   cheaper level saves the most is moved to it. Functions are assumed to be
+   called equally often, as there are no call frequency estimates.
+   Inputs:
+     m           -> Module
+     vStrategies -> Receives the BLPP_STRATEGY_* of each function, or
+                    BLPP_FUNC_UNINSTRUMENTED, indexed by function ID
+   Side Effects:
+     uiRate is set to 1 if no function is sampled
+*/
+void BLPPInstrumentation::ChooseStrategies(Module &m,
+  std::vector<uint32_t> &vStrategies)
+{
+  std::vector<FunctionCost> vCosts;
+  std::priority_queue<std::pair<double, uint32_t> > pqSavings;
+  double dBase = 0, dOverhead = 0;
+  uint32_t auiLevels[BUDGET_LEVELS] = {0, 0, 0, 0};
+
+  for (Module::iterator it = m.begin(); it != m.end(); it++)
+  {
+    Function &f = *it;
+    if (f.isDeclaration()) continue;
+    uint32_t i = vStrategies.size();
+    FunctionCost sCost;
+    bool isSelected = IsSelected(f, i);
+    BLPP &bp = GetBLPP(f);
+    EstimateCost(f, bp, sCost);
+    vStrategies.push_back((bp.bnEntryP->siNumPaths < uiDenseLimit) ?
+      BLPP_STRATEGY_DENSE : BLPP_STRATEGY_TABLE);
+    if (bEdgeOnly)
+      vStrategies[i] = BLPP_STRATEGY_EDGE;
+    if (!isSelected)
+    {
+      vStrategies[i] = BLPP_FUNC_UNINSTRUMENTED;
+      sCost.uiLevel = BUDGET_NONE;
+    }
+    dBase += sCost.dBase;
+    dOverhead += sCost.adCost[sCost.uiLevel];
+    vCosts.push_back(sCost);
+    if (sCost.adCost[BUDGET_EXACT] > 0)
+      pqSavings.push(std::make_pair(sCost.adCost[BUDGET_EXACT], i));
+  }
+
+  while ((dOverhead > dBase * dBudget / 100) && !pqSavings.empty())
+  {
+    /* The queue holds the overhead of each function at its current level */
+    uint32_t i = pqSavings.top().second;
+    FunctionCost &sCost = vCosts[i];
+    pqSavings.pop();
+    double dCurrent = sCost.adCost[sCost.uiLevel];
+    uint32_t uiNext = sCost.uiLevel + 1;
+    while (sCost.adCost[uiNext] >= dCurrent)
+      uiNext++;
+    dOverhead -= dCurrent - sCost.adCost[uiNext];
+    sCost.uiLevel = uiNext;
+    if (sCost.adCost[uiNext] > 0)
+      pqSavings.push(std::make_pair(sCost.adCost[uiNext], i));
+  }
+
+  for (uint32_t i = 0; i < vCosts.size(); i++)
+  {
+    auiLevels[vCosts[i].uiLevel]++;
+    if (BUDGET_SAMPLED == vCosts[i].uiLevel)
+      vStrategies[i] = BLPP_STRATEGY_SAMPLED;
+    else if (BUDGET_EDGE == vCosts[i].uiLevel)
+      vStrategies[i] = BLPP_STRATEGY_EDGE;
+    else if (BUDGET_NONE == vCosts[i].uiLevel)
+      vStrategies[i] = BLPP_FUNC_UNINSTRUMENTED;
+  }
+  if (0 == auiLevels[BUDGET_SAMPLED])
+    uiRate = 1;
+  errs() << "BLPP: estimated overhead " << format("%.2f", dBase ?
+    100 * dOverhead / dBase : 0.0) << "% (budget " << dBudget << "%): "
+    << auiLevels[BUDGET_EXACT] << " functions count every path, "
+    << auiLevels[BUDGET_SAMPLED] << " sampled at 1/" << uiRate << ", "
+    << auiLevels[BUDGET_EDGE] << " count edges, "
+    << auiLevels[BUDGET_NONE] << " not instrumented\n";
+}
+
+/* This function returns the last edge of a path, decoded as in
+   BLPP::RegeneratePath, or nullptr if the path ID is out of range.
+*/
+static BLPPEdge* FinalEdge(BLPP &bp, uint64_t uLPathID)
+{
+  BLPPNode *bnCurP = bp.bnEntryP;
+  BLPPEdge *psEdge = nullptr;
+  if (uLPathID >= bp.bnEntryP->siNumPaths)
+    return nullptr;
+  while (bnCurP != bp.bnExitP)
+  {
+    psEdge = nullptr;
+    for (BLPPEdgeRange::iterator it = bnCurP->lOutEdges.begin();
+      it != bnCurP->lOutEdges.end(); it++)
+    {
+      if (((uint64_t) (*it)->siEdgeVal <= uLPathID) &&
+        (!psEdge || ((*it)->siEdgeVal > psEdge->siEdgeVal)))
+        psEdge = *it;
+    }
+    uLPathID -= psEdge->siEdgeVal;
+    bnCurP = psEdge->nodeHeadP;
+  }
+  return psEdge;
+}
+
+/* This function predicts the path most often ending at a back edge
+   (-blpphotloops): the one counted most often in -blpphotprofile, or else
+   the one taking the heaviest edge at every branch from the loop header.
+   Inputs:
+     bp       -> BLPP graph of the function
+     psToExit -> The tail->exit edge of the back edge
+     uiProcID -> Function ID
+   Return Value:
+     The path ID
+*/
+int64_t BLPPInstrumentation::PredictHotPath(BLPP &bp, BLPPEdge *psToExit,
+  uint32_t uiProcID)
+{
+  if (bdbHotP && !(bp.uiPathFlags & BLPP_FUNC_HASHED) &&
+    bdbHotP->was_called(uiProcID))
+  {
+    std::vector<PathCount> vPaths;
+    uint64_t uLBest = 0;
+    int64_t siBest = -1;
+    bdbHotP->read_paths(uiProcID, vPaths);
+    for (std::vector<PathCount>::iterator it = vPaths.begin();
+      it != vPaths.end(); it++)
+    {
+      if ((it->second > uLBest) && (FinalEdge(bp, it->first) == psToExit))
+      {
+        uLBest = it->second;
+        siBest = it->first;
+      }
+    }
+    if (siBest >= 0)
+      return siBest;
+  }
+
+  /* Nodes from which the tail of the back edge is reached in the DAG */
+  BLPPNode *bnTailP = psToExit->nodeTailP;
+  std::set<BLPPNode*> sReaching;
+  std::vector<BLPPNode*> vWork(1, bnTailP);
+  sReaching.insert(bnTailP);
+  while (!vWork.empty())
+  {
+    BLPPNode *bnCurP = vWork.back();
+    vWork.pop_back();
+    for (BLPPEdgeRange::iterator it = bnCurP->lInEdges.begin();
+      it != bnCurP->lInEdges.end(); it++)
+    {
+      if (!(*it)->beDummyMatchP && ((*it)->nodeTailP != bp.bnExitP) &&
+        sReaching.insert((*it)->nodeTailP).second)
+        vWork.push_back((*it)->nodeTailP);
+    }
+  }
+
+  BLPPEdge *psFromEntry = psToExit->beDummyMatchP;
+  BLPPNode *bnCurP = psFromEntry->nodeHeadP;
+  int64_t siPathID = psFromEntry->siEdgeVal + psToExit->siEdgeVal;
+  while (bnCurP != bnTailP)
+  {
+    BLPPEdge *psNext = nullptr;
+    for (BLPPEdgeRange::iterator it = bnCurP->lOutEdges.begin();
+      it != bnCurP->lOutEdges.end(); it++)
+    {
+      if (!(*it)->beDummyMatchP && sReaching.count((*it)->nodeHeadP) &&
+        (!psNext || ((*it)->uLWeight > psNext->uLWeight)))
+        psNext = *it;
+    }
+    assert(psNext && "Loop header doesn't reach the back edge");
+    siPathID += psNext->siEdgeVal;
+    bnCurP = psNext->nodeHeadP;
+  }
+  if (bp.uiPathFlags & BLPP_FUNC_HASHED)
+    siPathID &= bp.uLHashMask;
+  return siPathID;
+}
+
+/* This function counts the predicted hot paths of back edges in registers
+   (-blpphotloops). The loop of a back edge is the region of blocks reaching
+   it without passing its header. Where the counter of the path would be
+   incremented, a hot path increments a register instead:
+     if (pathid == hot) hotcount++; else counters[pathid]++;
+   and every edge leaving the region adds hotcount to counters[hot]. Loops
+   that call functions are left alone, so that no counts are lost if the
+   program exits from a callee.
+   Inputs:
+     f          -> Function
+     vReads     -> The back edges
+     psCounters -> The function's counter array
+*/
+void BLPPInstrumentation::EmitHotPathCounters(Function &f,
+  std::vector<HotLoopRead> &vReads, Value *psCounters)
+{
+  IntegerType *psInt64Ty = IntegerType::get(f.getContext(), 64);
+  Instruction *psFrontPt = f.getEntryBlock().getFirstNonPHI();
+  std::vector<AllocaInst*> vHotCounts;
+
+  for (std::vector<HotLoopRead>::iterator it = vReads.begin();
+    it != vReads.end(); it++)
+  {
+    ICmpInst *psIsHot = it->psIsHot;
+    Value *psPathID = it->psPathID;
+    Instruction *psNext = psIsHot->getNextNode();
+    std::set<BasicBlock*> sRegion;
+    std::vector<BasicBlock*> vWork(1, psIsHot->getParent());
+    bool isCounted = true;
+    sRegion.insert(it->psHeader);
+    sRegion.insert(psIsHot->getParent());
+    while (!vWork.empty() && isCounted)
+    {
+      BasicBlock *psBB = vWork.back();
+      vWork.pop_back();
+      for (BasicBlock::iterator itI = psBB->begin(); itI != psBB->end(); itI++)
+      {
+        if ((isa<CallInst>(itI) || isa<InvokeInst>(itI)) &&
+          !isa<IntrinsicInst>(itI))
+          isCounted = false;
+      }
+      if (psBB == it->psHeader)
+        continue;
+      for (pred_iterator itP = pred_begin(psBB); itP != pred_end(psBB); itP++)
+      {
+        if (sRegion.insert(*itP).second)
+          vWork.push_back(*itP);
+      }
+    }
+    /* Without a loop, the region reaches the entry: a cut point */
+    if (!isCounted || sRegion.count(&f.getEntryBlock()))
+    {
+      Value *psSlot = GetElementPtrInst::Create(psCounters,
+        ArrayRef<Value*>(&psPathID, 1), "", psNext);
+      EmitIncrement(psSlot, false, psNext);
+      psIsHot->eraseFromParent();
+      continue;
+    }
+
+    /* Edges leaving the region, found before any block is split */
+    std::vector<std::pair<TerminatorInst*, uint32_t> > vExits;
+    for (std::set<BasicBlock*>::iterator itB = sRegion.begin();
+      itB != sRegion.end(); itB++)
+    {
+      TerminatorInst *psTerm = (*itB)->getTerminator();
+      for (uint32_t i = 0; i < psTerm->getNumSuccessors(); i++)
+      {
+        if (!sRegion.count(psTerm->getSuccessor(i)))
+          vExits.push_back(std::make_pair(psTerm, i));
+      }
+    }
+
+    AllocaInst *psHotCount = new AllocaInst(psInt64Ty, "blpp.hotcount",
+      psFrontPt);
+    new StoreInst(ConstantInt::get(psInt64Ty, 0), psHotCount, psFrontPt);
+    vHotCounts.push_back(psHotCount);
+    TerminatorInst *psThen, *psElse;
+    SplitBlockAndInsertIfThenElse(psIsHot, psNext, &psThen, &psElse,
+      MDBuilder(f.getContext()).createBranchWeights(1000, 1));
+    Value *psCount = new LoadInst(psHotCount, "", psThen);
+    psCount = BinaryOperator::Create(Instruction::BinaryOps::Add, psCount,
+      ConstantInt::get(psInt64Ty, 1), "", psThen);
+    new StoreInst(psCount, psHotCount, psThen);
+    Value *psSlot = GetElementPtrInst::Create(psCounters,
+      ArrayRef<Value*>(&psPathID, 1), "", psElse);
+    EmitIncrement(psSlot, false, psElse);
+
+    Value *psHotPath = psIsHot->getOperand(1);
+    for (std::vector<std::pair<TerminatorInst*, uint32_t> >::iterator itE =
+      vExits.begin(); itE != vExits.end(); itE++)
+    {
+      TerminatorInst *psTerm = itE->first;
+      BasicBlock *psExit = splitEdge(psTerm->getParent(),
+        psTerm->getSuccessor(itE->second), itE->second);
+      Instruction *psFlushPt = &*psExit->getFirstInsertionPt();
+      Value *psHot = new LoadInst(psHotCount, "", psFlushPt);
+      Value *psHotSlot = GetElementPtrInst::Create(psCounters,
+        ArrayRef<Value*>(&psHotPath, 1), "", psFlushPt);
+      Value *psTotal = new LoadInst(psHotSlot, "", psFlushPt);
+      psTotal = BinaryOperator::Create(Instruction::BinaryOps::Add, psTotal,
+        psHot, "", psFlushPt);
+      new StoreInst(psTotal, psHotSlot, psFlushPt);
+      new StoreInst(ConstantInt::get(psInt64Ty, 0), psHotCount, psFlushPt);
+    }
+  }
+  if (!vHotCounts.empty())
+  {
+    DominatorTree sDT;
+    sDT.recalculate(f);
+    PromoteMemToReg(vHotCounts, sDT);
+  }
+}
+
+/* This function instruments a function for edge profiling: counter i
+   counts CFG edge i of BLPP::ChooseEdgeCounters, and is incremented on
+   that edge if it is a chord. The counters are kept like those of small
+   path spaces, in a static array or, with -blppmmap, the mapped profile.
+*/
+void BLPPInstrumentation::InstrumentEdges(Function &f, uint32_t uiProcID,
+  BLPP &bp)
+{
+  std::vector<BLPPEdge*> &vEdges = bp.ChooseEdgeCounters();
+  IntegerType *psInt64Ty = IntegerType::get(f.getContext(), 64);
+  uint32_t uiNumCounters = vEdges.size();
+  GlobalVariable *psMappedVar = nullptr;
+  Value *psCounters = nullptr;
+
+  if (bMmap)
+  {
+    psMappedVar = CreateMappedCounters(f, uiProcID, uiNumCounters,
+      BLPP_STRATEGY_EDGE);
+  }
+  else
+  {
+    ArrayType *psCountersTy = ArrayType::get(psInt64Ty, uiNumCounters);
+    GlobalVariable *psArray = new GlobalVariable(*f.getParent(),
+      psCountersTy, false, GlobalValue::InternalLinkage,
+      ConstantAggregateZero::get(psCountersTy),
+      "blpp.counters." + Twine(uiProcID));
+    FunctionDescInfo sInfo = {uiProcID, uiNumCounters, BLPP_COUNTERS_DENSE,
+      BLPP_STRATEGY_EDGE, psArray, f.getName().str()};
+    vFuncDescs.push_back(sInfo);
+    psCounters = ConstantExpr::getPointerCast(psArray,
+      PointerType::getUnqual(psInt64Ty));
+  }
+
+  for (uint32_t i = 0; i < uiNumCounters; i++)
+  {
+    BLPPEdge *psEdge = vEdges[i];
+    if (!psEdge->isChord)
+      continue;
+    /* Returns are counted before the return */
+    BasicBlock *psTail = static_cast<BasicBlock*>
+      (psEdge->nodeTailP->vNodeDataP);
+    BasicBlock *psHead = static_cast<BasicBlock*>
+      (psEdge->nodeHeadP->vNodeDataP);
+    Instruction *psInsertionPt = splitEdge(psTail, psHead,
+      psEdge->uiSuccNum)->getTerminator();
+    Value *psBase = psCounters;
+    if (psMappedVar)
+      psBase = new LoadInst(psMappedVar, "", psInsertionPt);
+    Value *psIndex = ConstantInt::get(psInt64Ty, i);
+    Value *psSlot = GetElementPtrInst::CreateInBounds(psBase,
+      ArrayRef<Value*>(&psIndex, 1), "", psInsertionPt);
+    EmitIncrement(psSlot, bThreaded, psInsertionPt);
+  }
+}
+
+/* This function prepares a function for sampling (-blppsamplerate). Its
+   blocks are cloned into the checking version, which runs uninstrumented;
+   the original blocks are instrumented as usual. Control moves between the
+   two versions at function entry and on back edges, so every value used
+   outside its own block is demoted to the stack first (run -mem2reg after
+   this pass to promote them again). Static allocas are moved into a new
+   entry block shared by both versions.
+   Inputs:
+     f         -> Function to be instrumented
+     mChecking -> Receives the mapping from original to cloned values
+   Return Value:
+     The branch ending the new entry block, to the instrumented version
+*/
+BranchInst* BLPPInstrumentation::CloneCheckingVersion(Function &f,
+  ValueToValueMapTy &mChecking)
+{
+  BasicBlock *psEntry = &f.getEntryBlock();
+  BasicBlock *psFront = BasicBlock::Create(f.getContext(), "blpp.sample", &f,
+    psEntry);
+  BranchInst *psBranch = BranchInst::Create(psEntry, psFront);
+  std::vector<Instruction*> vDemote;
+  std::vector<PHINode*> vPhis;
+  std::vector<BasicBlock*> vBlocks;
+
+  for (BasicBlock::iterator it = psEntry->begin(); it != psEntry->end(); )
+  {
+    AllocaInst *psAlloca = dyn_cast<AllocaInst>(&*it++);
+    if (psAlloca && isa<Constant>(psAlloca->getArraySize()))
+      psAlloca->moveBefore(psBranch);
+  }
+
+  for (Function::iterator itBB = ++f.begin(); itBB != f.end(); itBB++)
+  {
+    vBlocks.push_back(&*itBB);
+    for (BasicBlock::iterator it = itBB->begin(); it != itBB->end(); it++)
+    {
+      if (PHINode *psPhi = dyn_cast<PHINode>(&*it))
+      {
+        vPhis.push_back(psPhi);
+        continue;
+      }
+      for (Value::use_iterator itU = it->use_begin(); itU != it->use_end();
+        itU++)
+      {
+        Instruction *psUser = cast<Instruction>(itU->getUser());
+        if ((psUser->getParent() != &*itBB) || isa<PHINode>(psUser))
+        {
+          vDemote.push_back(&*it);
+          break;
+        }
+      }
+    }
+  }
+  for (std::vector<Instruction*>::iterator it = vDemote.begin(); 
+    it != vDemote.end(); it++)
+    DemoteRegToStack(**it, false, psBranch);
+  for (std::vector<PHINode*>::iterator it = vPhis.begin(); 
+    it != vPhis.end(); it++)
+    DemotePHIToStack(*it, psBranch);
+
+  for (std::vector<BasicBlock*>::iterator it = vBlocks.begin(); 
+    it != vBlocks.end(); it++)
+    mChecking[*it] = CloneBasicBlock(*it, mChecking, ".chk", &f);
+  for (std::vector<BasicBlock*>::iterator it = vBlocks.begin(); 
+    it != vBlocks.end(); it++)
+  {
+    BasicBlock *psClone = cast<BasicBlock>(mChecking[*it]);
+    for (BasicBlock::iterator itI = psClone->begin(); itI != psClone->end();
+      itI++)
+      RemapInstruction(&*itI, mChecking, RF_IgnoreMissingEntries);
+  }
+  return psBranch;
+}
+
+/* This function copies the blocks of a function, before it is
+   instrumented, into the version run while profiling is off (-blpptoggle).
+   The copies use only the function's arguments and their own values, so
+   they are kept out of the function until AddToggledVersion, and the
+   instrumentation never sees them. Functions with blocks whose address is
+   taken are not copied, since indirect branches would leave the copy.
+   Inputs:
+     f    -> Function to be instrumented
+     vOff -> Receives the copies, the entry block first
+*/
+void BLPPInstrumentation::CloneToggledVersion(Function &f,
+  std::vector<BasicBlock*> &vOff)
+{
+  ValueToValueMapTy mOff;
+
+  for (Function::iterator it = f.begin(); it != f.end(); it++)
+  {
+    if (it->hasAddressTaken())
+      return;
+  }
+  for (Function::iterator it = f.begin(); it != f.end(); it++)
+  {
+    BasicBlock *psClone = CloneBasicBlock(&*it, mOff, ".off");
+    mOff[&*it] = psClone;
+    vOff.push_back(psClone);
+  }
+  for (std::vector<BasicBlock*>::iterator it = vOff.begin();
+    it != vOff.end(); it++)
+  {
+    for (BasicBlock::iterator itI = (*it)->begin(); itI != (*it)->end();
+      itI++)
+      RemapInstruction(&*itI, mOff, RF_IgnoreMissingEntries);
+  }
+}
+
+/* This function adds the copies made by CloneToggledVersion to the
+   instrumented function, behind a new entry block that picks a version:
+     if (__blpp_enabled) goto instrumented; else goto copy;
+   The two versions never branch into each other, so profiling off costs
+   one load and one branch per call. Static allocas of both versions are
+   moved into the new entry block.
+*/
+void BLPPInstrumentation::AddToggledVersion(Function &f,
+  std::vector<BasicBlock*> &vOff)
+{
+  if (vOff.empty())
+    return;
+  BasicBlock *psEntry = &f.getEntryBlock();
+  BasicBlock *psDispatch = BasicBlock::Create(f.getContext(), "blpp.toggle",
+    &f, psEntry);
+  for (std::vector<BasicBlock*>::iterator it = vOff.begin();
+    it != vOff.end(); it++)
+    f.getBasicBlockList().push_back(*it);
+  Value *psFlag = new LoadInst(psEnabled, "", psDispatch);
+  Value *psIsOn = new ICmpInst(*psDispatch, ICmpInst::ICMP_NE, psFlag,
+    ConstantInt::get(psFlag->getType(), 0));
+  BranchInst *psBranch = BranchInst::Create(psEntry, vOff[0], psIsOn,
+    psDispatch);
+
+  BasicBlock *apsEntries[2] = {psEntry, vOff[0]};
+  for (uint32_t i = 0; i < 2; i++)
+  {
+    for (BasicBlock::iterator it = apsEntries[i]->begin();
+      it != apsEntries[i]->end(); )
+    {
+      AllocaInst *psAlloca = dyn_cast<AllocaInst>(&*it++);
+      if (psAlloca && isa<Constant>(psAlloca->getArraySize()))
+        psAlloca->moveBefore(psBranch);
+    }
+  }
+}
+
+/* This function replaces an unconditional branch with the sampling
+   countdown:
+     if (--countdown == 0) { countdown = rate; goto sampled; }
+     goto unsampled;
+*/
+void BLPPInstrumentation::EmitSampleCheck(BranchInst *psBranch, 
+  BasicBlock *psSampled, BasicBlock *psUnsampled)
+{
+  LLVMContext &sContext = psBranch->getContext();
+  IntegerType *psInt32Ty = IntegerType::get(sContext, 32);
+  Value *psCount = new LoadInst(psSampleCountdown, "", psBranch);
+  psCount = BinaryOperator::Create(Instruction::BinaryOps::Sub, psCount,
+    ConstantInt::get(psInt32Ty, 1), "", psBranch);
+  Value *psSample = new ICmpInst(psBranch, ICmpInst::ICMP_EQ, psCount,
+    ConstantInt::get(psInt32Ty, 0));
+  Value *psNext = SelectInst::Create(psSample, 
+    ConstantInt::get(psInt32Ty, uiRate), psCount, "", psBranch);
+  new StoreInst(psNext, psSampleCountdown, psBranch);
+  BranchInst::Create(psSampled, psUnsampled, psSample, psBranch)->setMetadata
+    (LLVMContext::MD_prof, 
+     MDBuilder(sContext).createBranchWeights(1, uiRate - 1));
+  psBranch->eraseFromParent();
+}
+
+/* This function creates the variable holding the path table of a function
+   with a large path space. It initially points to the runtime's empty
+   table, so that the first increment allocates a real one. The variable is
+   thread local in every build, as the runtime's tables are only ever
+   updated by the thread that created them.
+*/
+GlobalVariable* BLPPInstrumentation::CreatePathTable(Function &f, 
+  uint32_t uiProcID)
+{
+  PointerType *psTablePtrTy = PointerType::getUnqual(psPathTableTy);
+  return new GlobalVariable(*f.getParent(), psTablePtrTy, false, 
+    GlobalValue::InternalLinkage, 
+    ConstantExpr::getPointerCast(psEmptyTable, psTablePtrTy),
+    "blpp.table." + Twine(uiProcID), nullptr,
+    GlobalVariable::InitialExecTLSModel);
+}
+
+/* This function creates the counter storage of a dense function in builds
+   with -blppmmap: a counter array, and the pointer through which the
+   instrumented code reaches it. The pointer refers to the static array
+   until the runtime moves the counters into the mapped profile.
+   Return Value:
+     The pointer variable
+*/
+GlobalVariable* BLPPInstrumentation::CreateMappedCounters(Function &f,
+  uint32_t uiProcID, uint32_t uiNumPaths, uint32_t uiFlags)
+{
+  IntegerType *psInt64Ty = IntegerType::get(f.getContext(), 64);
+  ArrayType *psArrayTy = ArrayType::get(psInt64Ty, uiNumPaths);
+  GlobalVariable *psArray = new GlobalVariable(*f.getParent(), psArrayTy,
+    false, GlobalValue::InternalLinkage, 
+    ConstantAggregateZero::get(psArrayTy), 
+    "blpp.records." + Twine(uiProcID));
+  PointerType *psCountersTy = PointerType::getUnqual(psInt64Ty);
+  GlobalVariable *psMappedVar = new GlobalVariable(*f.getParent(), 
+    psCountersTy, false, GlobalValue::InternalLinkage,
+    ConstantExpr::getPointerCast(psArray, psCountersTy),
+    "blpp.counters." + Twine(uiProcID));
+  FunctionDescInfo sInfo = {uiProcID, uiNumPaths, BLPP_COUNTERS_MAPPED,
+    uiFlags, psMappedVar, f.getName().str()};
+  vFuncDescs.push_back(sInfo);
+  return psMappedVar;
+}
+
+/* This function returns the ID of a function as the runtime knows it: the
+   runtime gives every module a range of IDs when it registers the module
+   descriptor, and stores the first one in psIDBase.
+*/
+Value* BLPPInstrumentation::LoadFunctionID(uint32_t uiProcID,
+  Instruction *psInsertionPt)
+{
+  Value *psBase = new LoadInst(psIDBase, "", psInsertionPt);
+  return BinaryOperator::Create(Instruction::BinaryOps::Add, psBase,
+    ConstantInt::get(psBase->getType(), uiProcID), "", psInsertionPt);
+}
+
+/* This function increments the 64 bit counter at psCounter. Shared counters
+   of threaded builds are incremented atomically.
+*/
+void BLPPInstrumentation::EmitIncrement(Value *psCounter, bool isAtomic,
+  Instruction *psInsertionPt)
+{
+  Constant *psOne = ConstantInt::get(IntegerType::get
+    (psInsertionPt->getContext(), 64), 1);
+  if (isAtomic)
+  {
+    new AtomicRMWInst(AtomicRMWInst::Add, psCounter, psOne, Monotonic,
+      CrossThread, psInsertionPt);
+  }
+  else
+  {
+    Value *psCount = new LoadInst(psCounter, "", psInsertionPt);
+    psCount = BinaryOperator::Create(Instruction::BinaryOps::Add,
+      psCount, psOne, "", psInsertionPt);
+    new StoreInst(psCount, psCounter, psInsertionPt);
+  }
+}
+
+/* This function inlines the common case of a path table increment in front
+   of the call to __blpp_table_miss that records the path:
+     slot = &table->slots[((pathid * BLPP_HASH_MUL) >> 32) & table->mask];
+     if (slot->key == pathid + 1)
+       slot->count++;
+     else
+       __blpp_table_miss(&table, pathid, idbase + procid);
+   This splits the block of the call, so it must only be done once all the
+   edges of the function have been instrumented.
+*/
+void BLPPInstrumentation::InlineTableProbe(CallInst *psMiss)
+{
+  LLVMContext &sContext = psMiss->getContext();
+  IntegerType *psInt64Ty = IntegerType::get(sContext, 64);
+  IntegerType *psInt32Ty = IntegerType::get(sContext, 32);
+  Value *psTableVar = psMiss->getArgOperand(0);
+  Value *psPathID = psMiss->getArgOperand(1);
+  Value *apsIdx[2] = {ConstantInt::get(psInt32Ty, 0), 
+    ConstantInt::get(psInt32Ty, 0)};
+
+  Value *psTable = new LoadInst(psTableVar, "", psMiss);
+  Value *psSlots = new LoadInst(GetElementPtrInst::CreateInBounds(psTable,
+    ArrayRef<Value*>(apsIdx, 2), "", psMiss), "", psMiss);
+  apsIdx[1] = ConstantInt::get(psInt32Ty, 1);
+  Value *psMask = new LoadInst(GetElementPtrInst::CreateInBounds(psTable,
+    ArrayRef<Value*>(apsIdx, 2), "", psMiss), "", psMiss);
+
+  Value *psHome = BinaryOperator::Create(Instruction::BinaryOps::Mul, psPathID,
+    ConstantInt::get(psInt64Ty, BLPP_HASH_MUL), "", psMiss);
+  psHome = BinaryOperator::Create(Instruction::BinaryOps::LShr, psHome,
+    ConstantInt::get(psInt64Ty, 32), "", psMiss);
+  psHome = BinaryOperator::Create(Instruction::BinaryOps::And, psHome, psMask,
+    "", psMiss);
+  Value *psSlot = GetElementPtrInst::CreateInBounds(psSlots, 
+    ArrayRef<Value*>(&psHome, 1), "", psMiss);
+
+  apsIdx[1] = ConstantInt::get(psInt32Ty, 0);
+  Value *psKey = new LoadInst(GetElementPtrInst::CreateInBounds(psSlot,
+    ArrayRef<Value*>(apsIdx, 2), "", psMiss), "", psMiss);
+  Value *psWanted = BinaryOperator::Create(Instruction::BinaryOps::Add, 
+    psPathID, ConstantInt::get(psInt64Ty, 1), "", psMiss);
+  Value *psHit = new ICmpInst(psMiss, ICmpInst::ICMP_EQ, psKey, psWanted);
+
+  TerminatorInst *psThen, *psElse;
+  SplitBlockAndInsertIfThenElse(psHit, psMiss, &psThen, &psElse,
+    MDBuilder(sContext).createBranchWeights(1 << 20, 1));
+
+  apsIdx[1] = ConstantInt::get(psInt32Ty, 1);
+  Value *psCountAddr = GetElementPtrInst::CreateInBounds(psSlot,
+    ArrayRef<Value*>(apsIdx, 2), "", psThen);
+  EmitIncrement(psCountAddr, false, psThen);
+
+  psMiss->moveBefore(psElse);
+  /* Only the miss needs the function ID */
+  uint32_t uiProcID = cast<ConstantInt>(psMiss->getArgOperand(2))
+    ->getZExtValue();
+  psMiss->setArgOperand(2, LoadFunctionID(uiProcID, psMiss));
+}
+
+/* This function returns the calling thread's counter array for a dense
+   function in threaded builds. The array is cached in a thread-local pointer,
+   which is loaded once at function entry; only the first call on each thread
+   goes to the runtime to allocate it.
+   Inputs:
+     f          -> Function being instrumented
+     uiProcID   -> ID of the function
+     uiNumPaths -> Number of paths of the function
+   Return Value:
+     The load of the thread-local pointer. Its null check is inserted by
+     GuardThreadCounters once the function has been instrumented.
+*/
+LoadInst* BLPPInstrumentation::LoadThreadCounters(Function &f, 
+  uint32_t uiProcID, uint32_t uiNumPaths)
+{
+  PointerType *psCountersTy = PointerType::getUnqual
+    (IntegerType::get(f.getContext(), 64));
+  GlobalVariable *psTLSCounters = new GlobalVariable(*f.getParent(),
+    psCountersTy, false, GlobalValue::InternalLinkage, 
+    ConstantPointerNull::get(psCountersTy), 
+    "blpp.tcounters." + Twine(uiProcID), nullptr, 
+    GlobalVariable::InitialExecTLSModel);
+
+  /* Load after the allocas, so that they stay in the entry block when the
+     null check splits it
+  */
+  BasicBlock::iterator itPt = f.getEntryBlock().getFirstInsertionPt();
+  while (isa<AllocaInst>(itPt))
+    itPt++;
+  return new LoadInst(psTLSCounters, "counters", &*itPt);
+}
+
+/* This function makes the first call on each thread allocate the thread's
+   counter array before psBase reads it:
+     if (!tls) tls = __blpp_thread_counters(idbase + id, n);
+     counters = tls;
+*/
+void BLPPInstrumentation::GuardThreadCounters(LoadInst *psBase, 
+  uint32_t uiProcID, uint32_t uiNumPaths)
+{
+  LLVMContext &sContext = psBase->getContext();
+  IntegerType *psInt32Ty = IntegerType::get(sContext, 32);
+  Value *psTLSCounters = psBase->getPointerOperand();
+  Value *psCached = new LoadInst(psTLSCounters, "", psBase);
+  Value *psIsNull = new ICmpInst(psBase, ICmpInst::ICMP_EQ, psCached,
+    ConstantPointerNull::get(cast<PointerType>(psCached->getType())));
+  TerminatorInst *psThen = SplitBlockAndInsertIfThen(psIsNull, psBase, false,
+    MDBuilder(sContext).createBranchWeights(1, 1 << 20));
+  Value *apsArgs[2] = {LoadFunctionID(uiProcID, psThen),
+    ConstantInt::get(psInt32Ty, uiNumPaths)};
+  Value *psNew = CallInst::Create(psThreadCounters, 
+    ArrayRef<Value*>(apsArgs, 2), "", psThen);
+  new StoreInst(psNew, psTLSCounters, psThen);
 }
 
 void BLPPInstrumentation::replacePhiUsesWith(BasicBlock *psChild,
@@ -38,23 +1140,108 @@ void BLPPInstrumentation::replaceTarget(TerminatorInst *psTerm,
 }
 
 void BLPPInstrumentation::InstrumentFunction(Function &f, uint32_t uiProcID,
-  BLPP &bp)
+  BLPP &bp, uint32_t uiStrategy)
 {
+  if (BLPP_STRATEGY_EDGE == uiStrategy)
+  {
+    InstrumentEdges(f, uiProcID, bp);
+    return;
+  }
+  ValueToValueMapTy mChecking;
+  BranchInst *psSampleBranch = nullptr;
+  std::vector<SampledBackEdge> vBackEdges;
+  if (uiStrategy ? (BLPP_STRATEGY_SAMPLED == uiStrategy) : (uiRate > 1))
+    psSampleBranch = CloneCheckingVersion(f, mChecking);
+
   LLVMContext &sContext = f.getContext();
   BasicBlock &sFront = f.getEntryBlock();
   IntegerType *psInt64Ty = IntegerType::get(sContext, 64);
   IntegerType *psInt32Ty = IntegerType::get(sContext, 32);
   Value *psProcID = ConstantInt::get(psInt32Ty, uiProcID);
-  Value *psPathSumVar = new AllocaInst(psInt64Ty, "pathsum", sFront.getFirstNonPHI());
-  ArrayRef<Value*> sRef3(&psProcID, 1);
-  
-  CallInst::Create(psRecordEntry, sRef3, "", sFront.getFirstNonPHI());
+  Instruction *psFrontPt = sFront.getFirstNonPHI();
+  AllocaInst *psPathSumVar = new AllocaInst(psInt64Ty, "pathsum", psFrontPt);
+  new StoreInst(ConstantInt::get(psInt64Ty, 0), psPathSumVar, psFrontPt);
+  Value *psCounters = nullptr;
+  GlobalVariable *psPathTable = nullptr, *psMappedVar = nullptr;
+  LoadInst *psThreadBase = nullptr;
+  std::vector<CallInst*> vTableProbes;
+  std::vector<BinaryOperator*> vIncrements;
+  std::vector<HotLoopRead> vHotReads;
+  uint32_t uiNumPaths = bp.bnEntryP->siNumPaths;
+  FunctionDescInfo sInfo = {uiProcID, uiNumPaths, BLPP_COUNTERS_CALL,
+    bp.uiPathFlags | uiStrategy, nullptr, f.getName().str()};
+
+  if ((uiNumPaths < uiDenseLimit) && bMmap)
+  {
+    psMappedVar = CreateMappedCounters(f, uiProcID, uiNumPaths,
+      sInfo.uiFlags);
+  }
+  else if ((uiNumPaths < uiDenseLimit) && bThreaded)
+  {
+    psCounters = psThreadBase = LoadThreadCounters(f, uiProcID, uiNumPaths);
+    sInfo.uiCounters = BLPP_COUNTERS_THREAD;
+    vFuncDescs.push_back(sInfo);
+  }
+  else if (uiNumPaths < uiDenseLimit)
+  {
+    /* Small path space: count paths in a static array indexed by path sum */
+    ArrayType *psCountersTy = ArrayType::get(psInt64Ty, uiNumPaths);
+    GlobalVariable *psArray = new GlobalVariable(*f.getParent(), 
+      psCountersTy, false, GlobalValue::InternalLinkage, 
+      ConstantAggregateZero::get(psCountersTy),
+      "blpp.counters." + Twine(uiProcID));
+    sInfo.uiCounters = BLPP_COUNTERS_DENSE;
+    sInfo.psCounters = psArray;
+    vFuncDescs.push_back(sInfo);
+    psCounters = ConstantExpr::getPointerCast(psArray, 
+      PointerType::getUnqual(psInt64Ty));
+  }
+  else
+  {
+    if (bPathTable)
+      psPathTable = CreatePathTable(f, uiProcID);
+    vFuncDescs.push_back(sInfo);
+  }
+
+  std::vector<SelectBranch> vSelectBranches;
+  std::set<BLPPEdge*> sSelectEdges;
+  if (bSelectIncr)
+    CollectSelectBranches(f, bp, vSelectBranches);
+  for (std::vector<SelectBranch>::iterator it = vSelectBranches.begin();
+    it != vSelectBranches.end(); it++)
+    sSelectEdges.insert(it->apsEdges, it->apsEdges + 2);
+
+  /* Edges out of switches that get a table (see EmitSwitchIncrement) */
+  std::map<SwitchInst*, std::vector<BLPPEdge*> > mSwitches;
+  std::set<BLPPEdge*> sTableEdges;
+  for (std::vector<BLPPEdge*>::iterator it = bp.lEdges.begin(); 
+    it != bp.lEdges.end(); it++)
+  {
+    BLPPEdge *psEdge = *it;
+    BasicBlock *psTail = static_cast<BasicBlock*>
+      (psEdge->nodeTailP->vNodeDataP);
+    int64_t siMin;
+    uint64_t uLRange;
+    if ((psEdge->beDummyMatchP && psEdge->nodeHeadP->vNodeDataP) || !psTail)
+      continue;
+    SwitchInst *psSwitch = dyn_cast<SwitchInst>(psTail->getTerminator());
+    if (!psSwitch || !GetCaseRange(psSwitch, siMin, uLRange))
+      continue;
+    std::vector<BLPPEdge*> &vEdges = mSwitches[psSwitch];
+    vEdges.resize(psSwitch->getNumSuccessors());
+    vEdges[psEdge->uiSuccNum] = psEdge;
+    sTableEdges.insert(psEdge);
+  }
+
   /* Insert instrumentation code on relevant edges */
-  for (std::list<BLPPEdge*>::iterator it = bp.lEdges.begin(); 
+  for (std::vector<BLPPEdge*>::iterator it = bp.lEdges.begin(); 
     it != bp.lEdges.end(); it++)
   {
     BLPPEdge *psEdge = *it;
     BasicBlock *psHead, *psTail;
+    if (sSelectEdges.count(psEdge) ||
+      (sTableEdges.count(psEdge) && (PATH_SUM_READ != psEdge->atKind)))
+      continue;
     if (psEdge->beDummyMatchP)
     {
       assert(psEdge->atKind != PATH_SUM_INIT);
@@ -84,6 +1271,8 @@ void BLPPInstrumentation::InstrumentFunction(Function &f, uint32_t uiProcID,
       psHead = static_cast<BasicBlock*>(psEdge->nodeHeadP->vNodeDataP);
       psTail = static_cast<BasicBlock*>(psEdge->nodeTailP->vNodeDataP);
     }
+    if ((INVALID != psEdge->atKind) && isCriticalEdge(psTail, psHead))
+      uiSplitEdges++;
     switch(psEdge->atKind)
     {
       case INVALID:
@@ -92,7 +1281,8 @@ void BLPPInstrumentation::InstrumentFunction(Function &f, uint32_t uiProcID,
       }
       case PATH_SUM_INIT:
       {
-        BasicBlock *psInsertionBlock = splitEdge(psTail, psHead);
+        BasicBlock *psInsertionBlock = splitEdge(psTail, psHead,
+          psEdge->uiSuccNum);
         Instruction *psInsertionPt = psInsertionBlock->getTerminator();
         new StoreInst
           (ConstantInt::get(psInt64Ty, psEdge->siIncrement),
@@ -101,27 +1291,78 @@ void BLPPInstrumentation::InstrumentFunction(Function &f, uint32_t uiProcID,
       }
       default:
       {
-        BasicBlock *psNewInsertionBlock = splitEdge(psTail, psHead);
+        BasicBlock *psNewInsertionBlock = splitEdge(psTail, psHead,
+          psEdge->uiSuccNum);
         Instruction *psInsertionPt = psNewInsertionBlock->getTerminator();
         Value *psCurPathSum = new LoadInst(psPathSumVar, "", psInsertionPt);
-        if (psEdge->siIncrement)
+        if (psEdge->siIncrement && !sTableEdges.count(psEdge))
         {
-          psCurPathSum = BinaryOperator::Create(Instruction::BinaryOps::Add, 
-            psCurPathSum, ConstantInt::get(psInt64Ty, psEdge->siIncrement),
-            "", psInsertionPt);
+          BinaryOperator *psIncrement = BinaryOperator::Create
+            (Instruction::BinaryOps::Add, psCurPathSum,
+            ConstantInt::get(psInt64Ty, psEdge->siIncrement), "",
+            psInsertionPt);
+          vIncrements.push_back(psIncrement);
+          psCurPathSum = psIncrement;
           if (PATH_SUM_INCR == psEdge->atKind)
           {
             /* Save path sum */
             new StoreInst(psCurPathSum, psPathSumVar, psInsertionPt);
           }
         }
-        if (PATH_SUM_READ == psEdge->atKind)
+        if ((PATH_SUM_READ == psEdge->atKind) &&
+          (bp.uiPathFlags & BLPP_FUNC_HASHED))
+        {
+          /* The path ID is the path sum modulo the hash size */
+          psCurPathSum = BinaryOperator::Create(Instruction::BinaryOps::And,
+            psCurPathSum, ConstantInt::get(psInt64Ty, bp.uLHashMask), "",
+            psInsertionPt);
+        }
+        if ((PATH_SUM_READ == psEdge->atKind) && psCounters && bHotLoops &&
+          !psThreadBase && !psSampleBranch && psEdge->beDummyMatchP &&
+          !psEdge->nodeHeadP->vNodeDataP)
+        {
+          /* Back edge; its hot path may be counted in a register */
+          ICmpInst *psIsHot = new ICmpInst(psInsertionPt, ICmpInst::ICMP_EQ,
+            psCurPathSum, ConstantInt::get(psInt64Ty,
+            PredictHotPath(bp, psEdge, uiProcID)));
+          HotLoopRead sRead = {psIsHot, psCurPathSum, psHead};
+          vHotReads.push_back(sRead);
+        }
+        else if ((PATH_SUM_READ == psEdge->atKind) && psCounters)
+        {
+          /* counters[pathsum]++ */
+          Value *psSlot = GetElementPtrInst::Create(psCounters, 
+            ArrayRef<Value*>(&psCurPathSum, 1), "", psInsertionPt);
+          EmitIncrement(psSlot, false, psInsertionPt);
+        }
+        else if ((PATH_SUM_READ == psEdge->atKind) && psMappedVar)
+        {
+          /* counters[pathsum]++, in the mapped profile */
+          Value *psMapped = new LoadInst(psMappedVar, "", psInsertionPt);
+          Value *psSlot = GetElementPtrInst::CreateInBounds(psMapped,
+            ArrayRef<Value*>(&psCurPathSum, 1), "", psInsertionPt);
+          EmitIncrement(psSlot, bThreaded, psInsertionPt);
+        }
+        else if ((PATH_SUM_READ == psEdge->atKind) && psPathTable)
+        {
+          /* Table, PathID, ProcID; the lookup is inlined later, and the
+             ProcID made global then
+          */
+          Value* apsArgs[3] = {psPathTable, psCurPathSum, psProcID};
+          vTableProbes.push_back(CallInst::Create(psTableMiss, 
+            ArrayRef<Value*>(apsArgs, 3), "", psInsertionPt));
+        }
+        else if (PATH_SUM_READ == psEdge->atKind)
         {
           /* PathID, ProcID */
-          Value* apsArgs[2] = {psCurPathSum, psProcID};
+          Value* apsArgs[2] = {psCurPathSum, 
+            LoadFunctionID(uiProcID, psInsertionPt)};
           ArrayRef<Value*> sRef(apsArgs, 2);
           CallInst::Create(psRecordPathSum, sRef, "", 
             psInsertionPt);
+        }
+        if (PATH_SUM_READ == psEdge->atKind)
+        {
           if (psEdge->isReset)
           {
             /* Initialize path sum */
@@ -130,23 +1371,309 @@ void BLPPInstrumentation::InstrumentFunction(Function &f, uint32_t uiProcID,
               psPathSumVar, psInsertionPt);
           }
         }
+        if (psSampleBranch && psEdge->beDummyMatchP && 
+          !psEdge->nodeHeadP->vNodeDataP)
+        {
+          /* Back edge; the sample ends here */
+          BLPPEdge *psFromEntry = psEdge->beDummyMatchP;
+          SampledBackEdge sBackEdge = {psTail, psHead, 
+            cast<TerminatorInst>(psInsertionPt),
+            psEdge->isReset ? psEdge->siReset : 0, psEdge->uiSuccNum};
+          if (PATH_SUM_INCR == psFromEntry->atKind)
+            sBackEdge.siPathSum += psFromEntry->siIncrement;
+          assert((psNewInsertionBlock != psHead) && "Back edge into a header "
+            "with a single predecessor");
+          vBackEdges.push_back(sBackEdge);
+        }
         break;
       }
     }
   }
-  /* serialize path profile data */
-  for (std::list<BLPPEdge*>::iterator it = bp.bnExitP->lInEdges.begin(); 
-   it != bp.bnExitP->lInEdges.end(); it++)  
+  if (psSampleBranch)
+  {
+    /* Connect the versions: calls and loop iterations start in the
+       instrumented version when the countdown expires, and the instrumented
+       version goes back to the checking version on every back edge
+    */
+    EmitSampleCheck(psSampleBranch, psSampleBranch->getSuccessor(0),
+      cast<BasicBlock>(mChecking[psSampleBranch->getSuccessor(0)]));
+    for (std::vector<SampledBackEdge>::iterator it = vBackEdges.begin();
+      it != vBackEdges.end(); it++)
+    {
+      BasicBlock *psCheckTail = cast<BasicBlock>(mChecking[it->psTail]);
+      BasicBlock *psCheckHead = cast<BasicBlock>(mChecking[it->psHead]);
+      replaceTarget(it->psExitBranch, it->psHead, psCheckHead);
+      BranchInst *psBranch = cast<BranchInst>
+        (splitEdge(psCheckTail, psCheckHead, it->uiSuccNum)->getTerminator());
+      assert(psBranch->isUnconditional());
+      new StoreInst(ConstantInt::get(psInt64Ty, it->siPathSum), psPathSumVar,
+        psBranch);
+      EmitSampleCheck(psBranch, it->psHead, psCheckHead);
+    }
+  }
+  /* After the other edges, so that updates for edges into the branch's
+     block, placed before its terminator, come first
+  */
+  for (std::map<SwitchInst*, std::vector<BLPPEdge*> >::iterator it =
+    mSwitches.begin(); it != mSwitches.end(); it++)
+    EmitSwitchIncrement(it->first, it->second, psPathSumVar, uiProcID);
+  for (std::vector<SelectBranch>::iterator it = vSelectBranches.begin();
+    it != vSelectBranches.end(); it++)
+    EmitSelectIncrement(*it, psPathSumVar);
+  for (std::vector<CallInst*>::iterator it = vTableProbes.begin();
+    it != vTableProbes.end(); it++)
+    InlineTableProbe(*it);
+  EmitHotPathCounters(f, vHotReads, psCounters);
+  if (psThreadBase)
+    GuardThreadCounters(psThreadBase, uiProcID, uiNumPaths);
+  PromotePathSum(f, psPathSumVar, vIncrements);
+}
+
+/* This function turns the path sum into SSA form, with phis where paths
+   merge, so that it is kept in a register rather than on the stack. The
+   increments along a chain of edges are then folded into one:
+     (x + c1) + c2  ->  x + (c1 + c2)
+   and constant path sums, left by initializations, are propagated.
+   Inputs:
+     f            -> Instrumented function
+     psPathSumVar -> The path sum variable
+     vIncrements  -> Path sum increments emitted for chords
+*/
+void BLPPInstrumentation::PromotePathSum(Function &f, AllocaInst *psPathSumVar,
+  std::vector<BinaryOperator*> &vIncrements)
+{
+  std::set<BinaryOperator*> sLive(vIncrements.begin(), vIncrements.end());
+  DominatorTree sDT;
+  sDT.recalculate(f);
+  assert(isAllocaPromotable(psPathSumVar) && "Path sum escapes");
+  PromoteMemToReg(ArrayRef<AllocaInst*>(&psPathSumVar, 1), sDT);
+
+  for (std::vector<BinaryOperator*>::iterator it = vIncrements.begin();
+    it != vIncrements.end(); it++)
+  {
+    BinaryOperator *psAdd = *it;
+    if (!sLive.count(psAdd))
+      continue;
+    ConstantInt *psConst = cast<ConstantInt>(psAdd->getOperand(1));
+    BinaryOperator *psInner = dyn_cast<BinaryOperator>(psAdd->getOperand(0));
+    while (psInner && sLive.count(psInner) && psInner->hasOneUse())
+    {
+      psConst = ConstantInt::get(psConst->getContext(), psConst->getValue() +
+        cast<ConstantInt>(psInner->getOperand(1))->getValue());
+      psAdd->setOperand(0, psInner->getOperand(0));
+      psAdd->setOperand(1, psConst);
+      sLive.erase(psInner);
+      psInner->eraseFromParent();
+      psInner = dyn_cast<BinaryOperator>(psAdd->getOperand(0));
+    }
+    if (ConstantInt *psBase = dyn_cast<ConstantInt>(psAdd->getOperand(0)))
+    {
+      psAdd->replaceAllUsesWith(ConstantInt::get(psConst->getContext(),
+        psBase->getValue() + psConst->getValue()));
+      sLive.erase(psAdd);
+      psAdd->eraseFromParent();
+    }
+  }
+}
+
+/* This function emits the module descriptor (BLPPModuleDesc in blpp_if.h),
+   which lists every instrumented function with its name, ID, path count
+   and counters, and a global constructor that registers it with the
+   runtime. The runtime then assigns the module its range of function IDs,
+   writes the dense counter arrays out at exit, and moves mapped counters
+   into the memory mapped profile. The descriptor also carries the sampling
+   rate, and the build ID that tells profiles of different builds apart.
+*/
+void BLPPInstrumentation::EmitModuleDescriptor(Module &m, uint64_t uLBuildID)
+{
+  LLVMContext &sContext = m.getContext();
+  IntegerType *psInt32Ty = IntegerType::get(sContext, 32);
+  IntegerType *psInt64Ty = IntegerType::get(sContext, 64);
+  PointerType *psBytePtrTy = Type::getInt8PtrTy(sContext);
+  Type *psVoidType = Type::getVoidTy(sContext);
+
+  Type *apsFuncTypes[6] = {psBytePtrTy, psBytePtrTy, psInt32Ty, psInt32Ty,
+    psInt32Ty, psInt32Ty};
+  StructType *psFuncDescTy = StructType::create(sContext, 
+    ArrayRef<Type*>(apsFuncTypes, 6), "blpp.funcdesc");
+  StructType *psModuleDescTy = StructType::create(sContext, "blpp.moduledesc");
+  Type *apsModuleTypes[8] = {psInt32Ty, psInt32Ty, psInt64Ty, psInt32Ty,
+    psInt32Ty, PointerType::getUnqual(psInt32Ty), 
+    PointerType::getUnqual(psFuncDescTy), 
+    PointerType::getUnqual(psModuleDescTy)};
+  psModuleDescTy->setBody(ArrayRef<Type*>(apsModuleTypes, 8));
+
+  std::vector<Constant*> vFuncs;
+  for (std::vector<FunctionDescInfo>::iterator it = vFuncDescs.begin();
+    it != vFuncDescs.end(); it++)
+  {
+    Constant *psName = ConstantDataArray::getString(sContext, it->sName);
+    GlobalVariable *psNameVar = new GlobalVariable(m, psName->getType(), true,
+      GlobalValue::PrivateLinkage, psName, "blpp.name." + Twine(it->uiProcID));
+    Constant *apsFields[6] = {
+      ConstantExpr::getPointerCast(psNameVar, psBytePtrTy),
+      it->psCounters ? ConstantExpr::getPointerCast(it->psCounters, 
+        psBytePtrTy) : ConstantPointerNull::get(psBytePtrTy),
+      ConstantInt::get(psInt32Ty, it->uiProcID),
+      ConstantInt::get(psInt32Ty, it->uiNumPaths),
+      ConstantInt::get(psInt32Ty, it->uiCounters),
+      ConstantInt::get(psInt32Ty, it->uiFlags)};
+    vFuncs.push_back(ConstantStruct::get(psFuncDescTy, 
+      ArrayRef<Constant*>(apsFields, 6)));
+  }
+  ArrayType *psFuncsTy = ArrayType::get(psFuncDescTy, vFuncs.size());
+  GlobalVariable *psFuncs = new GlobalVariable(m, psFuncsTy, true,
+    GlobalValue::InternalLinkage, ConstantArray::get(psFuncsTy, vFuncs),
+    "blpp.functions");
+
+  Constant *apsModule[8] = {ConstantInt::get(psInt32Ty, BLPP_MODULE_VERSION),
+    ConstantInt::get(psInt32Ty, vFuncs.size()),
+    ConstantInt::get(psInt64Ty, uLBuildID),
+    ConstantInt::get(psInt32Ty, uiRate),
+    ConstantInt::get(psInt32Ty, 0), psIDBase,
+    ConstantExpr::getPointerCast(psFuncs, 
+      PointerType::getUnqual(psFuncDescTy)),
+    ConstantPointerNull::get(PointerType::getUnqual(psModuleDescTy))};
+  GlobalVariable *psModuleDesc = new GlobalVariable(m, psModuleDescTy, false,
+    GlobalValue::InternalLinkage, ConstantStruct::get(psModuleDescTy,
+    ArrayRef<Constant*>(apsModule, 8)), "blpp.module");
+
+  Type *apsRegisterTypes[1] = {PointerType::getUnqual(psModuleDescTy)};
+  FunctionType *psRegisterType = FunctionType::get(psVoidType,
+    ArrayRef<Type*>(apsRegisterTypes, 1), false);
+  psRegisterModule = m.getOrInsertFunction("__blpp_register_module",
+    psRegisterType);
+
+  FunctionType *psCtorType = FunctionType::get(psVoidType, false);
+  Function *psCtor = Function::Create(psCtorType, GlobalValue::InternalLinkage,
+    "blpp.register_module", &m);
+  BasicBlock *psBody = BasicBlock::Create(sContext, "", psCtor);
+  ReturnInst *psRet = ReturnInst::Create(sContext, psBody);
+  Value *psArg = psModuleDesc;
+  CallInst::Create(psRegisterModule, ArrayRef<Value*>(&psArg, 1), "", psRet);
+  /* Ahead of other constructors, which may run instrumented code */
+  appendToGlobalCtors(m, psCtor, 0);
+}
+
+/* This function folds bytes into an FNV-1a hash */
+static uint64_t HashBytes(uint64_t uLHash, const void *vP, size_t uiSize)
+{
+  const unsigned char *pucP = (const unsigned char*) vP;
+  for (size_t i = 0; i < uiSize; i++)
+  {
+    uLHash ^= pucP[i];
+    uLHash *= 0x100000001B3ULL;
+  }
+  return uLHash;
+}
+
+/* This function finds the conditional branches of a function whose
+   instrumentation can be done with a select (-blppselectincr): both
+   successor edges are tree edges or chords that only initialize or
+   increment the path sum, and at least one of them is critical. Back edges
+   count paths, so branches with a back edge are left alone.
+   Inputs:
+     f         -> Function being instrumented
+     bp        -> Its BLPP graph
+     vBranches -> Receives the branches
+*/
+void BLPPInstrumentation::CollectSelectBranches(Function &f, BLPP &bp,
+  std::vector<SelectBranch> &vBranches)
+{
+  std::map<BasicBlock*, SelectBranch> mBranches;
+  std::set<BasicBlock*> sExcluded;
+
+  for (std::vector<BLPPEdge*>::iterator it = bp.lEdges.begin(); 
+    it != bp.lEdges.end(); it++)
   {
     BLPPEdge *psEdge = *it;
-    if (!psEdge->beDummyMatchP)
+    BasicBlock *psTail = static_cast<BasicBlock*>
+      (psEdge->nodeTailP->vNodeDataP);
+    BasicBlock *psHead = static_cast<BasicBlock*>
+      (psEdge->nodeHeadP->vNodeDataP);
+    if (psEdge->beDummyMatchP)
     {
-      BasicBlock *psExit = static_cast<BasicBlock*>
-        (psEdge->nodeTailP->vNodeDataP);
-      CallInst::Create(psRecordExit, ArrayRef<Value*>(&psProcID, 1),
-        "", psExit->getTerminator());
+      /* The CFG edge of the pair leaves the tail of the edge to exit */
+      if (!psHead)
+        sExcluded.insert(psTail);
+      continue;
     }
+    if (!psTail || !psHead)
+      continue;
+    BranchInst *psBranch = dyn_cast<BranchInst>(psTail->getTerminator());
+    if (!psBranch || psBranch->isUnconditional() ||
+      (psBranch->getSuccessor(0) == psBranch->getSuccessor(1)))
+      continue;
+    if (PATH_SUM_READ == psEdge->atKind)
+    {
+      sExcluded.insert(psTail);
+      continue;
+    }
+    SelectBranch &sBranch = mBranches[psTail];
+    sBranch.psBranch = psBranch;
+    sBranch.apsEdges[psBranch->getSuccessor(0) == psHead ? 0 : 1] = psEdge;
+  }
+
+  for (std::map<BasicBlock*, SelectBranch>::iterator it = mBranches.begin();
+    it != mBranches.end(); it++)
+  {
+    SelectBranch &sBranch = it->second;
+    bool isNeeded = false;
+    if (sExcluded.count(it->first) || !sBranch.apsEdges[0] ||
+      !sBranch.apsEdges[1])
+      continue;
+    for (uint32_t i = 0; i < 2; i++)
+      isNeeded |= (INVALID != sBranch.apsEdges[i]->atKind) &&
+        isCriticalEdge(it->first, sBranch.psBranch->getSuccessor(i));
+    if (isNeeded)
+      vBranches.push_back(sBranch);
+  }
+}
+
+/* This function updates the path sum for a branch found by
+   CollectSelectBranches, right before the branch:
+     pathsum += cond ? incTrue : incFalse
+   or, if an edge initializes the path sum,
+     pathsum = cond ? valTrue : valFalse
+*/
+void BLPPInstrumentation::EmitSelectIncrement(SelectBranch &sBranch,
+  Value *psPathSumVar)
+{
+  BranchInst *psBranch = sBranch.psBranch;
+  IntegerType *psInt64Ty = IntegerType::get(psBranch->getContext(), 64);
+  Value *psCurPathSum = new LoadInst(psPathSumVar, "", psBranch);
+  Value *psNewPathSum;
+  Value *apsValues[2];
+  bool isIncrement = true;
+
+  for (uint32_t i = 0; i < 2; i++)
+  {
+    BLPPEdge *psEdge = sBranch.apsEdges[i];
+    if (PATH_SUM_INIT == psEdge->atKind)
+      isIncrement = false;
+    if (INVALID != psEdge->atKind)
+      uiFoldedEdges += isCriticalEdge(psBranch->getParent(),
+        psBranch->getSuccessor(i));
   }
+  for (uint32_t i = 0; i < 2; i++)
+  {
+    BLPPEdge *psEdge = sBranch.apsEdges[i];
+    int64_t siIncrement = (INVALID == psEdge->atKind) ? 0 :
+      psEdge->siIncrement;
+    if (isIncrement || (PATH_SUM_INIT == psEdge->atKind))
+      apsValues[i] = ConstantInt::get(psInt64Ty, siIncrement);
+    else if (siIncrement)
+      apsValues[i] = BinaryOperator::Create(Instruction::BinaryOps::Add,
+        psCurPathSum, ConstantInt::get(psInt64Ty, siIncrement), "", psBranch);
+    else
+      apsValues[i] = psCurPathSum;
+  }
+  psNewPathSum = SelectInst::Create(psBranch->getCondition(), apsValues[0],
+    apsValues[1], "", psBranch);
+  if (isIncrement)
+    psNewPathSum = BinaryOperator::Create(Instruction::BinaryOps::Add,
+      psCurPathSum, psNewPathSum, "", psBranch);
+  new StoreInst(psNewPathSum, psPathSumVar, psBranch);
 }
 
 /* This function returns the basic block where instrumentation code on the
@@ -154,13 +1681,37 @@ void BLPPInstrumentation::InstrumentFunction(Function &f, uint32_t uiProcID,
    a new basic block and returns it, else it returns either the tail or the 
    head
 */
-BasicBlock* BLPPInstrumentation::splitEdge(BasicBlock *psTail, BasicBlock *psHead)
+BasicBlock* BLPPInstrumentation::splitEdge(BasicBlock *psTail, BasicBlock *psHead,
+  int32_t siSuccNum)
 {
   if (!psHead)
   {
     assert(psTail);
     return psTail;
   }
+  SwitchInst *psSwitch = dyn_cast<SwitchInst>(psTail->getTerminator());
+  if (psSwitch && (siSuccNum >= 0))
+  {
+    /* Several cases may share a successor, so split the edge of this case
+       alone; an edge split before has its block in between by now
+    */
+    uint32_t uiEdges = 0;
+    psHead = psSwitch->getSuccessor(siSuccNum);
+    for (uint32_t i = 0; i < psSwitch->getNumSuccessors(); i++)
+      uiEdges += (psSwitch->getSuccessor(i) == psHead);
+    if ((1 == uiEdges) && psHead->getUniquePredecessor())
+      return psHead;
+    BasicBlock *psNewHead = BasicBlock::Create(psTail->getContext(), "",
+      psTail->getParent());
+    BranchInst::Create(psHead, psNewHead);
+    psSwitch->setSuccessor(siSuccNum, psNewHead);
+    for (BasicBlock::iterator it = psHead->begin(); isa<PHINode>(&*it); it++)
+    {
+      PHINode *psPhi = cast<PHINode>(it);
+      psPhi->setIncomingBlock(psPhi->getBasicBlockIndex(psTail), psNewHead);
+    }
+    return psNewHead;
+  }
   BasicBlock *psRelation;
   psRelation = psTail->getUniqueSuccessor();
   if (psRelation)
@@ -184,36 +1735,189 @@ BasicBlock* BLPPInstrumentation::splitEdge(BasicBlock *psTail, BasicBlock *psHea
 
 bool BLPPInstrumentation::runOnModule(Module &m)
 {
-  if (NULL == psRecordEntry)
-  {
-    IntegerType *psFnIDType = IntegerType::get(m.getContext(), 32);
-    IntegerType *psPathIDType = IntegerType::get(m.getContext(), 64);
-    Type* psVoidType = Type::getVoidTy(m.getContext());
-    Type* apsTypes[1] = {psFnIDType};
-    ArrayRef<Type*> sRef(apsTypes, 1);
-    FunctionType *psRecordEntryType = FunctionType::get
-      (psVoidType, sRef, false);
-    psRecordEntry = m.getOrInsertFunction("__record_entry", psRecordEntryType);
-    psRecordExit = m.getOrInsertFunction("__record_exit", psRecordEntryType);
-    Type *apsArgTypes[2] = {psPathIDType, psFnIDType};
-    ArrayRef<Type*> sRef2(apsArgTypes, 2);
-    FunctionType *psRecordPathSumType = FunctionType::get
-      (psVoidType, sRef2, false);
-    psRecordPathSum = m.getOrInsertFunction("__record_path_sum", psRecordPathSumType);
-  }
-  uint32_t i = 0;
+  /* The declarations and descriptors of a module the pass ran on before
+     belong to that module
+  */
+  vFuncDescs.clear();
+  psRecordPathSum = psRegisterModule = nullptr;
+  psThreadCounters = psTableMiss = nullptr;
+  psPathTableTy = nullptr;
+  psEmptyTable = psEnabled = nullptr;
+  psSampleCountdown = psIDBase = nullptr;
+  IntegerType *psFnIDType = IntegerType::get(m.getContext(), 32);
+  IntegerType *psPathIDType = IntegerType::get(m.getContext(), 64);
+  Type* psVoidType = Type::getVoidTy(m.getContext());
+  Type *apsArgTypes[2] = {psPathIDType, psFnIDType};
+  ArrayRef<Type*> sRef2(apsArgTypes, 2);
+  FunctionType *psRecordPathSumType = FunctionType::get
+    (psVoidType, sRef2, false);
+  psRecordPathSum = m.getOrInsertFunction("__record_path_sum", psRecordPathSumType);
+  Type *psCountersTy = PointerType::getUnqual(psPathIDType);
+  Type *apsThreadArgTypes[2] = {psFnIDType, psFnIDType};
+  FunctionType *psThreadCountersType = FunctionType::get
+    (psCountersTy, ArrayRef<Type*>(apsThreadArgTypes, 2), false);
+  psThreadCounters = m.getOrInsertFunction("__blpp_thread_counters",
+    psThreadCountersType);
+
+  /* Leading fields of BLPPPathSlot and BLPPPathTable in the runtime */
+  Type *apsSlotTypes[2] = {psPathIDType, psPathIDType};
+  StructType *psSlotTy = StructType::create(m.getContext(),
+    ArrayRef<Type*>(apsSlotTypes, 2), "blpp.slot");
+  Type *apsTableTypes[2] = {PointerType::getUnqual(psSlotTy), psPathIDType};
+  psPathTableTy = StructType::create(m.getContext(),
+    ArrayRef<Type*>(apsTableTypes, 2), "blpp.table");
+  psEmptyTable = m.getOrInsertGlobal("__blpp_empty_table", psPathTableTy);
+  PointerType *psTablePtrTy = PointerType::getUnqual(psPathTableTy);
+  Type *apsMissTypes[3] = {PointerType::getUnqual(psTablePtrTy),
+    psPathIDType, psFnIDType};
+  FunctionType *psTableMissType = FunctionType::get
+    (psVoidType, ArrayRef<Type*>(apsMissTypes, 3), false);
+  psTableMiss = m.getOrInsertFunction("__blpp_table_miss", psTableMissType);
+  /* Set by the runtime when the module is registered */
+  IntegerType *psIDBaseTy = IntegerType::get(m.getContext(), 32);
+  psIDBase = new GlobalVariable(m, psIDBaseTy, false,
+    GlobalValue::InternalLinkage, ConstantInt::get(psIDBaseTy, 0),
+    "blpp.id.base");
+  std::string sError;
+  if (!sInclude.empty() && !psIncludeRE)
+  {
+    psIncludeRE = new Regex(sInclude);
+    if (!psIncludeRE->isValid(sError))
+      report_fatal_error(Twine("-blppinclude: ") + sError);
+  }
+  if (!sExclude.empty() && !psExcludeRE)
+  {
+    psExcludeRE = new Regex(sExclude);
+    if (!psExcludeRE->isValid(sError))
+      report_fatal_error(Twine("-blppexclude: ") + sError);
+  }
+  if (!sHotProfile.empty() && !bdbHotP)
+    bdbHotP = new BLPPDB(sHotProfile.c_str());
+  /* Defined by the runtime */
+  if (bToggle)
+    psEnabled = m.getOrInsertGlobal("__blpp_enabled",
+      IntegerType::get(m.getContext(), 32));
+
+  std::vector<uint32_t> vStrategies;
+  uiRate = (uiSampleRate > 1) ? uiSampleRate : 1;
+  if (dBudget > 0)
+  {
+    if (0 == uiSampleRate.getNumOccurrences())
+      uiRate = BLPP_BUDGET_SAMPLE_RATE;
+    ChooseStrategies(m, vStrategies);
+  }
+  if (uiRate > 1)
+  {
+    /* One countdown for the whole module, or per thread */
+    IntegerType *psInt32Ty = IntegerType::get(m.getContext(), 32);
+    psSampleCountdown = new GlobalVariable(m, psInt32Ty, false,
+      GlobalValue::InternalLinkage, ConstantInt::get(psInt32Ty, uiRate),
+      "blpp.sample.countdown", nullptr,
+      bThreaded ? GlobalVariable::InitialExecTLSModel :
+        GlobalVariable::NotThreadLocal);
+  }
+
+  /* The build ID covers what a profile is interpreted against: the ID,
+     name, path count, path numbering (BLPP_FUNC_TRUNCATED, _HASHED) and
+     strategy of every function, instrumented or not, so that selective
+     builds can share profiles with full ones. Uninstrumented functions have
+     the strategy they would be instrumented with.
+  */
+  uint64_t uLBuildID = 0xCBF29CE484222325ULL;
+  uint32_t i = 0, uiSelected = 0;
+  uiFoldedEdges = uiSplitEdges = 0;
   for (Module::iterator it = m.begin(); it != m.end(); it++)
   {
     Function &f = *it;
     if (f.isDeclaration()) continue;
-    BLPP &bp=getAnalysis<BLPP>(f);
-    InstrumentFunction(f, i, bp);
+    /* Ahead of BLPP, whose results the next getAnalysis could free */
+    bool isSelected = vStrategies.empty() ? IsSelected(f, i) :
+      !(vStrategies[i] & BLPP_FUNC_UNINSTRUMENTED);
+    BLPP &bp = GetBLPP(f);
+    StringRef sName = f.getName();
+    uint32_t uiNumPaths = bp.bnEntryP->siNumPaths;
+    uint32_t uiStrategy = (!vStrategies.empty() ? vStrategies[i] :
+      (bEdgeOnly ? BLPP_STRATEGY_EDGE : 0)) & BLPP_FUNC_STRATEGY_MASK;
+    uint32_t uiNumbering = uiStrategy | bp.uiPathFlags;
+    uLBuildID = HashBytes(uLBuildID, &i, sizeof(i));
+    uLBuildID = HashBytes(uLBuildID, sName.data(), sName.size());
+    uLBuildID = HashBytes(uLBuildID, &uiNumPaths, sizeof(uiNumPaths));
+    uLBuildID = HashBytes(uLBuildID, &uiNumbering, sizeof(uiNumbering));
+    if (isSelected)
+    {
+      std::vector<BasicBlock*> vOff;
+      if (bToggle)
+        CloneToggledVersion(f, vOff);
+      InstrumentFunction(f, i, bp, uiStrategy);
+      AddToggledVersion(f, vOff);
+      /* The cached graph no longer matches the function */
+      if (psFAM)
+        psFAM->invalidate<BLPPAnalysis>(f);
+      uiSelected++;
+    }
+    else
+    {
+      FunctionDescInfo sInfo = {i, 0, BLPP_COUNTERS_CALL,
+        BLPP_FUNC_UNINSTRUMENTED, nullptr, sName.str()};
+      vFuncDescs.push_back(sInfo);
+    }
     i++;
   }
+  if (bStats && (psIncludeRE || psExcludeRE || (uiMinFreq > 0) || bdbHotP))
+    errs() << "BLPP: instrumented " << uiSelected << " of " << i
+      << " functions\n";
+  EmitModuleDescriptor(m, uLBuildID);
+  if (bStats && bSelectIncr)
+    errs() << "BLPP: " << uiFoldedEdges << " instrumented critical edges "
+      "updated by selects, " << uiSplitEdges << " split\n";
   return true;
 }
 
+/* This function runs the pass with the analyses of the new pass manager.
+   Inputs:
+     m    -> Module
+     sFAM -> Function analyses of m, with BLPPAnalysis registered
+*/
+bool BLPPInstrumentation::runOnModule(Module &m, FunctionAnalysisManager &sFAM)
+{
+  psFAM = &sFAM;
+  bool isChanged = runOnModule(m);
+  psFAM = nullptr;
+  return isChanged;
+}
+
+/* The legacy pass does the work, with its graphs taken from the
+   FunctionAnalysisManager instead of from getAnalysis(), so both pass
+   managers instrument with the same code.
+*/
+PreservedAnalyses BLPPInstrumentationPass::run(Module &m,
+  ModuleAnalysisManager *psAM)
+{
+  psInstrP->runOnModule(m,
+    psAM->getResult<FunctionAnalysisManagerModuleProxy>(m).getManager());
+  return PreservedAnalyses::none();
+}
+
 char BLPPInstrumentation::ID = 0;
 static RegisterPass<BLPPInstrumentation> X ("ppinstrument", "instrument code for BLPP profiling");
 
+/* Clang runs the pass at the end of its optimization pipeline, at any
+   optimization level, when it loads this module (-Xclang -load -Xclang
+   LLVMPathProfiler.so). Sampled functions keep the program's values on the
+   stack, so mem2reg runs after them.
+*/
+static void AddBLPPInstrumentation(const PassManagerBuilder &sBuilder,
+  legacy::PassManagerBase &sPM)
+{
+  sPM.add(new BLPPInstrumentation());
+  if ((uiSampleRate > 1) || (dBudget > 0))
+    sPM.add(createPromoteMemoryToRegisterPass());
+}
+static RegisterStandardPasses
+  BLPPOptimizerLast(PassManagerBuilder::EP_OptimizerLast,
+  AddBLPPInstrumentation);
+static RegisterStandardPasses
+  BLPPOptLevel0(PassManagerBuilder::EP_EnabledOnOptLevel0,
+  AddBLPPInstrumentation);
+
 
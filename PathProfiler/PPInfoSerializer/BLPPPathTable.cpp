@@ -0,0 +1,268 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <vector>
+#include "BLPPPathTable.h"
+
+/* This file contains the slow paths of the open addressing path table */
+
+static BLPPPathSlot psEmptySlot;
+BLPPPathTable __blpp_empty_table = {&psEmptySlot, 0, NULL, 0, 0, 0, -1, 0, NULL};
+
+/* Slot arrays are preceded by a cache line that records their mask, so that
+	 a snapshot can size an array from its pointer alone.
+*/
+#define BLPP_SLOTS_HDR (BLPP_CACHE_LINE / sizeof(BLPPPathSlot))
+
+/* This function allocates a zeroed, cache line aligned slot array.
+	 Inputs:
+	   uLNumSlots -> Number of slots (a power of 2)
+	 Return Value:
+	   The slot array
+*/
+static BLPPPathSlot *alloc_slots(uint64_t uLNumSlots) {
+	void *vP = NULL;
+	BLPPPathSlot *psSlots;
+	int siErr = posix_memalign(&vP, BLPP_CACHE_LINE,
+														 (uLNumSlots + BLPP_SLOTS_HDR) * sizeof(BLPPPathSlot));
+	assert((0 == siErr) && "Can't allocate path table");
+	(void) siErr;
+	memset(vP, 0, (uLNumSlots + BLPP_SLOTS_HDR) * sizeof(BLPPPathSlot));
+	psSlots = (BLPPPathSlot*) vP + BLPP_SLOTS_HDR;
+	psSlots[-1].uLKey = uLNumSlots - 1;
+	return psSlots;
+}
+
+static void free_slots(BLPPPathSlot *psSlots) {
+	free(psSlots - BLPP_SLOTS_HDR);
+}
+
+static uint64_t slots_mask(const BLPPPathSlot *psSlots) {
+	return psSlots[-1].uLKey;
+}
+
+/* Slot arrays dropped while a snapshot was reading tables */
+typedef struct BLPPRetiredSlots {
+	BLPPPathSlot *psSlots;
+	struct BLPPRetiredSlots *brNextP;
+} BLPPRetiredSlots;
+
+static int siSnapshots;
+static BLPPRetiredSlots *brRetiredP;
+
+/* This function frees a slot array that is no longer reachable from its
+	 table, or defers that to the end of the snapshot that may be reading it.
+*/
+static void retire_slots(BLPPPathSlot *psSlots) {
+	/* Pairs with the fence in blpp_table_snapshot: either the snapshot sees
+		 the array unlinked, or we see the snapshot.
+	*/
+	__sync_synchronize();
+	if (0 == siSnapshots) {
+		free_slots(psSlots);
+	} else {
+		BLPPRetiredSlots *brP = (BLPPRetiredSlots*) malloc(sizeof(BLPPRetiredSlots));
+		brP->psSlots = psSlots;
+		do {
+			brP->brNextP = brRetiredP;
+		} while (!__sync_bool_compare_and_swap(&brRetiredP, brP->brNextP, brP));
+	}
+}
+
+/* These mark the layout of a table as changing and as stable again */
+static void begin_update(BLPPPathTable *btP) {
+	__atomic_store_n(&btP->uiSeq, btP->uiSeq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void end_update(BLPPPathTable *btP) {
+	__atomic_store_n(&btP->uiSeq, btP->uiSeq + 1, __ATOMIC_RELEASE);
+}
+
+/* This function looks for a key in a slot array by linear probing from its
+	 home slot. Moved slots of an array being migrated do not end the probe.
+	 Inputs:
+	   psSlots -> Slot array
+		 uLMask  -> Number of slots - 1
+		 uLKey   -> Path ID + 1
+	 Return Value:
+	   The slot holding the key, or the empty slot where it would be inserted
+*/
+static BLPPPathSlot *probe(BLPPPathSlot *psSlots, uint64_t uLMask,
+													 uint64_t uLKey) {
+	uint64_t i = blpp_table_home(uLKey - 1, uLMask);
+
+	while ((psSlots[i].uLKey != uLKey) &&
+				 (psSlots[i].uLKey != BLPP_SLOT_EMPTY)) {
+		i = (i + 1) & uLMask;
+	}
+	return &psSlots[i];
+}
+
+/* This function moves up to uLSteps slots of the old slot array into the
+	 current one, and frees the old array once it has been moved completely.
+*/
+static void migrate_step(BLPPPathTable *btP, uint64_t uLSteps) {
+	while ((NULL != btP->psOldSlots) && (uLSteps > 0)) {
+		BLPPPathSlot *psOld = &btP->psOldSlots[btP->uLMigrated];
+
+		if ((BLPP_SLOT_EMPTY != psOld->uLKey) &&
+				(BLPP_SLOT_MOVED != psOld->uLKey)) {
+			BLPPPathSlot *psNew = probe(btP->psSlots, btP->uLMask, psOld->uLKey);
+			if (BLPP_SLOT_EMPTY == psNew->uLKey) {
+				psNew->uLKey = psOld->uLKey;
+				btP->uLUsed++;
+			}
+			psNew->uLCount += psOld->uLCount;
+			psOld->uLKey = BLPP_SLOT_MOVED;
+		}
+
+		btP->uLMigrated++;
+		if (btP->uLMigrated > btP->uLOldMask) {
+			BLPPPathSlot *psOldSlots = btP->psOldSlots;
+			btP->psOldSlots = NULL;
+			retire_slots(psOldSlots);
+		}
+		uLSteps--;
+	}
+}
+
+/* This function doubles the table. The current slot array becomes the old
+	 array, which is moved over by later misses.
+*/
+static void grow(BLPPPathTable *btP) {
+	/* A table only fills up again long after its last migration finished,
+		 so this loop normally has nothing to do.
+	*/
+	migrate_step(btP, ~0ULL);
+
+	btP->psOldSlots = btP->psSlots;
+	btP->uLOldMask = btP->uLMask;
+	btP->uLMigrated = 0;
+	btP->uLMask = (btP->uLMask << 1) | 1;
+	btP->psSlots = alloc_slots(btP->uLMask + 1);
+	btP->uLUsed = 0;
+}
+
+BLPPPathTable *blpp_table_create(signed int siProcID) {
+	BLPPPathTable *btP = (BLPPPathTable*) calloc(1, sizeof(BLPPPathTable));
+
+	assert(NULL != btP && "Can't allocate path table");
+	btP->psSlots = alloc_slots(BLPP_TABLE_INIT_SLOTS);
+	btP->uLMask = BLPP_TABLE_INIT_SLOTS - 1;
+	btP->siProcID = siProcID;
+	return btP;
+}
+
+void blpp_table_insert(BLPPPathTable *btP, uint64_t uLPathID) {
+	uint64_t uLKey = uLPathID + 1;
+	uint64_t uLCount = 0;
+	BLPPPathSlot *psSlot = probe(btP->psSlots, btP->uLMask, uLKey);
+
+	assert((&__blpp_empty_table != btP) && "Inserting into the empty table");
+	begin_update(btP);
+
+	if (BLPP_SLOT_EMPTY == psSlot->uLKey) {
+		/* Not in the current array; it may not have been migrated yet */
+		if (NULL != btP->psOldSlots) {
+			BLPPPathSlot *psOld = probe(btP->psOldSlots, btP->uLOldMask, uLKey);
+			if (psOld->uLKey == uLKey) {
+				uLCount = psOld->uLCount;
+				psOld->uLKey = BLPP_SLOT_MOVED;
+			}
+		}
+
+		/* Keep the load factor below 3/4 */
+		if (4 * (btP->uLUsed + 1) > 3 * (btP->uLMask + 1)) {
+			grow(btP);
+			psSlot = probe(btP->psSlots, btP->uLMask, uLKey);
+		}
+		psSlot->uLKey = uLKey;
+		btP->uLUsed++;
+	}
+	psSlot->uLCount = psSlot->uLCount + uLCount + 1;
+
+	migrate_step(btP, BLPP_TABLE_MIGRATE_STEP);
+	end_update(btP);
+}
+
+void blpp_table_zero(BLPPPathTable *btP) {
+	uint64_t i;
+
+	for (i = 0; i <= btP->uLMask; i++) {
+		btP->psSlots[i].uLCount = 0;
+	}
+	if (NULL != btP->psOldSlots) {
+		for (i = 0; i <= btP->uLOldMask; i++) {
+			btP->psOldSlots[i].uLCount = 0;
+		}
+	}
+}
+
+void blpp_table_for_each(const BLPPPathTable *btP,
+												 void (*fnP)(uint64_t, uint64_t, void*),
+												 void *vDataP) {
+	uint64_t i;
+
+	for (i = 0; i <= btP->uLMask; i++) {
+		if (BLPP_SLOT_EMPTY != btP->psSlots[i].uLKey) {
+			fnP(btP->psSlots[i].uLKey - 1, btP->psSlots[i].uLCount, vDataP);
+		}
+	}
+
+	if (NULL != btP->psOldSlots) {
+		for (i = 0; i <= btP->uLOldMask; i++) {
+			uint64_t uLKey = btP->psOldSlots[i].uLKey;
+			if ((BLPP_SLOT_EMPTY != uLKey) && (BLPP_SLOT_MOVED != uLKey)) {
+				fnP(uLKey - 1, btP->psOldSlots[i].uLCount, vDataP);
+			}
+		}
+	}
+}
+
+void blpp_table_snapshot(const BLPPPathTable *btP,
+												 void (*fnP)(uint64_t, uint64_t, void*),
+												 void *vDataP) {
+	std::vector<BLPPPathSlot> vSlots, vOldSlots;
+	BLPPPathTable btCopy;
+
+	/* From here on, no slot array we can reach is freed */
+	__sync_fetch_and_add(&siSnapshots, 1);
+
+	for (unsigned int uiTry = 0; uiTry < BLPP_SNAPSHOT_TRIES; uiTry++) {
+		unsigned int uiSeq = __atomic_load_n(&btP->uiSeq, __ATOMIC_ACQUIRE);
+		BLPPPathSlot *psSlots = __atomic_load_n(&btP->psSlots, __ATOMIC_RELAXED);
+		BLPPPathSlot *psOldSlots = __atomic_load_n(&btP->psOldSlots,
+																							 __ATOMIC_RELAXED);
+
+		vSlots.assign(psSlots, psSlots + slots_mask(psSlots) + 1);
+		vOldSlots.clear();
+		if (NULL != psOldSlots) {
+			vOldSlots.assign(psOldSlots, psOldSlots + slots_mask(psOldSlots) + 1);
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (!(uiSeq & 1) &&
+				(__atomic_load_n(&btP->uiSeq, __ATOMIC_RELAXED) == uiSeq)) {
+			break;
+		}
+	}
+
+	/* Free what was retired while we were reading */
+	if (1 == __sync_fetch_and_sub(&siSnapshots, 1)) {
+		BLPPRetiredSlots *brP = __sync_lock_test_and_set(&brRetiredP, 
+																										 (BLPPRetiredSlots*) NULL);
+		while (NULL != brP) {
+			BLPPRetiredSlots *brNextP = brP->brNextP;
+			free_slots(brP->psSlots);
+			free(brP);
+			brP = brNextP;
+		}
+	}
+
+	btCopy.psSlots = &vSlots[0];
+	btCopy.uLMask = vSlots.size() - 1;
+	btCopy.psOldSlots = vOldSlots.empty() ? NULL : &vOldSlots[0];
+	btCopy.uLOldMask = vOldSlots.size() - 1;
+	blpp_table_for_each(&btCopy, fnP, vDataP);
+}
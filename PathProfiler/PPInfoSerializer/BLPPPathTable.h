@@ -0,0 +1,130 @@
+#ifndef BLPP_PATH_TABLE_H
+#define BLPP_PATH_TABLE_H
+
+/* This file defines the open addressing table used to count paths of
+   functions whose path space is too large for a dense counter array.
+
+   The table is keyed by the 64 bit path ID and uses linear probing over
+   cache line aligned slots. The common case - the path is already in its
+   home slot - is handled by blpp_table_increment, which the instrumentation
+   pass also emits inline. Everything else goes to blpp_table_miss.
+
+   Resizes are incremental: a full table gets a new slot array of twice the
+   size, and every subsequent miss moves a few slots of the old array over,
+   so no single increment pays for a full rehash.
+
+   Snapshots (__blpp_dump) read tables while their threads keep counting.
+   A table's thread never waits for a snapshot: it bumps uiSeq around every
+   change to the table's layout, and snapshots copy the slot arrays and retry
+   if uiSeq changed meanwhile. Slot arrays dropped while a snapshot is in
+   progress are freed once it has finished.
+
+   The layout of the first two fields of BLPPPathTable and of BLPPPathSlot is
+   known to the instrumentation pass, and must not change.
+*/
+#include <stdint.h>
+#include "llvm/Analysis/blpp_if.h"
+
+#define BLPP_CACHE_LINE           (64)
+#define BLPP_TABLE_INIT_SLOTS     (64)
+#define BLPP_TABLE_MIGRATE_STEP   (16)
+#define BLPP_SNAPSHOT_TRIES       (100)
+
+/* Keys are path ID + 1, so that an all zero slot is empty */
+#define BLPP_SLOT_EMPTY           (0ULL)
+#define BLPP_SLOT_MOVED           (~0ULL)
+
+typedef struct BLPPPathSlot {
+	uint64_t uLKey;
+	uint64_t uLCount;
+} BLPPPathSlot;
+
+typedef struct BLPPPathTable {
+	BLPPPathSlot *psSlots;  /* Current slot array */
+	uint64_t uLMask;        /* Number of slots - 1 */
+
+	/* Only the slow path looks at the fields below */
+	BLPPPathSlot *psOldSlots; /* Slot array being migrated, or NULL */
+	uint64_t uLOldMask;
+	uint64_t uLMigrated;    /* Old slots below this index have been moved */
+	uint64_t uLUsed;        /* Keys stored in psSlots */
+	signed int siProcID;
+	unsigned int uiSeq;     /* Odd while the layout is being changed */
+	struct BLPPPathTable *btNextP;
+} BLPPPathTable;
+
+/* The table every instrumented function starts with. It has a single empty
+   slot, so the first increment always misses and allocates a real table.
+*/
+extern "C" BLPPPathTable __blpp_empty_table;
+
+extern "C" void __blpp_table_miss(BLPPPathTable **ppTable, uint64_t uLPathID,
+																	signed int siProcID);
+
+static inline uint64_t blpp_table_home(uint64_t uLPathID, uint64_t uLMask) {
+	return ((uLPathID * BLPP_HASH_MUL) >> 32) & uLMask;
+}
+
+/* This function counts one execution of a path.
+	 Inputs:
+	   ppTable  -> Table of the function (updated when the table is created)
+		 uLPathID -> Path ID
+		 siProcID -> Function ID
+	 Return Value:
+	   None
+*/
+static inline void blpp_table_increment(BLPPPathTable **ppTable,
+																				uint64_t uLPathID,
+																				signed int siProcID) {
+	BLPPPathTable *btP = *ppTable;
+	BLPPPathSlot *psSlot = &btP->psSlots[blpp_table_home(uLPathID, btP->uLMask)];
+
+	if (psSlot->uLKey == uLPathID + 1) {
+		psSlot->uLCount++;
+	} else {
+		__blpp_table_miss(ppTable, uLPathID, siProcID);
+	}
+}
+
+/* This function creates an empty table.
+	 Inputs:
+	   siProcID -> Function whose paths the table counts
+	 Return Value:
+	   The new table
+*/
+BLPPPathTable *blpp_table_create(signed int siProcID);
+
+/* This function counts one execution of a path that was not found in its
+	 home slot: it probes the table, moves the path out of the old slot array
+	 if necessary, and inserts it if it is new.
+	 Inputs:
+	   btP      -> Table (not the empty table)
+		 uLPathID -> Path ID
+	 Return Value:
+	   None
+*/
+void blpp_table_insert(BLPPPathTable *btP, uint64_t uLPathID);
+
+/* This function zeroes the counts of every path in a table, keeping the
+	 paths. Nothing may update or read the table meanwhile.
+*/
+void blpp_table_zero(BLPPPathTable *btP);
+
+/* This function calls fnP(uLPathID, uLCount, vDataP) for every path in the
+	 table, including paths not yet migrated out of an old slot array.
+*/
+void blpp_table_for_each(const BLPPPathTable *btP,
+												 void (*fnP)(uint64_t, uint64_t, void*),
+												 void *vDataP);
+
+/* This function calls fnP(uLPathID, uLCount, vDataP) for every path in a
+	 table that may be updated concurrently by its thread. The paths passed
+	 are those of one consistent copy of the table, unless the table kept
+	 changing for BLPP_SNAPSHOT_TRIES attempts, in which case the last copy
+	 is used.
+*/
+void blpp_table_snapshot(const BLPPPathTable *btP,
+												 void (*fnP)(uint64_t, uint64_t, void*),
+												 void *vDataP);
+
+#endif
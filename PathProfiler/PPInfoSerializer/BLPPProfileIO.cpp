@@ -0,0 +1,335 @@
+#include <string.h>
+#include <algorithm>
+#include "BLPPProfileIO.h"
+
+/* Functions whose path IDs all lie below this are merged in a dense array */
+#define BLPP_DENSE_MERGE_LIMIT (1 << 20)
+
+/* This function reads a whole file into memory.
+	 Return Value:
+	   0 on success, -1 on read errors
+*/
+static int read_file(FILE *fp, std::vector<uint8_t> &vBuf) {
+	uint8_t aucChunk[1 << 16];
+	size_t uiRead;
+
+	vBuf.clear();
+	while ((uiRead = fread(aucChunk, 1, sizeof(aucChunk), fp)) > 0) {
+		vBuf.insert(vBuf.end(), aucChunk, aucChunk + uiRead);
+	}
+	return ferror(fp) ? -1 : 0;
+}
+
+/* This function decodes the paths of one function of a v2 profile.
+	 Return Value:
+	   0 on success, -1 if the paths are corrupt
+*/
+static int read_function(const std::vector<uint8_t> &vBuf,
+												 const BLPPFuncIndex &bfi, BLPPFuncProfile &bf) {
+	const uint8_t *pucP, *pucEnd;
+	uint64_t uLPathID = 0, uLDelta, uLCount;
+
+	if ((bfi.uLOffset > vBuf.size()) ||
+			(bfi.uLSize > vBuf.size() - bfi.uLOffset)) {
+		return -1;
+	}
+	pucP = &vBuf[0] + bfi.uLOffset;
+	pucEnd = pucP + bfi.uLSize;
+
+	bf.uiFlags = bfi.uiEncoding & ~BLPP_ENC_MASK;
+	switch (bfi.uiEncoding & BLPP_ENC_MASK) {
+	case BLPP_ENC_DENSE:
+		if (bfi.uLSize != bfi.uiNumPaths * sizeof(uint64_t)) {
+			return -1;
+		}
+		bf.vDense.resize(bfi.uiNumPaths);
+		memcpy(bf.vDense.data(), pucP, bfi.uLSize);
+		return 0;
+	case BLPP_ENC_VARINT:
+		bf.vPaths.reserve(bfi.uiNumPaths);
+		for (uint32_t i = 0; i < bfi.uiNumPaths; i++) {
+			pucP = blpp_get_varint(pucP, pucEnd, &uLDelta);
+			if (NULL != pucP) {
+				pucP = blpp_get_varint(pucP, pucEnd, &uLCount);
+			}
+			if ((NULL == pucP) || ((0 != i) && (0 == uLDelta))) {
+				return -1;
+			}
+			uLPathID += uLDelta;
+			bf.vPaths.push_back(BLPPPathCount(uLPathID, uLCount));
+		}
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/* This function reads a v1 profile (BLPPDBHdr and BLPPProfInfo records) */
+static int read_v1_profile(const std::vector<uint8_t> &vBuf,
+													 BLPPProfileData &pd) {
+	BLPPDBHdr bdbh;
+	BLPPSampleTrailer bst;
+	unsigned int uiNumFuncs;
+
+	if (vBuf.size() < sizeof(BLPPDBHdr)) {
+		return -1;
+	}
+	memcpy(&bdbh, &vBuf[0], sizeof(bdbh));
+	uiNumFuncs = bdbh.uiOffset / sizeof(BLPPDBHdr);
+	if ((0 == uiNumFuncs) || (bdbh.uiOffset > vBuf.size())) {
+		return -1;
+	}
+	uiNumFuncs--; /* The last header is a dummy */
+
+	pd.vFuncs.resize(uiNumFuncs);
+	for (unsigned int i = 0; i < uiNumFuncs; i++) {
+		BLPPFuncProfile &bf = pd.vFuncs[i];
+
+		memcpy(&bdbh, &vBuf[i * sizeof(BLPPDBHdr)], sizeof(bdbh));
+		if ((bdbh.uiOffset > vBuf.size()) ||
+				(bdbh.uiNumPaths >
+				 (vBuf.size() - bdbh.uiOffset) / sizeof(BLPPProfInfo))) {
+			return -1;
+		}
+		for (uint32_t j = 0; j < bdbh.uiNumPaths; j++) {
+			BLPPProfInfo bprof;
+			memcpy(&bprof, &vBuf[bdbh.uiOffset + j * sizeof(BLPPProfInfo)],
+						 sizeof(bprof));
+			if (bprof.uiExecCount) {
+				bf.vPaths.push_back(BLPPPathCount(bprof.uLPathID, bprof.uiExecCount));
+			}
+		}
+		/* v1 records are in hash table order */
+		std::sort(bf.vPaths.begin(), bf.vPaths.end());
+	}
+
+	memcpy(&bst, &vBuf[vBuf.size() - sizeof(bst)], sizeof(bst));
+	if ((BLPP_SAMPLE_MAGIC == bst.uiMagic) && (bst.uiSampleRate > 1)) {
+		pd.uiSampleRate = bst.uiSampleRate;
+	}
+	return 0;
+}
+
+int blpp_read_profile(FILE *fp, BLPPProfileData &pd) {
+	std::vector<uint8_t> vBuf;
+	BLPPProfHdr bph;
+
+	pd.uLBuildID = 0;
+	pd.uiSampleRate = 1;
+	pd.vFuncs.clear();
+	if (0 != read_file(fp, vBuf)) {
+		return -1;
+	}
+
+	memset(&bph, 0, sizeof(bph));
+	if ((vBuf.size() >= sizeof(uint32_t)) &&
+			(BLPP_PROF_MAGIC == *(uint32_t*) &vBuf[0])) {
+		if (vBuf.size() < 6 * sizeof(uint32_t)) {
+			return -1;
+		}
+		/* Headers of older writers may be shorter */
+		memcpy(&bph, &vBuf[0], std::min(vBuf.size(), sizeof(bph)));
+		if ((BLPP_PROF_VERSION != bph.uiVersion) ||
+				(bph.uiHdrSize > vBuf.size()) ||
+				(bph.uiNumFuncs >
+				 (vBuf.size() - bph.uiHdrSize) / sizeof(BLPPFuncIndex))) {
+			return -1;
+		}
+		if (bph.uiHdrSize < sizeof(bph)) {
+			memset((char*) &bph + bph.uiHdrSize, 0, sizeof(bph) - bph.uiHdrSize);
+		}
+		pd.uLBuildID = bph.uLBuildID;
+		pd.uiSampleRate = bph.uiSampleRate;
+		pd.vFuncs.resize(bph.uiNumFuncs);
+		for (uint32_t i = 0; i < bph.uiNumFuncs; i++) {
+			BLPPFuncIndex bfi;
+			memcpy(&bfi, &vBuf[bph.uiHdrSize + i * sizeof(bfi)], sizeof(bfi));
+			if (0 != read_function(vBuf, bfi, pd.vFuncs[i])) {
+				return -1;
+			}
+		}
+		return 0;
+	}
+	return read_v1_profile(vBuf, pd);
+}
+
+int blpp_write_profile(FILE *fp, const BLPPProfileData &pd) {
+	BLPPProfHdr bph;
+	std::vector<BLPPFuncIndex> vIndex(pd.vFuncs.size());
+	std::vector<uint8_t> vPaths, vFunc;
+	uint64_t uLBase;
+
+	memset(&bph, 0, sizeof(bph));
+	bph.uiMagic = BLPP_PROF_MAGIC;
+	bph.uiVersion = BLPP_PROF_VERSION;
+	bph.uiHdrSize = sizeof(BLPPProfHdr);
+	bph.uiNumFuncs = pd.vFuncs.size();
+	bph.uiSampleRate = pd.uiSampleRate;
+	bph.uLBuildID = pd.uLBuildID;
+	uLBase = sizeof(BLPPProfHdr) + vIndex.size() * sizeof(BLPPFuncIndex);
+
+	for (unsigned int i = 0; i < pd.vFuncs.size(); i++) {
+		const BLPPFuncProfile &bf = pd.vFuncs[i];
+		uint64_t uLPrevID = 0, uLNumDense;
+		uint32_t uiNumPaths = 0;
+		uint8_t aucBuf[20];
+
+		vFunc.clear();
+		for (size_t j = 0; j < bf.vDense.size(); j++) {
+			if (bf.vDense[j]) {
+				unsigned int uiLen = blpp_put_varint(aucBuf, j - uLPrevID);
+				uiLen += blpp_put_varint(aucBuf + uiLen, bf.vDense[j]);
+				vFunc.insert(vFunc.end(), aucBuf, aucBuf + uiLen);
+				uLPrevID = j;
+				uiNumPaths++;
+			}
+		}
+		for (size_t j = 0; j < bf.vPaths.size(); j++) {
+			unsigned int uiLen = blpp_put_varint(aucBuf,
+																					 bf.vPaths[j].first - uLPrevID);
+			uiLen += blpp_put_varint(aucBuf + uiLen, bf.vPaths[j].second);
+			vFunc.insert(vFunc.end(), aucBuf, aucBuf + uiLen);
+			uLPrevID = bf.vPaths[j].first;
+			uiNumPaths++;
+		}
+
+		vIndex[i].uLOffset = uLBase + vPaths.size();
+		uLNumDense = bf.vDense.size();
+		if (!bf.vDense.empty() && (uLNumDense * sizeof(uint64_t) < vFunc.size())) {
+			vIndex[i].uiNumPaths = uLNumDense;
+			vIndex[i].uiEncoding = BLPP_ENC_DENSE | bf.uiFlags;
+			vPaths.insert(vPaths.end(), (const uint8_t*) bf.vDense.data(),
+										(const uint8_t*) (bf.vDense.data() + uLNumDense));
+		} else {
+			vIndex[i].uiNumPaths = uiNumPaths;
+			vIndex[i].uiEncoding = BLPP_ENC_VARINT | bf.uiFlags;
+			vPaths.insert(vPaths.end(), vFunc.begin(), vFunc.end());
+		}
+		vIndex[i].uLSize = uLBase + vPaths.size() - vIndex[i].uLOffset;
+	}
+
+	if ((1 != fwrite(&bph, sizeof(bph), 1, fp)) ||
+			(vIndex.size() !=
+			 fwrite(vIndex.data(), sizeof(BLPPFuncIndex), vIndex.size(), fp)) ||
+			(vPaths.size() != fwrite(vPaths.data(), 1, vPaths.size(), fp))) {
+		return -1;
+	}
+	return 0;
+}
+
+/* This function returns the number of counters a dense array needs to hold
+	 every path of a function.
+*/
+static uint64_t dense_size(const BLPPFuncProfile &bf) {
+	uint64_t uLSize = bf.vDense.size();
+
+	if (!bf.vPaths.empty()) {
+		uLSize = std::max(uLSize, bf.vPaths.back().first + 1);
+	}
+	return uLSize;
+}
+
+/* This function moves the dense counts of a function into its sorted path
+	 list.
+*/
+static void make_sparse(BLPPFuncProfile &bf) {
+	std::vector<BLPPPathCount> vPaths;
+
+	for (size_t j = 0; j < bf.vDense.size(); j++) {
+		if (bf.vDense[j]) {
+			vPaths.push_back(BLPPPathCount(j, bf.vDense[j]));
+		}
+	}
+	bf.vDense.clear();
+	if (!vPaths.empty()) {
+		vPaths.insert(vPaths.end(), bf.vPaths.begin(), bf.vPaths.end());
+		std::inplace_merge(vPaths.begin(), vPaths.end() - bf.vPaths.size(),
+											 vPaths.end());
+		bf.vPaths.swap(vPaths);
+	}
+}
+
+bool blpp_has_counts(const BLPPFuncProfile &bf) {
+	for (size_t j = 0; j < bf.vDense.size(); j++) {
+		if (bf.vDense[j]) {
+			return true;
+		}
+	}
+	for (size_t j = 0; j < bf.vPaths.size(); j++) {
+		if (bf.vPaths[j].second) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int blpp_merge_flags(uint32_t &uiDst, bool bDstCounts, uint32_t uiSrc,
+										 bool bSrcCounts) {
+	uint32_t uiStrategy = uiDst & BLPP_FUNC_STRATEGY_MASK;
+	uint32_t uiSrcStrategy = uiSrc & BLPP_FUNC_STRATEGY_MASK;
+
+	if (uiStrategy != uiSrcStrategy) {
+		if (bDstCounts && bSrcCounts) {
+			return -1;
+		}
+		if (bSrcCounts || (!bDstCounts && (0 == uiStrategy))) {
+			uiStrategy = uiSrcStrategy;
+		}
+	}
+	uiDst = ((uiDst | uiSrc) & ~BLPP_FUNC_STRATEGY_MASK) | uiStrategy;
+	return 0;
+}
+
+int blpp_add_function(BLPPFuncProfile &bfDst, const BLPPFuncProfile &bfSrc,
+											uint64_t uLWeight) {
+	uint64_t uLSize = std::max(dense_size(bfDst), dense_size(bfSrc));
+
+	if (0 != blpp_merge_flags(bfDst.uiFlags, blpp_has_counts(bfDst),
+														bfSrc.uiFlags, blpp_has_counts(bfSrc))) {
+		return -1;
+	}
+	if ((!bfDst.vDense.empty() || !bfSrc.vDense.empty()) &&
+			(uLSize <= BLPP_DENSE_MERGE_LIMIT)) {
+		/* Add everything up in a dense array */
+		bfDst.vDense.resize(uLSize, 0);
+		for (size_t j = 0; j < bfDst.vPaths.size(); j++) {
+			bfDst.vDense[bfDst.vPaths[j].first] += bfDst.vPaths[j].second;
+		}
+		bfDst.vPaths.clear();
+		for (size_t j = 0; j < bfSrc.vDense.size(); j++) {
+			bfDst.vDense[j] += bfSrc.vDense[j] * uLWeight;
+		}
+		for (size_t j = 0; j < bfSrc.vPaths.size(); j++) {
+			bfDst.vDense[bfSrc.vPaths[j].first] += bfSrc.vPaths[j].second * uLWeight;
+		}
+		return 0;
+	}
+
+	/* Merge the sorted path lists */
+	BLPPFuncProfile bfSparse = bfSrc;
+	std::vector<BLPPPathCount> vMerged;
+	size_t i = 0, j = 0;
+
+	make_sparse(bfDst);
+	make_sparse(bfSparse);
+	vMerged.reserve(bfDst.vPaths.size() + bfSparse.vPaths.size());
+	while ((i < bfDst.vPaths.size()) || (j < bfSparse.vPaths.size())) {
+		if ((j == bfSparse.vPaths.size()) || ((i < bfDst.vPaths.size()) &&
+				(bfDst.vPaths[i].first < bfSparse.vPaths[j].first))) {
+			vMerged.push_back(bfDst.vPaths[i++]);
+		} else if ((i == bfDst.vPaths.size()) ||
+							 (bfSparse.vPaths[j].first < bfDst.vPaths[i].first)) {
+			vMerged.push_back(BLPPPathCount(bfSparse.vPaths[j].first,
+																			bfSparse.vPaths[j].second * uLWeight));
+			j++;
+		} else {
+			vMerged.push_back(BLPPPathCount(bfDst.vPaths[i].first,
+																			bfDst.vPaths[i].second +
+																			bfSparse.vPaths[j].second * uLWeight));
+			i++;
+			j++;
+		}
+	}
+	bfDst.vPaths.swap(vMerged);
+	return 0;
+}
@@ -0,0 +1,85 @@
+#ifndef BLPP_PROFILE_IO_H
+#define BLPP_PROFILE_IO_H
+
+/* This file defines an in-memory form of a path profile, and functions that
+   read it from and write it to profile files. Both versions of the format
+   in blpp_if.h are read; v2 is written. It is used by the runtime and by
+   BLPPMerge.
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include "llvm/Analysis/blpp_if.h"
+
+/* A path ID and its execution count */
+typedef std::pair<uint64_t, uint64_t> BLPPPathCount;
+
+/* The paths of one function. Paths are kept either as counts indexed by
+   path ID (vDense, as read from BLPP_ENC_DENSE), or as executed paths
+   sorted by path ID (vPaths); only one of the two is used. uiFlags are the
+   function's BLPP_FUNC_* flags.
+*/
+typedef struct BLPPFuncProfile {
+	std::vector<uint64_t> vDense;
+	std::vector<BLPPPathCount> vPaths;
+	uint32_t uiFlags;
+	BLPPFuncProfile() : uiFlags(0) {}
+} BLPPFuncProfile;
+
+typedef struct BLPPProfileData {
+	uint64_t uLBuildID;
+	uint32_t uiSampleRate;
+	std::vector<BLPPFuncProfile> vFuncs; /* Indexed by function ID */
+} BLPPProfileData;
+
+/* This function reads a profile.
+	 Inputs:
+	   fp -> Profile file, positioned at its start
+		 pd -> Receives the profile
+	 Return Value:
+	   0 on success, -1 if the file is not a valid profile
+*/
+int blpp_read_profile(FILE *fp, BLPPProfileData &pd);
+
+/* This function writes a profile in the v2 format. Every function is
+	 written in whichever of BLPP_ENC_VARINT and BLPP_ENC_DENSE is smaller.
+	 Inputs:
+	   fp -> File to write to
+		 pd -> Profile
+	 Return Value:
+	   0 on success, -1 on write errors
+*/
+int blpp_write_profile(FILE *fp, const BLPPProfileData &pd);
+
+/* This function returns whether a function profile has a nonzero count */
+bool blpp_has_counts(const BLPPFuncProfile &bf);
+
+/* This function merges the BLPP_FUNC_* flags of a function in another
+	 profile into its flags. The strategy (BLPP_FUNC_STRATEGY_MASK) is a
+	 field, not a flag, so it isn't ORed: a profile without counts of the
+	 function leaves the strategy to the other, and counts of different
+	 strategies can't be added up.
+	 Inputs:
+	   uiDst      -> Flags to merge into
+		 bDstCounts -> The function has counts in the profile of uiDst
+		 uiSrc      -> Flags to merge
+		 bSrcCounts -> The function has counts in the profile of uiSrc
+	 Return Value:
+	   0 on success, -1 if both have counts, of different strategies
+*/
+int blpp_merge_flags(uint32_t &uiDst, bool bDstCounts, uint32_t uiSrc,
+										 bool bSrcCounts);
+
+/* This function adds uLWeight times the paths of one function to another.
+	 Inputs:
+	   bfDst    -> Function profile to add to
+		 bfSrc    -> Function profile to add
+		 uLWeight -> Multiplier of the added counts
+	 Return Value:
+	   0 on success, -1 if the two count paths with different strategies
+		 (bfDst is then unchanged)
+*/
+int blpp_add_function(BLPPFuncProfile &bfDst, const BLPPFuncProfile &bfSrc,
+											uint64_t uLWeight);
+
+#endif
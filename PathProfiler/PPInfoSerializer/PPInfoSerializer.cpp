@@ -1,14 +1,682 @@
 #include <stdio.h>
 #include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <limits.h>
 #include <vector>
+#include <algorithm>
 #include <hash_map>
 #include "llvm/Analysis/blpp_if.h"
+#include "BLPPPathTable.h"
+#include "BLPPProfileIO.h"
 
-static int siFirstTime;
-static unsigned long uiFirstProcID;
-static signed int siMaxProcID;
+typedef __gnu_cxx::hash_map<uint64_t, uint64_t> PathMap;
 
-std::vector<__gnu_cxx::hash_map<uint64_t, unsigned int> > vProcPathMaps(10);
+static int siDumping;
+static int siExited;
+
+/* Modules register from global constructors, which may run before the
+   constructors of this file. Until then, registered modules are only
+   queued on bmdPendingP, which needs no construction, and are added once
+   the runtime is initialized.
+*/
+static BLPPModuleDesc *bmdPendingP;
+static uint32_t uiNumFuncIDs;
+static int bRuntimeReady;
+
+/* One in uiSampleRate paths is counted by sampled builds */
+static unsigned int uiSampleRate = 1;
+
+/* Sum of the build IDs of the instrumented modules, so that profiles of
+   different builds are not merged
+*/
+static uint64_t uLBuildID;
+
+/* Counter arrays of functions with small path spaces. These are emitted by
+   the instrumentation pass, incremented inline and registered at startup.
+*/
+typedef struct {
+	uint64_t *puLCounters;
+	uint32_t uiNumPaths;
+} BLPPDenseCounters;
+
+static std::vector<BLPPDenseCounters> vDenseCounters;
+
+/* Counter arrays of functions built with -blppmmap. The arrays live in a
+   shared file mapping of the profile, a v2 profile whose functions are all
+   BLPP_ENC_DENSE, so the profile is on disk at all times - even if the
+   process is killed.
+*/
+typedef struct {
+	uint64_t **ppuLCounters; /* Pointer used by the instrumented code */
+	uint32_t uiNumPaths;
+	int bInFile;             /* The counters are in the mapped profile */
+} BLPPMappedCounters;
+
+static std::vector<BLPPMappedCounters> vMappedCounters;
+
+/* BLPP_FUNC_* flags by function ID, for the functions that have any */
+static std::vector<uint32_t> vFuncFlags;
+
+/* Other threads may be incrementing counters in the mapping while modules
+   are registered, so counters never move once they are in the file. The
+   header and an index with room for BLPP_MAP_MAX_FUNCS functions are mapped
+   at the start of the file, and counters are appended to the file in chunks
+   mapped of their own. No mapping is removed before exit. Functions that
+   don't fit in the index, or whose counters can't be mapped, keep their
+   static arrays, and the profile is then written in full at exit.
+*/
+#define BLPP_MAP_MAX_FUNCS  (1 << 16)
+#define BLPP_MAP_CHUNK_SIZE (1 << 18)
+
+typedef struct {
+	void *vP;
+	size_t uiSize;
+} BLPPMapChunk;
+
+static int siMapFD = -1;
+static void *vMapP;      /* Header and index */
+static size_t uiMapSize;
+static std::vector<BLPPMapChunk> vMapChunks;
+static size_t uiFileSize;
+static char *pcChunkFreeP; /* Unused part of the last chunk */
+static size_t uiChunkFree;
+/* Set in a forked child, whose counters are no longer mapped */
+static int bMapDetached;
+
+/* A counter array allocated for one thread of a threaded build */
+typedef struct BLPPThreadCounters {
+	signed int siProcID;
+	BLPPDenseCounters dc;
+	struct BLPPThreadCounters *tcNextP;
+} BLPPThreadCounters;
+
+/* The path tables of one thread. Only the owning thread ever updates its
+   table, so recording a path takes no locks. A table is pushed onto a
+   lock-free list the first time its thread records a path, and is never
+   freed, so that the counts of threads which have already exited are still
+   merged into the profile at exit.
+   Snapshots walk btTablesP and tcCountersP while the thread runs, so entries
+   are only linked in once they are fully initialized, and never unlinked.
+*/
+typedef struct BLPPThreadTable {
+	/* Path tables used by __record_path_sum, indexed by function ID */
+	std::vector<BLPPPathTable*> vProcTables;
+	/* All path tables created on this thread, including inline ones */
+	BLPPPathTable *btTablesP;
+	/* Per-thread counter arrays of threaded builds (-blppthreaded) */
+	BLPPThreadCounters *tcCountersP;
+	struct BLPPThreadTable *btNextP;
+} BLPPThreadTable;
+
+static BLPPThreadTable *btHeadP;
+static __thread BLPPThreadTable *btSelfP;
+
+/* This function returns the path tables of the calling thread, creating
+	 and registering them on first use.
+	 Inputs:
+	   None
+	 Return Value:
+	   The calling thread's tables
+*/
+static BLPPThreadTable *get_thread_table() {
+	BLPPThreadTable *btP = btSelfP;
+
+	if (NULL == btP) {
+		btP = new BLPPThreadTable;
+		btP->btTablesP = NULL;
+		btP->tcCountersP = NULL;
+		do {
+			btP->btNextP = btHeadP;
+		} while (!__sync_bool_compare_and_swap(&btHeadP, btP->btNextP, btP));
+		btSelfP = btP;
+	}
+	return btP;
+}
+
+/* This function adds the paths recorded in a counter array to a path map.
+	 Inputs:
+	   dc -> Counter array
+		 h  -> Path map of the same function
+	 Return Value:
+	   None
+*/
+static void merge_dense_counters(const BLPPDenseCounters &dc, PathMap &h) {
+	for (uint32_t j = 0; j < dc.uiNumPaths; j++) {
+		if (dc.puLCounters[j]) {
+			h[j] += dc.puLCounters[j];
+		}
+	}
+}
+
+/* Callback of blpp_table_snapshot, adding a path to a path map */
+static void merge_table_path(uint64_t uLPathID, uint64_t uLCount,
+														 void *vDataP) {
+	PathMap &h = *(PathMap*) vDataP;
+	/* Tables zeroed in a forked child keep their paths */
+	if (uLCount) {
+		h[uLPathID] += uLCount;
+	}
+}
+
+/* This function reduces the tables of all threads, and the shared counter
+	 arrays, into one path map per function.
+	 Inputs:
+	   vMerged -> Receives one path map per function ID
+	 Return Value:
+	   None
+*/
+static void merge_thread_tables(std::vector<PathMap> &vMerged) {
+	vMerged.resize(std::max<size_t>(uiNumFuncIDs,
+																	std::max(vDenseCounters.size(),
+																					 vMappedCounters.size())));
+	for (unsigned int i = 0; i < vDenseCounters.size(); i++) {
+		merge_dense_counters(vDenseCounters[i], vMerged[i]);
+	}
+	for (unsigned int i = 0; i < vMappedCounters.size(); i++) {
+		BLPPDenseCounters dc;
+		dc.puLCounters = *vMappedCounters[i].ppuLCounters;
+		dc.uiNumPaths = vMappedCounters[i].uiNumPaths;
+		merge_dense_counters(dc, vMerged[i]);
+	}
+
+	for (BLPPThreadTable *btP = btHeadP; btP != NULL; btP = btP->btNextP) {
+		for (BLPPPathTable *ptP = btP->btTablesP; ptP != NULL; ptP = ptP->btNextP) {
+			if (ptP->siProcID >= (signed int) vMerged.size()) {
+				vMerged.resize(ptP->siProcID + 1);
+			}
+			blpp_table_snapshot(ptP, merge_table_path, &vMerged[ptP->siProcID]);
+		}
+		for (BLPPThreadCounters *tcP = btP->tcCountersP; tcP != NULL;
+				 tcP = tcP->tcNextP) {
+			if (tcP->siProcID >= (signed int) vMerged.size()) {
+				vMerged.resize(tcP->siProcID + 1);
+			}
+			merge_dense_counters(tcP->dc, vMerged[tcP->siProcID]);
+		}
+	}
+}
+
+/* This function returns 1 iff some paths are counted outside of the memory
+	 mapped profile, and 0 otherwise.
+*/
+static int has_unmapped_counts() {
+	for (unsigned int i = 0; i < vDenseCounters.size(); i++) {
+		if (NULL != vDenseCounters[i].puLCounters) {
+			return 1;
+		}
+	}
+	for (unsigned int i = 0; i < vMappedCounters.size(); i++) {
+		if ((vMappedCounters[i].uiNumPaths > 0) && !vMappedCounters[i].bInFile) {
+			return 1;
+		}
+	}
+	for (BLPPThreadTable *btP = btHeadP; btP != NULL; btP = btP->btNextP) {
+		if ((NULL != btP->btTablesP) || (NULL != btP->tcCountersP)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* The profile is written to prof.res, or to the file named by
+   BLPP_PROFILE_FILE, in which %p stands for the process ID, %h for the host
+   name and %t for the time the name was first needed, in seconds since the
+   epoch. The name is worked out again in a forked child.
+*/
+static char acProfilePath[PATH_MAX];
+static pid_t siPathPID;
+
+/* Room for a suffix added to the name of the profile (.<pid>.snapshot,
+   .tmp.<pid>, .lock); names of temporary files and locks can have two
+*/
+#define BLPP_PATH_SUFFIX_MAX (64)
+
+/* This function expands a profile file name pattern.
+	 Inputs:
+	   pcPattern -> Pattern
+		 pcPath    -> Receives the file name
+		 uiSize    -> Size of pcPath
+	 Return Value:
+	   None
+*/
+static void expand_profile_path(const char *pcPattern, char *pcPath,
+																size_t uiSize) {
+	size_t uiLen = 0;
+	char acHost[256];
+
+	for (; ('\0' != *pcPattern) && (uiLen + 1 < uiSize); pcPattern++) {
+		const char *pcSubst = NULL;
+		char acNum[32];
+
+		if ('%' == *pcPattern) {
+			switch (pcPattern[1]) {
+			case 'p':
+				snprintf(acNum, sizeof(acNum), "%d", (int) getpid());
+				pcSubst = acNum;
+				break;
+			case 'h':
+				if (0 != gethostname(acHost, sizeof(acHost))) {
+					strcpy(acHost, "localhost");
+				}
+				acHost[sizeof(acHost) - 1] = '\0';
+				pcSubst = acHost;
+				break;
+			case 't':
+				snprintf(acNum, sizeof(acNum), "%lu", (unsigned long) time(NULL));
+				pcSubst = acNum;
+				break;
+			case '%':
+				pcSubst = "%";
+				break;
+			}
+		}
+		if (NULL != pcSubst) {
+			uiLen += snprintf(pcPath + uiLen, uiSize - uiLen, "%s", pcSubst);
+			uiLen = std::min(uiLen, uiSize - 1);
+			pcPattern++;
+		} else {
+			pcPath[uiLen++] = *pcPattern;
+		}
+	}
+	pcPath[uiLen] = '\0';
+}
+
+/* This function returns the name of the profile file of this process */
+static const char *profile_path() {
+	if (getpid() != siPathPID) {
+		const char *pcPattern = getenv("BLPP_PROFILE_FILE");
+		if ((NULL == pcPattern) || ('\0' == *pcPattern)) {
+			pcPattern = "prof.res";
+		}
+		expand_profile_path(pcPattern, acProfilePath, sizeof(acProfilePath));
+		siPathPID = getpid();
+	}
+	return acProfilePath;
+}
+
+/* This function returns the BLPP_FUNC_* flags of a function */
+static uint32_t func_flags(unsigned int uiFID) {
+	return (uiFID < vFuncFlags.size()) ? vFuncFlags[uiFID] : 0;
+}
+
+/* This function maps the header and index of the memory mapped profile,
+	 creating the file on first use.
+	 Inputs:
+	   None
+	 Return Value:
+	   1 if they are mapped, 0 otherwise
+*/
+static int map_profile_header() {
+	size_t uiPage = sysconf(_SC_PAGESIZE);
+	BLPPProfHdr *bphP;
+	void *vNewP;
+
+	if (NULL != vMapP) {
+		return 1;
+	}
+	if (bMapDetached) {
+		return 0;
+	}
+	if (siMapFD < 0) {
+		siMapFD = open(profile_path(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	}
+	uiMapSize = sizeof(BLPPProfHdr) + BLPP_MAP_MAX_FUNCS * sizeof(BLPPFuncIndex);
+	uiMapSize = (uiMapSize + uiPage - 1) / uiPage * uiPage;
+	if ((siMapFD < 0) || (0 != ftruncate(siMapFD, uiMapSize))) {
+		return 0;
+	}
+	vNewP = mmap(NULL, uiMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, siMapFD, 0);
+	if (MAP_FAILED == vNewP) {
+		return 0;
+	}
+
+	bphP = (BLPPProfHdr*) vNewP;
+	bphP->uiMagic = BLPP_PROF_MAGIC;
+	bphP->uiVersion = BLPP_PROF_VERSION;
+	bphP->uiHdrSize = sizeof(BLPPProfHdr);
+	bphP->uiNumFuncs = 0;
+	bphP->uiSampleRate = uiSampleRate;
+	bphP->uiFlags = 0;
+	bphP->uLBuildID = uLBuildID;
+	vMapP = vNewP;
+	uiFileSize = uiMapSize;
+	return 1;
+}
+
+/* This function allocates counters at the end of the memory mapped
+	 profile, mapping a new chunk of the file if the last one is full.
+	 Inputs:
+	   uiSize   -> Bytes to allocate
+		 uLOffset -> Receives their offset in the file
+	 Return Value:
+	   The counters, or NULL if they can't be mapped
+*/
+static uint64_t *alloc_mapped_counters(size_t uiSize, uint64_t &uLOffset) {
+	size_t uiPage = sysconf(_SC_PAGESIZE);
+	uint64_t *puLCountersP;
+
+	if (uiSize > uiChunkFree) {
+		BLPPMapChunk mc;
+		mc.uiSize = std::max<size_t>(BLPP_MAP_CHUNK_SIZE,
+																 (uiSize + uiPage - 1) / uiPage * uiPage);
+		if (0 != ftruncate(siMapFD, uiFileSize + mc.uiSize)) {
+			return NULL;
+		}
+		mc.vP = mmap(NULL, mc.uiSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+								 siMapFD, uiFileSize);
+		if (MAP_FAILED == mc.vP) {
+			if (0 != ftruncate(siMapFD, uiFileSize)) {
+				/* Harmless: the file then ends in zeros that no index entry
+					 points to, and the next chunk is mapped over them */
+			}
+			return NULL;
+		}
+		vMapChunks.push_back(mc);
+		pcChunkFreeP = (char*) mc.vP;
+		uiChunkFree = mc.uiSize;
+		uiFileSize += mc.uiSize;
+	}
+	uLOffset = uiFileSize - uiChunkFree;
+	puLCountersP = (uint64_t*) pcChunkFreeP;
+	pcChunkFreeP += uiSize;
+	uiChunkFree -= uiSize;
+	return puLCountersP;
+}
+
+/* This function moves the counters of a newly registered function into the
+	 memory mapped profile, and adds the function to its index. Counters
+	 already in the file are not touched. The function's code normally runs
+	 only once its module is registered, so nothing increments the static
+	 array while its counts are carried over.
+	 Inputs:
+	   uiFID -> Function ID
+	 Return Value:
+	   None
+	 Side Effects:
+	   If the counters can't be mapped, they stay where they are and are
+		 written out at exit
+*/
+static void map_counters(unsigned int uiFID) {
+	BLPPMappedCounters &mc = vMappedCounters[uiFID];
+	size_t uiSize = mc.uiNumPaths * sizeof(uint64_t);
+	BLPPProfHdr *bphP;
+	BLPPFuncIndex *bfiP;
+	uint64_t *puLCountersP;
+	uint64_t uLOffset = 0;
+
+	if ((uiFID >= BLPP_MAP_MAX_FUNCS) || !map_profile_header()) {
+		return;
+	}
+	if (uiSize > 0) {
+		puLCountersP = alloc_mapped_counters(uiSize, uLOffset);
+		if (NULL == puLCountersP) {
+			return;
+		}
+		memcpy(puLCountersP, *mc.ppuLCounters, uiSize);
+		__atomic_store_n(mc.ppuLCounters, puLCountersP, __ATOMIC_RELEASE);
+	}
+	mc.bInFile = 1;
+
+	bphP = (BLPPProfHdr*) vMapP;
+	bfiP = (BLPPFuncIndex*) (bphP + 1);
+	bfiP[uiFID].uLOffset = uLOffset;
+	bfiP[uiFID].uLSize = uiSize;
+	bfiP[uiFID].uiNumPaths = mc.uiNumPaths;
+	bfiP[uiFID].uiEncoding = BLPP_ENC_DENSE | func_flags(uiFID);
+	/* Functions in between have no mapped counters, but may have flags */
+	for (unsigned int i = bphP->uiNumFuncs; i < uiFID; i++) {
+		bfiP[i].uiEncoding = BLPP_ENC_DENSE | func_flags(i);
+	}
+	if (uiFID >= bphP->uiNumFuncs) {
+		__atomic_store_n(&bphP->uiNumFuncs, uiFID + 1, __ATOMIC_RELEASE);
+	}
+}
+
+/* This function flushes the memory mapped profile to the file.
+	 Inputs:
+	   siFlags -> MS_ASYNC or MS_SYNC
+	 Return Value:
+	   None
+*/
+static void sync_mapped_profile(int siFlags) {
+	msync(vMapP, uiMapSize, siFlags);
+	for (unsigned int i = 0; i < vMapChunks.size(); i++) {
+		msync(vMapChunks[i].vP, vMapChunks[i].uiSize, siFlags);
+	}
+}
+
+/* This function converts merged path maps into a profile.
+	 Inputs:
+	   vMerged -> One path map per function ID
+		 pd      -> Receives the profile
+	 Return Value:
+	   None
+*/
+static void make_profile(std::vector<PathMap> &vMerged, BLPPProfileData &pd) {
+	pd.uLBuildID = uLBuildID;
+	pd.uiSampleRate = uiSampleRate;
+	pd.vFuncs.resize(vMerged.size());
+	for (unsigned int i = 0; i < vMerged.size(); i++) {
+		std::vector<BLPPPathCount> &vPaths = pd.vFuncs[i].vPaths;
+		pd.vFuncs[i].uiFlags = func_flags(i);
+		vPaths.assign(vMerged[i].begin(), vMerged[i].end());
+		std::sort(vPaths.begin(), vPaths.end());
+	}
+}
+
+/* This function writes a profile in the v2 format defined by blpp_if.h to
+	 a temporary file, and renames it over pcPath, so readers never see a
+	 partial profile.
+	 Inputs:
+	   pcPath -> Profile file
+		 pd     -> Profile
+	 Return Value:
+	   None
+*/
+static void write_profile(const char *pcPath, const BLPPProfileData &pd) {
+	char acTmpPath[PATH_MAX + 2 * BLPP_PATH_SUFFIX_MAX];
+	FILE *fp;
+	int siErr;
+
+	/* Other processes may be writing profiles of the same name */
+	siErr = snprintf(acTmpPath, sizeof(acTmpPath), "%s.tmp.%d", pcPath,
+									 (int) getpid());
+	if ((siErr < 0) || ((size_t) siErr >= sizeof(acTmpPath))) {
+		fprintf(stderr, "BLPP: profile name too long: %s\n", pcPath);
+		return;
+	}
+	fp = fopen(acTmpPath, "wb");
+	if (NULL == fp) {
+		fprintf(stderr, "BLPP: can't write %s\n", acTmpPath);
+		return;
+	}
+	siErr = blpp_write_profile(fp, pd);
+	if ((0 != fclose(fp)) || (0 != siErr)) {
+		fprintf(stderr, "BLPP: can't write %s\n", acTmpPath);
+		unlink(acTmpPath);
+		return;
+	}
+	rename(acTmpPath, pcPath);
+}
+
+/* This function returns 1 iff BLPP_PROFILE_ACCUMULATE asks for the profile
+	 to be added to the existing one, and 0 otherwise. A memory mapped
+	 profile is updated in place, so it is never accumulated.
+*/
+static int accumulate_mode() {
+	const char *pcAccumulate = getenv("BLPP_PROFILE_ACCUMULATE");
+
+	if ((NULL == pcAccumulate) || ('\0' == *pcAccumulate) ||
+			(0 == strcmp(pcAccumulate, "0"))) {
+		return 0;
+	}
+	if (NULL != vMapP) {
+		fprintf(stderr, "BLPP: BLPP_PROFILE_ACCUMULATE is ignored with -blppmmap\n");
+		return 0;
+	}
+	return 1;
+}
+
+/* This function returns whether the counts of every function of two
+	 profiles can be added up: functions counted in both must have been
+	 counted with the same strategy.
+*/
+static bool same_strategies(const BLPPProfileData &pd1,
+														const BLPPProfileData &pd2) {
+	size_t uiNumFuncs = std::min(pd1.vFuncs.size(), pd2.vFuncs.size());
+
+	for (size_t i = 0; i < uiNumFuncs; i++) {
+		uint32_t uiFlags = pd1.vFuncs[i].uiFlags;
+		if (0 != blpp_merge_flags(uiFlags, blpp_has_counts(pd1.vFuncs[i]),
+															pd2.vFuncs[i].uiFlags,
+															blpp_has_counts(pd2.vFuncs[i]))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* This function adds a profile to the one in pcPath. Processes accumulating
+	 into the same file take turns by locking pcPath.lock with flock.
+	 Profiles of another build are replaced. If the sampling rates differ,
+	 both profiles are scaled to full counts.
+	 Inputs:
+	   pcPath -> Profile file
+		 pd     -> Profile to add (modified)
+	 Return Value:
+	   None
+*/
+static void accumulate_profile(const char *pcPath, BLPPProfileData &pd) {
+	char acLockPath[PATH_MAX + 2 * BLPP_PATH_SUFFIX_MAX];
+	BLPPProfileData pdOld;
+	FILE *fp;
+	int siLockFD = -1, siLen;
+
+	/* A truncated name would lock another file */
+	siLen = snprintf(acLockPath, sizeof(acLockPath), "%s.lock", pcPath);
+	if ((siLen >= 0) && ((size_t) siLen < sizeof(acLockPath))) {
+		siLockFD = open(acLockPath, O_RDWR | O_CREAT, 0644);
+	}
+	if (siLockFD >= 0) {
+		while ((0 != flock(siLockFD, LOCK_EX)) && (EINTR == errno));
+	} else {
+		fprintf(stderr, "BLPP: can't lock %s; accumulating unlocked\n",
+						acLockPath);
+	}
+
+	fp = fopen(pcPath, "rb");
+	if (NULL != fp) {
+		if (0 != blpp_read_profile(fp, pdOld)) {
+			fprintf(stderr, "BLPP: %s is not a profile; replacing it\n", pcPath);
+		} else if (pdOld.uLBuildID != pd.uLBuildID) {
+			fprintf(stderr, "BLPP: %s is of another build; replacing it\n", pcPath);
+		} else if (!same_strategies(pdOld, pd)) {
+			fprintf(stderr, "BLPP: %s counts functions differently; replacing it\n",
+							pcPath);
+		} else {
+			bool bScale = (pdOld.uiSampleRate != pd.uiSampleRate);
+			BLPPFuncProfile bfEmpty;
+
+			if (pdOld.vFuncs.size() > pd.vFuncs.size()) {
+				pd.vFuncs.resize(pdOld.vFuncs.size());
+			}
+			for (unsigned int i = 0; i < pd.vFuncs.size(); i++) {
+				uint64_t uLOldWeight = 1, uLNewWeight = 1;
+				if (bScale) {
+					/* Only sampled functions are scaled */
+					uLNewWeight = blpp_func_rate(pd.vFuncs[i].uiFlags, pd.uiSampleRate);
+					if (i < pdOld.vFuncs.size()) {
+						uLOldWeight = blpp_func_rate(pdOld.vFuncs[i].uiFlags,
+																				 pdOld.uiSampleRate);
+					}
+				}
+				if (1 != uLNewWeight) {
+					BLPPFuncProfile bfNew;
+					blpp_add_function(bfNew, pd.vFuncs[i], uLNewWeight);
+					pd.vFuncs[i] = bfNew;
+				}
+				/* The strategies were checked above */
+				blpp_add_function(pd.vFuncs[i], (i < pdOld.vFuncs.size()) ?
+													pdOld.vFuncs[i] : bfEmpty, uLOldWeight);
+			}
+			if (bScale) {
+				pd.uiSampleRate = 1;
+			}
+		}
+		fclose(fp);
+	}
+	write_profile(pcPath, pd);
+
+	if (siLockFD >= 0) {
+		close(siLockFD); /* Releases the lock */
+	}
+}
+
+/* These serialize writers of the profile: snapshots and the final dump */
+static void lock_dump() {
+	while (!__sync_bool_compare_and_swap(&siDumping, 0, 1)) {
+		sched_yield();
+	}
+}
+
+static void unlock_dump() {
+	__sync_lock_release(&siDumping);
+}
+
+/* This function writes the profile of this process (see profile_path).
+	 While part of the profile is memory mapped, replacing the profile would
+	 detach the mapping from the file, so snapshots go to <profile>.snapshot
+	 instead. In accumulate mode, only the final dump is added to the
+	 profile; snapshots go to <profile>.<pid>.snapshot.
+	 Inputs:
+	   bIsFinal -> 1 for the dump at exit, 0 for a snapshot
+	 Return Value:
+	   None
+	 Side Effects:
+	   Must be called with the dump lock held
+*/
+static void dump_profile(int bIsFinal) {
+	std::vector<PathMap> vMerged;
+	BLPPProfileData pd;
+	const char *pcPath = profile_path();
+	char acSnapshotPath[PATH_MAX + BLPP_PATH_SUFFIX_MAX];
+	int bAccumulate = accumulate_mode();
+
+	if (NULL != vMapP) {
+		if (!has_unmapped_counts()) {
+			/* The mapped profile is complete; nothing to serialize */
+			sync_mapped_profile(bIsFinal ? MS_ASYNC : MS_SYNC);
+			return;
+		}
+		if (!bIsFinal) {
+			snprintf(acSnapshotPath, sizeof(acSnapshotPath), "%s.snapshot", pcPath);
+			pcPath = acSnapshotPath;
+		}
+	} else if (bAccumulate && !bIsFinal) {
+		snprintf(acSnapshotPath, sizeof(acSnapshotPath), "%s.%d.snapshot", pcPath,
+						 (int) getpid());
+		pcPath = acSnapshotPath;
+	}
+
+	merge_thread_tables(vMerged);
+	make_profile(vMerged, pd);
+	if (bAccumulate && bIsFinal) {
+		accumulate_profile(pcPath, pd);
+	} else {
+		write_profile(pcPath, pd);
+	}
+}
 
 /* This function returns the total number of recorded paths for a function.
 	 Inputs:
@@ -16,7 +684,7 @@ std::vector<__gnu_cxx::hash_map<uint64_t, unsigned int> > vProcPathMaps(10);
 	 Return Value:
 	   Number of recorded paths for the function.
 */
-	 
+
 static unsigned int get_total_path_count(__gnu_cxx::hash_map<uint64_t, unsigned int> hm) {
 	unsigned int uiNumPaths = 0;
 	for(__gnu_cxx::hash_map<uint64_t, unsigned int>::iterator it = hm.begin(); it != hm.end();
@@ -26,84 +694,490 @@ static unsigned int get_total_path_count(__gnu_cxx::hash_map<uint64_t, unsigned
 	return uiNumPaths;
 }
 
+/* This function registers the counter array of a function with a small
+	 path space.
+	 Inputs:
+	   siProcID    -> Function ID
+		 puLCounters -> Counter array, indexed by path ID
+		 uiNumPaths  -> Number of paths (and counters) of the function
+	 Return Value:
+	   None
+*/
+static void record_counters(signed int siProcID, uint64_t *puLCounters,
+														uint32_t uiNumPaths) {
+	BLPPDenseCounters dc;
+
+	if (siProcID >= (signed int) vDenseCounters.size()) {
+		dc.puLCounters = NULL;
+		dc.uiNumPaths = 0;
+		vDenseCounters.resize(siProcID + 1, dc);
+	}
+	vDenseCounters[siProcID].puLCounters = puLCounters;
+	vDenseCounters[siProcID].uiNumPaths = uiNumPaths;
+}
+
+
+/* This function records the sampling rate of a sampled module. All sampled
+	 modules of a program must use the same rate, since the profile has only
+	 one.
+	 Inputs:
+	   uiRate -> One in uiRate paths is counted
+	 Return Value:
+	   None
+*/
+static void set_sample_rate(unsigned int uiRate) {
+	if ((uiSampleRate > 1) && (uiRate != uiSampleRate)) {
+		fprintf(stderr, "BLPP: modules sampled at 1/%u and 1/%u; counts are "
+						"scaled by %u\n", uiSampleRate, uiRate, uiSampleRate);
+		return;
+	}
+	uiSampleRate = uiRate;
+	if (NULL != vMapP) {
+		((BLPPProfHdr*) vMapP)->uiSampleRate = uiSampleRate;
+	}
+}
+
+
+/* This function records the build ID of an instrumented module. The ID of
+	 the profile is the sum of the IDs of all modules, which does not depend
+	 on the order in which they are loaded.
+	 Inputs:
+	   uLID -> Build ID computed by the instrumentation pass
+	 Return Value:
+	   None
+*/
+static void add_build_id(uint64_t uLID) {
+	uLBuildID += uLID;
+	if (NULL != vMapP) {
+		((BLPPProfHdr*) vMapP)->uLBuildID = uLBuildID;
+	}
+}
+
+
+/* This function registers the counter array of a function built with
+	 -blppmmap, and moves it into the memory mapped profile.
+	 Inputs:
+	   siProcID     -> Function ID
+		 ppuLCounters -> Pointer through which the function reaches its counters
+		 uiNumPaths   -> Number of paths (and counters) of the function
+	 Return Value:
+	   None
+*/
+static void record_mapped_counters(signed int siProcID,
+																	 uint64_t **ppuLCounters,
+																	 uint32_t uiNumPaths) {
+	BLPPMappedCounters mc;
+	static uint64_t *puLNoCountersP;
+
+	if (siProcID >= (signed int) vMappedCounters.size()) {
+		mc.ppuLCounters = &puLNoCountersP;
+		mc.uiNumPaths = 0;
+		mc.bInFile = 0;
+		vMappedCounters.resize(siProcID + 1, mc);
+	}
+	vMappedCounters[siProcID].ppuLCounters = ppuLCounters;
+	vMappedCounters[siProcID].uiNumPaths = uiNumPaths;
+	vMappedCounters[siProcID].bInFile = 0;
+	map_counters(siProcID);
+}
+
+
+/* This function returns the calling thread's counter array for a function,
+	 allocating it on the first call from that thread. Threaded builds cache
+	 the result in a thread-local pointer, so this is called at most once per
+	 function and thread.
+	 Inputs:
+	   siProcID   -> Function ID
+		 uiNumPaths -> Number of paths of the function
+	 Return Value:
+	   Zero initialized counter array, indexed by path ID
+*/
 extern "C"
-void __record_entry(unsigned long id) {
+uint64_t *__blpp_thread_counters(signed int siProcID, uint32_t uiNumPaths) {
+	BLPPThreadTable *btP = get_thread_table();
+	BLPPThreadCounters *tcP;
+
+	for (tcP = btP->tcCountersP; tcP != NULL; tcP = tcP->tcNextP) {
+		if (tcP->siProcID == siProcID) {
+			return tcP->dc.puLCounters;
+		}
+	}
 
-  if (!siFirstTime) {
-    uiFirstProcID = id;
-    siFirstTime = 1;
-  }
-  
+	tcP = new BLPPThreadCounters;
+	tcP->siProcID = siProcID;
+	tcP->dc.puLCounters = new uint64_t[uiNumPaths]();
+	tcP->dc.uiNumPaths = uiNumPaths;
+	tcP->tcNextP = btP->tcCountersP;
+	__atomic_store_n(&btP->tcCountersP, tcP, __ATOMIC_RELEASE);
+	return tcP->dc.puLCounters;
 }
 
 
+/* This function is the out of line part of a path table increment. The
+	 first miss on a function's table replaces the shared empty table with a
+	 new table owned by the calling thread; *ppTable is thread local, so
+	 each thread gets a table of its own.
+	 Inputs:
+	   ppTable  -> Table of the function
+		 uLPathID -> Path ID
+		 siProcID -> Function ID
+	 Return Value:
+	   None
+*/
 extern "C"
-void __record_exit(unsigned long id) {
-
-	int i;
-	__gnu_cxx::hash_map<uint64_t, unsigned int> h;
-	BLPPDBHdr bdbh;
-	BLPPProfInfo bprof;
-	unsigned int uiFixedOffset, uiCumPathCount;
-
-	if (id == uiFirstProcID) {
-		FILE *fp = fopen("prof.res", "wb");
-		assert(fp != NULL);
-	
-		/* Write all path frequencies to the file - in the format defined by
-		   blpp_if.h
-		*/
-
-		/* First the header */
-		uiFixedOffset = (siMaxProcID + 2) * sizeof(BLPPDBHdr);
-		uiCumPathCount = 0;
-		for (i = 0; i <= siMaxProcID; i++) {
-			bdbh.uiFunctionID = i;
-			bdbh.uiOffset = uiFixedOffset + (uiCumPathCount * sizeof(BLPPProfInfo));
-			bdbh.uiNumPaths = vProcPathMaps[i].size();//get_total_path_count(vProcPathMaps[i]);
-			uiCumPathCount += bdbh.uiNumPaths;
-			fwrite(&bdbh, sizeof(BLPPDBHdr), 1, fp);
-		}
-
-		/* A dummy function id */
-		bdbh.uiFunctionID = i;
-		bdbh.uiOffset = uiFixedOffset + (uiCumPathCount * sizeof(BLPPProfInfo));
-		bdbh.uiNumPaths = 0;
-		fwrite(&bdbh, sizeof(BLPPDBHdr), 1, fp);
-	
-	 	for (i = 0; i <= siMaxProcID; i++) {
-			h = vProcPathMaps[i];
-			for(__gnu_cxx::hash_map<uint64_t, unsigned int>::iterator it = h.begin(); it != h.end();
-				it++) {
-				bprof.uLPathID = (*it).first;
-				bprof.uiExecCount = (*it).second;
-				fwrite(&bprof, sizeof(BLPPProfInfo), 1, fp);
+void __blpp_table_miss(BLPPPathTable **ppTable, uint64_t uLPathID,
+											 signed int siProcID) {
+	BLPPPathTable *ptP = *ppTable;
+
+	if (&__blpp_empty_table == ptP) {
+		BLPPThreadTable *btP = get_thread_table();
+		ptP = blpp_table_create(siProcID);
+		ptP->btNextP = btP->btTablesP;
+		__atomic_store_n(&btP->btTablesP, ptP, __ATOMIC_RELEASE);
+		*ppTable = ptP;
+	}
+	blpp_table_insert(ptP, uLPathID);
+}
+
+
+/* This function hands the functions of a registered module to the runtime.
+	 Inputs:
+	   bmdP -> Module descriptor
+	 Return Value:
+	   None
+	 Side Effects:
+	   Must be called with the dump lock held
+*/
+static void add_module(BLPPModuleDesc *bmdP) {
+	uint32_t uiBase = *bmdP->puiIDBase;
+
+	add_build_id(bmdP->uLBuildID);
+	if (bmdP->uiSampleRate > 1) {
+		/* Before the mapped counters, so that the mapped profile has the rate */
+		set_sample_rate(bmdP->uiSampleRate);
+	}
+	for (uint32_t i = 0; i < bmdP->uiNumFuncs; i++) {
+		BLPPFuncDesc &bfd = bmdP->bfdFuncsP[i];
+		if (0 != bfd.uiFlags) {
+			/* Before the mapped counters, whose index entries carry the flags */
+			if (uiBase + bfd.uiFuncID >= vFuncFlags.size()) {
+				vFuncFlags.resize(uiBase + bfd.uiFuncID + 1, 0);
 			}
+			vFuncFlags[uiBase + bfd.uiFuncID] = bfd.uiFlags;
 		}
-	
-		fclose(fp);
+		switch (bfd.uiCounters) {
+		case BLPP_COUNTERS_DENSE:
+			record_counters(uiBase + bfd.uiFuncID, (uint64_t*) bfd.vCountersP,
+											bfd.uiNumPaths);
+			break;
+		case BLPP_COUNTERS_MAPPED:
+			record_mapped_counters(uiBase + bfd.uiFuncID,
+														 (uint64_t**) bfd.vCountersP, bfd.uiNumPaths);
+			break;
+		}
+	}
+}
+
+/* This function registers an instrumented module. It is called by the
+	 global constructor the instrumentation pass emits into every module.
+	 Inputs:
+	   bmdP -> Module descriptor
+	 Return Value:
+	   None
+	 Side Effects:
+	   Assigns the function IDs of the module
+*/
+extern "C"
+void __blpp_register_module(BLPPModuleDesc *bmdP) {
+	if (BLPP_MODULE_VERSION != bmdP->uiVersion) {
+		fprintf(stderr, "BLPP: module built for runtime version %u, not %u; "
+						"not profiled\n", bmdP->uiVersion, BLPP_MODULE_VERSION);
+		return;
 	}
 
+	/* Modules loaded at run time register while snapshots may be taken */
+	lock_dump();
+	*bmdP->puiIDBase = uiNumFuncIDs;
+	uiNumFuncIDs += bmdP->uiNumFuncs;
+	if (bRuntimeReady) {
+		add_module(bmdP);
+	} else {
+		bmdP->bmdNextP = bmdPendingP;
+		bmdPendingP = bmdP;
+	}
+	unlock_dump();
+}
+
+
+/* This function writes the profile when the program exits */
+static void dump_at_exit() {
+	lock_dump();
+	dump_profile(1);
+	siExited = 1;
+	unlock_dump();
+}
+
+/* A forked child inherits the counts of its parent, which the parent
+	 writes itself, and shares the memory mapped profile with it. The child
+	 zeroes the counts it inherited, and moves the counters of -blppmmap
+	 functions into arrays of its own, whose counts it writes at exit like
+	 those of other builds. Holding the dump lock across fork() keeps
+	 snapshots and module registration out of the way.
+*/
+static void prepare_fork() {
+	lock_dump();
+}
+
+static void after_fork_parent() {
+	unlock_dump();
+}
+
+/* This function gives the functions whose counters are in the memory
+	 mapped profile zeroed arrays of their own, and unmaps the profile.
+	 Inputs, Return Value:
+	   None
+	 Side Effects:
+	   Only the calling thread may be running
+*/
+static void detach_mapped_profile() {
+	for (unsigned int i = 0; i < vMappedCounters.size(); i++) {
+		BLPPMappedCounters &mc = vMappedCounters[i];
+		if ((mc.uiNumPaths > 0) && mc.bInFile) {
+			__atomic_store_n(mc.ppuLCounters, new uint64_t[mc.uiNumPaths](),
+											 __ATOMIC_RELEASE);
+		}
+		mc.bInFile = 0;
+	}
+	for (unsigned int i = 0; i < vMapChunks.size(); i++) {
+		munmap(vMapChunks[i].vP, vMapChunks[i].uiSize);
+	}
+	vMapChunks.clear();
+	munmap(vMapP, uiMapSize);
+	vMapP = NULL;
+	close(siMapFD);
+	siMapFD = -1;
+	uiFileSize = uiChunkFree = 0;
+	pcChunkFreeP = NULL;
+	bMapDetached = 1;
+}
+
+static void after_fork_child() {
+	if (NULL != vMapP) {
+		detach_mapped_profile();
+	}
+	for (unsigned int i = 0; i < vDenseCounters.size(); i++) {
+		const BLPPDenseCounters &dc = vDenseCounters[i];
+		if (NULL != dc.puLCounters) {
+			memset(dc.puLCounters, 0, dc.uiNumPaths * sizeof(uint64_t));
+		}
+	}
+	for (unsigned int i = 0; i < vMappedCounters.size(); i++) {
+		const BLPPMappedCounters &mc = vMappedCounters[i];
+		if (mc.uiNumPaths > 0) {
+			memset(*mc.ppuLCounters, 0, mc.uiNumPaths * sizeof(uint64_t));
+		}
+	}
+	/* The tables of the threads that didn't fork are never updated again */
+	for (BLPPThreadTable *btP = btHeadP; btP != NULL; btP = btP->btNextP) {
+		for (BLPPPathTable *ptP = btP->btTablesP; ptP != NULL; ptP = ptP->btNextP) {
+			blpp_table_zero(ptP);
+		}
+		for (BLPPThreadCounters *tcP = btP->tcCountersP; tcP != NULL;
+				 tcP = tcP->tcNextP) {
+			memset(tcP->dc.puLCounters, 0, tcP->dc.uiNumPaths * sizeof(uint64_t));
+		}
+	}
+	unlock_dump();
+}
+
+/* This object is constructed after the containers used by add_module, so
+	 that they are ready for the queued modules, and registers dump_at_exit
+	 after they have been constructed, so that it runs before they are
+	 destroyed.
+*/
+static struct BLPPRuntimeInit {
+	BLPPRuntimeInit() {
+		std::vector<BLPPModuleDesc*> vModules;
+
+		lock_dump();
+		for (BLPPModuleDesc *bmdP = bmdPendingP; bmdP != NULL; 
+				 bmdP = bmdP->bmdNextP) {
+			vModules.push_back(bmdP);
+		}
+		/* In the order they were registered */
+		for (unsigned int i = vModules.size(); i > 0; i--) {
+			add_module(vModules[i - 1]);
+		}
+		bmdPendingP = NULL;
+		bRuntimeReady = 1;
+		unlock_dump();
+		atexit(dump_at_exit);
+		pthread_atfork(prepare_fork, after_fork_parent, after_fork_child);
+	}
+} briRuntimeInit;
+
+
+/* This function writes a snapshot of the profile while the program keeps
+	 running. Threads are not stopped; each counter is read as it stands.
+	 Snapshots requested after the final profile was written do nothing.
+	 Inputs:
+	   None
+	 Return Value:
+	   0 on success, -1 if no profile was written
+*/
+extern "C"
+int __blpp_dump() {
+	int siRet = -1;
+
+	lock_dump();
+	if (!siExited) {
+		dump_profile(0);
+		siRet = 0;
+	}
+	unlock_dump();
+	return siRet;
 }
 
 
 extern "C"
 void __record_path_sum(uint64_t uiPathID, signed int siProcID) {
-	__gnu_cxx::hash_map<uint64_t, unsigned int>::iterator it;
-	__gnu_cxx::hash_map<uint64_t, unsigned int>::value_type *vt;
+	BLPPThreadTable *btP = get_thread_table();
 
-	if (siProcID >= vProcPathMaps.size()) {
-		vProcPathMaps.resize(siProcID * 2);
+	if (siProcID >= (signed int) btP->vProcTables.size()) {
+		btP->vProcTables.resize(siProcID * 2 + 1, &__blpp_empty_table);
 	}
 
-	it = vProcPathMaps[siProcID].find(uiPathID); 
-	if (it != vProcPathMaps[siProcID].end()) {
-		(*it).second = (*it).second + 1;
-	} else {
-		vProcPathMaps[siProcID].insert(__gnu_cxx::hash_map<uint64_t, unsigned int>::value_type(uiPathID, 1));
+	blpp_table_increment(&btP->vProcTables[siProcID], uiPathID, siProcID);
+
+}
+
+
+/* Functions of -blpptoggle builds run their instrumented version only while
+   this flag is nonzero, and an uninstrumented copy otherwise. It is read
+   once per call, so a change applies to the calls made after it.
+*/
+extern "C" {
+volatile uint32_t __blpp_enabled = 1;
+}
+
+/* This function turns profiling on or off in -blpptoggle builds, e.g. for
+	 a few minutes of a long running program. Counts already taken are kept.
+	 Inputs:
+	   siEnable -> Nonzero to count paths, 0 to stop counting
+	 Return Value:
+	   1 if profiling was on before, 0 otherwise
+*/
+extern "C"
+int __blpp_enable(int siEnable) {
+	int siWasOn = (0 != __blpp_enabled);
+
+	__blpp_enabled = (0 != siEnable);
+	return siWasOn;
+}
+
+/* Profiling starts off with BLPP_ENABLED=0, and the signal named by
+   BLPP_TOGGLE_SIGNAL turns it on and off. The handler only writes the flag,
+   which is async-signal-safe.
+*/
+static void toggle_profiling(int siSignal) {
+	(void) siSignal;
+	__blpp_enabled = !__blpp_enabled;
+}
+
+/* Snapshots can also be requested with a signal (BLPP_DUMP_SIGNAL, e.g.
+   "USR1" or a signal number) or taken periodically (BLPP_DUMP_INTERVAL, in
+   seconds). Both are served by a background thread, since writing the
+   profile is not async-signal-safe; the handler only wakes the thread up.
+*/
+static sem_t sDumpRequest;
+static unsigned int uiDumpInterval;
+
+static void request_dump(int siSignal) {
+	(void) siSignal;
+	sem_post(&sDumpRequest);
+}
+
+static void *dump_thread(void *vP) {
+	(void) vP;
+	for (;;) {
+		if (0 != uiDumpInterval) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += uiDumpInterval;
+			while ((0 != sem_timedwait(&sDumpRequest, &ts)) && (EINTR == errno));
+		} else {
+			while ((0 != sem_wait(&sDumpRequest)) && (EINTR == errno));
+		}
+		__blpp_dump();
+	}
+	return NULL;
+}
+
+/* This function parses BLPP_DUMP_SIGNAL and BLPP_TOGGLE_SIGNAL.
+	 Inputs:
+	   pcSignal -> "USR1", "SIGUSR1", "USR2", "SIGUSR2" or a signal number
+	 Return Value:
+	   The signal number, or 0 if the value is not a signal
+*/
+static int parse_dump_signal(const char *pcSignal) {
+	if (0 == strncmp(pcSignal, "SIG", 3)) {
+		pcSignal += 3;
+	}
+	if (0 == strcmp(pcSignal, "USR1")) {
+		return SIGUSR1;
+	}
+	if (0 == strcmp(pcSignal, "USR2")) {
+		return SIGUSR2;
+	}
+	return atoi(pcSignal);
+}
+
+__attribute__((constructor))
+static void init_dump_thread() {
+	const char *pcSignal = getenv("BLPP_DUMP_SIGNAL");
+	const char *pcInterval = getenv("BLPP_DUMP_INTERVAL");
+	int siSignal = (NULL != pcSignal) ? parse_dump_signal(pcSignal) : 0;
+	pthread_t tThread;
+	pthread_attr_t taAttr;
+
+	if (NULL != pcInterval) {
+		uiDumpInterval = atoi(pcInterval);
 	}
-	if (siProcID > siMaxProcID) {
-		siMaxProcID = siProcID;
+	if ((siSignal <= 0) && (0 == uiDumpInterval)) {
+		return;
+	}
+
+	sem_init(&sDumpRequest, 0, 0);
+	if (siSignal > 0) {
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = request_dump;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		sigaction(siSignal, &sa, NULL);
 	}
 
+	pthread_attr_init(&taAttr);
+	pthread_attr_setdetachstate(&taAttr, PTHREAD_CREATE_DETACHED);
+	pthread_create(&tThread, &taAttr, dump_thread, NULL);
+	pthread_attr_destroy(&taAttr);
+}
+
+__attribute__((constructor))
+static void init_toggle() {
+	const char *pcEnabled = getenv("BLPP_ENABLED");
+	const char *pcSignal = getenv("BLPP_TOGGLE_SIGNAL");
+	int siSignal = (NULL != pcSignal) ? parse_dump_signal(pcSignal) : 0;
+
+	if (NULL != pcEnabled) {
+		__blpp_enabled = (0 != atoi(pcEnabled));
+	}
+	if (siSignal > 0) {
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = toggle_profiling;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		sigaction(siSignal, &sa, NULL);
+	}
 }
@@ -0,0 +1,130 @@
+/* This program compares the open addressing path table (BLPPPathTable.h)
+   with the __gnu_cxx::hash_map previously used by the runtime, on a skewed
+   (Zipf-like) distribution of path IDs.
+
+   Usage: PathTableBench [number of distinct paths] [number of increments]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
+#include <hash_map>
+#include "../BLPPPathTable.h"
+
+typedef __gnu_cxx::hash_map<uint64_t, uint64_t> PathMap;
+
+/* The bench links BLPPPathTable.cpp only, not the rest of the runtime,
+	 which would write its tables to prof.res at exit. This is the runtime's
+	 miss handler, less the registration of the table with its thread.
+*/
+extern "C"
+void __blpp_table_miss(BLPPPathTable **ppTable, uint64_t uLPathID,
+											 signed int siProcID) {
+	if (&__blpp_empty_table == *ppTable) {
+		*ppTable = blpp_table_create(siProcID);
+	}
+	blpp_table_insert(*ppTable, uLPathID);
+}
+
+/* Callback of blpp_table_for_each, checking a path against the hash_map */
+typedef struct {
+	PathMap *phP;
+	uint64_t uLSum;
+	bool isMismatch;
+} TableCheck;
+
+static void check_path(uint64_t uLPathID, uint64_t uLCount, void *vDataP) {
+	TableCheck *tcP = (TableCheck*) vDataP;
+	PathMap::iterator it = tcP->phP->find(uLPathID);
+
+	if ((it == tcP->phP->end()) || ((*it).second != uLCount)) {
+		tcP->isMismatch = true;
+	}
+	tcP->uLSum += uLCount;
+}
+
+static double elapsed(const struct timespec &tsStart) {
+	struct timespec tsEnd;
+	clock_gettime(CLOCK_MONOTONIC, &tsEnd);
+	return (tsEnd.tv_sec - tsStart.tv_sec) +
+		(tsEnd.tv_nsec - tsStart.tv_nsec) * 1e-9;
+}
+
+/* Draws uiNumSamples path IDs among uiNumPaths scattered path IDs, with
+	 the probability of the k-th most frequent path proportional to 1/k^s.
+*/
+static void make_trace(unsigned int uiNumPaths, unsigned int uiNumSamples,
+											 double flSkew, std::vector<uint64_t> &vTrace) {
+	std::vector<double> vCumWeight(uiNumPaths);
+	std::vector<uint64_t> vPathIDs(uiNumPaths);
+	double flSum = 0.0;
+
+	for (unsigned int i = 0; i < uiNumPaths; i++) {
+		flSum += 1.0 / pow(i + 1, flSkew);
+		vCumWeight[i] = flSum;
+		/* Path IDs of large functions are sparse */
+		vPathIDs[i] = ((uint64_t) rand() << 31) ^ rand();
+	}
+
+	vTrace.resize(uiNumSamples);
+	for (unsigned int i = 0; i < uiNumSamples; i++) {
+		double flR = flSum * (rand() / (RAND_MAX + 1.0));
+		unsigned int k = std::lower_bound(vCumWeight.begin(), vCumWeight.end(), flR)
+			- vCumWeight.begin();
+		vTrace[i] = vPathIDs[std::min(k, uiNumPaths - 1)];
+	}
+}
+
+int main(int argc, char **argv) {
+	unsigned int uiNumPaths = (argc > 1) ? atoi(argv[1]) : 100000;
+	unsigned int uiNumSamples = (argc > 2) ? atoi(argv[2]) : 20000000;
+	double aflSkews[] = {0.8, 1.1, 1.5};
+
+	for (unsigned int s = 0; s < sizeof(aflSkews) / sizeof(aflSkews[0]); s++) {
+		std::vector<uint64_t> vTrace;
+		struct timespec tsStart;
+		PathMap h;
+		BLPPPathTable *btP = &__blpp_empty_table;
+		uint64_t uLMapSum = 0;
+		double flMapTime, flTableTime;
+
+		srand(1);
+		make_trace(uiNumPaths, uiNumSamples, aflSkews[s], vTrace);
+
+		clock_gettime(CLOCK_MONOTONIC, &tsStart);
+		for (unsigned int i = 0; i < uiNumSamples; i++) {
+			PathMap::iterator it = h.find(vTrace[i]);
+			if (it != h.end()) {
+				(*it).second = (*it).second + 1;
+			} else {
+				h.insert(PathMap::value_type(vTrace[i], 1));
+			}
+		}
+		flMapTime = elapsed(tsStart);
+
+		clock_gettime(CLOCK_MONOTONIC, &tsStart);
+		for (unsigned int i = 0; i < uiNumSamples; i++) {
+			blpp_table_increment(&btP, vTrace[i], 0);
+		}
+		flTableTime = elapsed(tsStart);
+
+		/* Both must have counted every increment, including the paths still
+			 in a slot array being migrated
+		*/
+		for (PathMap::iterator it = h.begin(); it != h.end(); it++) {
+			uLMapSum += (*it).second;
+		}
+		TableCheck tc = {&h, 0, false};
+		blpp_table_for_each(btP, check_path, &tc);
+
+		printf("skew %.1f, %zu distinct paths: hash_map %.2f ns/inc, "
+					 "path table %.2f ns/inc (%.1fx)%s\n",
+					 aflSkews[s], h.size(), flMapTime * 1e9 / uiNumSamples,
+					 flTableTime * 1e9 / uiNumSamples, flMapTime / flTableTime,
+					 ((uLMapSum == tc.uLSum) && !tc.isMismatch) ? "" :
+					 " COUNT MISMATCH");
+	}
+	return 0;
+}
@@ -0,0 +1,194 @@
+/* This program checks that BLPPMerge keeps the counts of every input when
+   a function has both dense and sparse inputs, including when the path IDs
+   of the sparse input are too large for the merge to sum them densely. It
+   also checks that inputs counting a function with different strategies
+   are rejected.
+
+   Usage: BLPPMergeCheck <path of BLPPMerge>
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include "../BLPPProfileIO.h"
+
+#define BLPP_CHECK_DENSE_PATHS (64)
+#define BLPP_CHECK_COUNT       (1ULL << 60)
+
+static int write_input(const std::string &sPath, const BLPPProfileData &pd) {
+	FILE *fp = fopen(sPath.c_str(), "wb");
+	int siErr;
+
+	if (NULL == fp) {
+		return -1;
+	}
+	siErr = blpp_write_profile(fp, pd);
+	return (0 != fclose(fp)) ? -1 : siErr;
+}
+
+/* This function runs BLPPMerge on inputs in sDir, into sDir/out.res.
+	 Return Value:
+	   0 if BLPPMerge succeeded and pdOut holds its output, -1 otherwise
+*/
+static int run_merge(const char *pcMerge, const std::string &sDir,
+										 const std::string &sInputs, BLPPProfileData &pdOut) {
+	std::string sCmd = std::string(pcMerge) + " -j 1 -o " + sDir + "/out.res " +
+		sInputs + " 2>/dev/null";
+	FILE *fp;
+	int siErr;
+
+	if (0 != system(sCmd.c_str())) {
+		return -1;
+	}
+	fp = fopen((sDir + "/out.res").c_str(), "rb");
+	if (NULL == fp) {
+		return -1;
+	}
+	siErr = blpp_read_profile(fp, pdOut);
+	fclose(fp);
+	return siErr;
+}
+
+/* This function returns the count of a path in a function of a profile */
+static uint64_t path_count(const BLPPFuncProfile &bf, uint64_t uLPathID) {
+	if (uLPathID < bf.vDense.size()) {
+		return bf.vDense[uLPathID];
+	}
+	for (size_t j = 0; j < bf.vPaths.size(); j++) {
+		if (bf.vPaths[j].first == uLPathID) {
+			return bf.vPaths[j].second;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	char acDir[] = "/tmp/blppmergeXXXXXX";
+	BLPPProfileData pdDense, pdSparse, pdOut, pdStrategy[4];
+	uint64_t uLBig = 1ULL << 30;
+	int siFailed = 0;
+
+	if ((argc != 2) || (NULL == mkdtemp(acDir))) {
+		fprintf(stderr, "Usage: BLPPMergeCheck <path of BLPPMerge>\n");
+		return 2;
+	}
+	std::string sDir(acDir);
+
+	/* Function 0: dense paths against a path ID of 2^30. Function 1: the
+		 same, with path IDs small enough to be summed densely. The counts are
+		 large, so that the dense input is written as BLPP_ENC_DENSE.
+	*/
+	pdDense.uLBuildID = pdSparse.uLBuildID = 1;
+	pdDense.uiSampleRate = pdSparse.uiSampleRate = 1;
+	pdDense.vFuncs.resize(2);
+	pdSparse.vFuncs.resize(2);
+	for (unsigned int i = 0; i < 2; i++) {
+		for (uint64_t j = 0; j < BLPP_CHECK_DENSE_PATHS; j++) {
+			pdDense.vFuncs[i].vDense.push_back(BLPP_CHECK_COUNT + j);
+		}
+	}
+	pdSparse.vFuncs[0].vPaths.push_back(BLPPPathCount(2, 10));
+	pdSparse.vFuncs[0].vPaths.push_back(BLPPPathCount(uLBig, 5));
+	pdSparse.vFuncs[1].vPaths.push_back(BLPPPathCount(2, 10));
+	pdSparse.vFuncs[1].vPaths.push_back(BLPPPathCount(99, 5));
+	if ((0 != write_input(sDir + "/dense.res", pdDense)) ||
+			(0 != write_input(sDir + "/sparse.res", pdSparse))) {
+		fprintf(stderr, "BLPPMergeCheck: can't write the inputs\n");
+		return 1;
+	}
+
+	/* The dense input is weighted by 2 */
+	if ((0 != run_merge(argv[1], sDir, sDir + "/dense.res:2 " + sDir +
+											"/sparse.res", pdOut)) || (pdOut.vFuncs.size() != 2)) {
+		fprintf(stderr, "BLPPMergeCheck: merging dense and sparse inputs failed\n");
+		return 1;
+	}
+
+	for (unsigned int i = 0; i < 2; i++) {
+		const BLPPFuncProfile &bf = pdOut.vFuncs[i];
+		uint64_t uLSparseID = (0 == i) ? uLBig : 99;
+
+		for (uint64_t j = 0; j < BLPP_CHECK_DENSE_PATHS; j++) {
+			uint64_t uLExpected = (BLPP_CHECK_COUNT + j) * 2 + ((2 == j) ? 10 : 0);
+			if (path_count(bf, j) != uLExpected) {
+				fprintf(stderr, "BLPPMergeCheck: function %u, path %llu: %llu, "
+								"expected %llu\n", i, (unsigned long long) j,
+								(unsigned long long) path_count(bf, j),
+								(unsigned long long) uLExpected);
+				siFailed = 1;
+			}
+		}
+		if (path_count(bf, uLSparseID) != 5) {
+			fprintf(stderr, "BLPPMergeCheck: function %u, path %llu: %llu, "
+							"expected 5\n", i, (unsigned long long) uLSparseID,
+							(unsigned long long) path_count(bf, uLSparseID));
+			siFailed = 1;
+		}
+	}
+
+	/* Function 0 with 20 executions of path 1, counted in a counter array, in
+		 a path table, without a strategy and as edge counts; and counted in a
+		 profile sampled at 1/64 that has no counts of it. DENSE | TABLE reads
+		 as SAMPLED, and no strategy | EDGE as EDGE, so these pairs must not be
+		 merged; the function without counts must not change the strategy.
+	*/
+	const uint32_t auiStrategies[4] = {BLPP_STRATEGY_DENSE, BLPP_STRATEGY_TABLE,
+																		 0, BLPP_STRATEGY_EDGE};
+	const char *apcStrategyInputs[4] = {"/s0.res", "/s1.res", "/s2.res",
+																			"/s3.res"};
+	BLPPProfileData pdUncounted;
+	for (unsigned int i = 0; i < 4; i++) {
+		pdStrategy[i].uLBuildID = 1;
+		pdStrategy[i].uiSampleRate = 1;
+		pdStrategy[i].vFuncs.resize(1);
+		pdStrategy[i].vFuncs[0].uiFlags = auiStrategies[i];
+		pdStrategy[i].vFuncs[0].vPaths.push_back(BLPPPathCount(1, 20));
+	}
+	pdUncounted.uLBuildID = 1;
+	pdUncounted.uiSampleRate = 64;
+	pdUncounted.vFuncs.resize(1);
+	pdUncounted.vFuncs[0].uiFlags = BLPP_STRATEGY_SAMPLED;
+	for (unsigned int i = 0; i < 4; i++) {
+		if (0 != write_input(sDir + apcStrategyInputs[i], pdStrategy[i])) {
+			fprintf(stderr, "BLPPMergeCheck: can't write the inputs\n");
+			return 1;
+		}
+	}
+	if (0 != write_input(sDir + "/uncounted.res", pdUncounted)) {
+		fprintf(stderr, "BLPPMergeCheck: can't write the inputs\n");
+		return 1;
+	}
+	for (unsigned int i = 0; i < 4; i += 2) {
+		BLPPProfileData pdMixed;
+		if (0 == run_merge(argv[1], sDir, sDir + apcStrategyInputs[i] + " " +
+											 sDir + apcStrategyInputs[i + 1], pdMixed)) {
+			fprintf(stderr, "BLPPMergeCheck: strategies %#x and %#x were merged\n",
+							auiStrategies[i], auiStrategies[i + 1]);
+			siFailed = 1;
+		}
+	}
+	BLPPProfileData pdKept;
+	if ((0 != run_merge(argv[1], sDir, sDir + apcStrategyInputs[0] + " " +
+											sDir + "/uncounted.res", pdKept)) ||
+			(pdKept.vFuncs.size() != 1) ||
+			((pdKept.vFuncs[0].uiFlags & BLPP_FUNC_STRATEGY_MASK) !=
+			 BLPP_STRATEGY_DENSE) || (path_count(pdKept.vFuncs[0], 1) != 20)) {
+		fprintf(stderr, "BLPPMergeCheck: a profile without counts changed the "
+						"strategy or counts of a function\n");
+		siFailed = 1;
+	}
+
+	for (unsigned int i = 0; i < 4; i++) {
+		unlink((sDir + apcStrategyInputs[i]).c_str());
+	}
+	unlink((sDir + "/uncounted.res").c_str());
+	unlink((sDir + "/dense.res").c_str());
+	unlink((sDir + "/sparse.res").c_str());
+	unlink((sDir + "/out.res").c_str());
+	rmdir(acDir);
+	if (!siFailed) {
+		printf("BLPPMergeCheck: passed\n");
+	}
+	return siFailed;
+}
@@ -0,0 +1,328 @@
+/* This program merges path profiles (prof.res files of any version) into
+   one v2 profile, summing the counts of every (function ID, path ID).
+
+   Usage: BLPPMerge [-j threads] [-f] -o output input[:weight] ...
+
+   The counts of an input are multiplied by its weight (1 by default).
+   Inputs are read, and functions merged, on several threads. Functions with
+   a dense input are summed in a counter array, the others by a k-way merge
+   of their sorted paths.
+
+   Profiles of different builds number their functions and paths
+   differently, so inputs whose build IDs differ are rejected unless -f is
+   given. Inputs that count a function with different strategies
+   (BLPP_FUNC_STRATEGY_MASK) are rejected in any case. Sampled inputs are
+   scaled up to full counts, unless all inputs were sampled at the same
+   rate.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include "../BLPPProfileIO.h"
+
+/* Largest path space summed in a counter array */
+#define BLPP_MERGE_DENSE_LIMIT (1 << 24)
+
+/* Counts added per vector operation */
+#define BLPP_VEC_LEN (4)
+typedef uint64_t BLPPVec __attribute__((vector_size(BLPP_VEC_LEN * 8)));
+
+typedef struct BLPPInput {
+	const char *pcPath;
+	uint64_t uLWeight;
+	uint32_t uiScaleRate;       /* Sampled functions are scaled by this */
+	BLPPProfileData pd;
+	int siErr;
+} BLPPInput;
+
+typedef struct BLPPMergeJob {
+	std::vector<BLPPInput> *pvInputs;
+	BLPPProfileData *pdOutP;
+	unsigned int uiNext;        /* Next input or function to process */
+} BLPPMergeJob;
+
+/* This function adds uLWeight times a counter array to another, a vector
+	 of counts at a time.
+*/
+static void add_dense(uint64_t *puLDst, const uint64_t *puLSrc, size_t uiNum,
+											uint64_t uLWeight) {
+	size_t j = 0;
+
+	for (; j + BLPP_VEC_LEN <= uiNum; j += BLPP_VEC_LEN) {
+		BLPPVec vDst, vSrc;
+		memcpy(&vDst, puLDst + j, sizeof(vDst));
+		memcpy(&vSrc, puLSrc + j, sizeof(vSrc));
+		vDst += vSrc * uLWeight;
+		memcpy(puLDst + j, &vDst, sizeof(vDst));
+	}
+	for (; j < uiNum; j++) {
+		puLDst[j] += puLSrc[j] * uLWeight;
+	}
+}
+
+/* A sorted path list taking part in a k-way merge. The heap puts the list
+	 with the smallest next path ID on top.
+*/
+typedef struct BLPPMergeCursor {
+	const BLPPPathCount *pcP, *pcEnd;
+	uint64_t uLWeight;
+	bool operator<(const BLPPMergeCursor &bmc) const {
+		return pcP->first > bmc.pcP->first;
+	}
+} BLPPMergeCursor;
+
+/* This function merges the counts of one function of every input into the
+	 output.
+	 Inputs:
+	   vInputs -> Inputs
+		 uiFID   -> Function ID
+		 bfOut   -> Receives the merged counts; its flags are merged already
+	 Return Value:
+	   None
+*/
+static void merge_function(std::vector<BLPPInput> &vInputs, unsigned int uiFID,
+													 BLPPFuncProfile &bfOut) {
+	std::vector<const BLPPFuncProfile*> vFuncs;
+	std::vector<uint64_t> vWeights;
+	std::vector<BLPPFuncProfile> vSparse;
+	uint64_t uLSize = 0;
+	bool bHasDense = false;
+
+	for (unsigned int i = 0; i < vInputs.size(); i++) {
+		if (uiFID < vInputs[i].pd.vFuncs.size()) {
+			const BLPPFuncProfile &bf = vInputs[i].pd.vFuncs[uiFID];
+			if (bf.vDense.empty() && bf.vPaths.empty()) {
+				continue;
+			}
+			vFuncs.push_back(&bf);
+			vWeights.push_back(vInputs[i].uLWeight *
+												 blpp_func_rate(bf.uiFlags, vInputs[i].uiScaleRate));
+			bHasDense |= !bf.vDense.empty();
+			uLSize = std::max(uLSize, (uint64_t) bf.vDense.size());
+			if (!bf.vPaths.empty()) {
+				uLSize = std::max(uLSize, bf.vPaths.back().first + 1);
+			}
+		}
+	}
+	if (vFuncs.empty()) {
+		return;
+	}
+
+	if (bHasDense && (uLSize <= BLPP_MERGE_DENSE_LIMIT)) {
+		bfOut.vDense.assign(uLSize, 0);
+		for (unsigned int i = 0; i < vFuncs.size(); i++) {
+			const BLPPFuncProfile &bf = *vFuncs[i];
+			add_dense(&bfOut.vDense[0], bf.vDense.data(), bf.vDense.size(),
+								vWeights[i]);
+			for (size_t j = 0; j < bf.vPaths.size(); j++) {
+				bfOut.vDense[bf.vPaths[j].first] += bf.vPaths[j].second * vWeights[i];
+			}
+		}
+		return;
+	}
+
+	/* Dense inputs of huge path spaces join the merge as path lists */
+	std::priority_queue<BLPPMergeCursor> pqCursors;
+	vSparse.resize(vFuncs.size());
+	for (unsigned int i = 0; i < vFuncs.size(); i++) {
+		const BLPPFuncProfile *bfP = vFuncs[i];
+		if (!bfP->vDense.empty()) {
+			/* Inputs have either dense counts or paths, not both */
+			for (size_t j = 0; j < bfP->vDense.size(); j++) {
+				if (bfP->vDense[j]) {
+					vSparse[i].vPaths.push_back(BLPPPathCount(j, bfP->vDense[j]));
+				}
+			}
+			bfP = &vSparse[i];
+		}
+		if (!bfP->vPaths.empty()) {
+			BLPPMergeCursor bmc = {&bfP->vPaths[0],
+														 &bfP->vPaths[0] + bfP->vPaths.size(), vWeights[i]};
+			pqCursors.push(bmc);
+		}
+	}
+	while (!pqCursors.empty()) {
+		BLPPMergeCursor bmc = pqCursors.top();
+		uint64_t uLCount = bmc.pcP->second * bmc.uLWeight;
+
+		pqCursors.pop();
+		if (!bfOut.vPaths.empty() && (bfOut.vPaths.back().first == bmc.pcP->first)) {
+			bfOut.vPaths.back().second += uLCount;
+		} else {
+			bfOut.vPaths.push_back(BLPPPathCount(bmc.pcP->first, uLCount));
+		}
+		if (++bmc.pcP != bmc.pcEnd) {
+			pqCursors.push(bmc);
+		}
+	}
+}
+
+/* Thread function reading inputs until none are left */
+static void *read_inputs(void *vP) {
+	BLPPMergeJob *bmjP = (BLPPMergeJob*) vP;
+	std::vector<BLPPInput> &vInputs = *bmjP->pvInputs;
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&bmjP->uiNext, 1)) < vInputs.size()) {
+		FILE *fp = fopen(vInputs[i].pcPath, "rb");
+		vInputs[i].siErr = (NULL == fp) ? -1 :
+			blpp_read_profile(fp, vInputs[i].pd);
+		if (NULL != fp) {
+			fclose(fp);
+		}
+	}
+	return NULL;
+}
+
+/* Thread function merging functions until none are left */
+static void *merge_functions(void *vP) {
+	BLPPMergeJob *bmjP = (BLPPMergeJob*) vP;
+	std::vector<BLPPFuncProfile> &vFuncs = bmjP->pdOutP->vFuncs;
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&bmjP->uiNext, 1)) < vFuncs.size()) {
+		merge_function(*bmjP->pvInputs, i, vFuncs[i]);
+	}
+	return NULL;
+}
+
+/* This function runs fnP on uiNumThreads threads, the calling one included */
+static void run_threads(void *(*fnP)(void*), BLPPMergeJob &bmj,
+												unsigned int uiNumThreads) {
+	std::vector<pthread_t> vThreads;
+
+	bmj.uiNext = 0;
+	for (unsigned int i = 1; i < uiNumThreads; i++) {
+		pthread_t tThread;
+		if (0 == pthread_create(&tThread, NULL, fnP, &bmj)) {
+			vThreads.push_back(tThread);
+		}
+	}
+	fnP(&bmj);
+	for (unsigned int i = 0; i < vThreads.size(); i++) {
+		pthread_join(vThreads[i], NULL);
+	}
+}
+
+static void usage() {
+	fprintf(stderr, "Usage: BLPPMerge [-j threads] [-f] -o output "
+					"input[:weight] ...\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	std::vector<BLPPInput> vInputs;
+	BLPPProfileData pdOut;
+	BLPPMergeJob bmj;
+	const char *pcOutput = NULL;
+	long siThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int uiNumFuncs = 0;
+	bool bForce = false, bSameRate = true;
+	FILE *fp;
+	int siOpt;
+
+	while (-1 != (siOpt = getopt(argc, argv, "j:fo:"))) {
+		switch (siOpt) {
+		case 'j': siThreads = atol(optarg); break;
+		case 'f': bForce = true; break;
+		case 'o': pcOutput = optarg; break;
+		default: usage();
+		}
+	}
+	if ((NULL == pcOutput) || (optind == argc)) {
+		usage();
+	}
+	if (siThreads < 1) {
+		siThreads = 1;
+	}
+
+	vInputs.resize(argc - optind);
+	for (unsigned int i = 0; i < vInputs.size(); i++) {
+		char *pcArg = argv[optind + i];
+		char *pcColon = strrchr(pcArg, ':');
+		char *pcEnd;
+
+		vInputs[i].pcPath = pcArg;
+		vInputs[i].uLWeight = 1;
+		vInputs[i].uiScaleRate = 1;
+		if ((NULL != pcColon) && ('\0' != pcColon[1])) {
+			unsigned long long uLWeight = strtoull(pcColon + 1, &pcEnd, 10);
+			if ('\0' == *pcEnd) {
+				if (0 == uLWeight) {
+					fprintf(stderr, "BLPPMerge: %s: weight must be positive\n", pcArg);
+					return 1;
+				}
+				*pcColon = '\0';
+				vInputs[i].uLWeight = uLWeight;
+			}
+		}
+	}
+
+	bmj.pvInputs = &vInputs;
+	bmj.pdOutP = &pdOut;
+	run_threads(read_inputs, bmj, std::min<long>(siThreads, vInputs.size()));
+
+	for (unsigned int i = 0; i < vInputs.size(); i++) {
+		BLPPInput &bi = vInputs[i];
+		if (0 != bi.siErr) {
+			fprintf(stderr, "BLPPMerge: %s: not a readable profile\n", bi.pcPath);
+			return 1;
+		}
+		if (bi.pd.uLBuildID != vInputs[0].pd.uLBuildID) {
+			fprintf(stderr, "BLPPMerge: %s: build %016llx, but %s is of build "
+							"%016llx%s\n", bi.pcPath, (unsigned long long) bi.pd.uLBuildID,
+							vInputs[0].pcPath,
+							(unsigned long long) vInputs[0].pd.uLBuildID,
+							bForce ? "" : " (use -f to merge anyway)");
+			if (!bForce) {
+				return 1;
+			}
+		}
+		bSameRate &= (bi.pd.uiSampleRate == vInputs[0].pd.uiSampleRate);
+		uiNumFuncs = std::max(uiNumFuncs, (unsigned int) bi.pd.vFuncs.size());
+	}
+
+	pdOut.uLBuildID = vInputs[0].pd.uLBuildID;
+	pdOut.uiSampleRate = vInputs[0].pd.uiSampleRate;
+	if (!bSameRate) {
+		pdOut.uiSampleRate = 1;
+		for (unsigned int i = 0; i < vInputs.size(); i++) {
+			vInputs[i].uiScaleRate = vInputs[i].pd.uiSampleRate;
+		}
+	}
+	pdOut.vFuncs.resize(uiNumFuncs);
+	for (unsigned int uiFID = 0; uiFID < uiNumFuncs; uiFID++) {
+		const char *pcCountedP = NULL; /* First input with counts */
+		for (unsigned int i = 0; i < vInputs.size(); i++) {
+			if (uiFID >= vInputs[i].pd.vFuncs.size()) {
+				continue;
+			}
+			const BLPPFuncProfile &bf = vInputs[i].pd.vFuncs[uiFID];
+			bool bCounts = blpp_has_counts(bf);
+			if (0 != blpp_merge_flags(pdOut.vFuncs[uiFID].uiFlags,
+																NULL != pcCountedP, bf.uiFlags, bCounts)) {
+				fprintf(stderr, "BLPPMerge: %s: function %u is counted with another "
+								"strategy than in %s\n", vInputs[i].pcPath, uiFID, pcCountedP);
+				return 1;
+			}
+			if (bCounts && (NULL == pcCountedP)) {
+				pcCountedP = vInputs[i].pcPath;
+			}
+		}
+	}
+	run_threads(merge_functions, bmj,
+							std::max<long>(1, std::min<long>(siThreads, uiNumFuncs)));
+
+	fp = fopen(pcOutput, "wb");
+	if ((NULL == fp) || (0 != blpp_write_profile(fp, pdOut)) ||
+			(0 != fclose(fp))) {
+		fprintf(stderr, "BLPPMerge: can't write %s\n", pcOutput);
+		return 1;
+	}
+	return 0;
+}
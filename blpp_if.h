@@ -17,5 +17,174 @@ typedef struct BLPPProfInfo {
 
 #define BLPPDB_HDR_SIZE (sizeof(BLPPDBHdr))
 
+/* The layout above is version 1 of the profile format, still read by
+   BLPPDB. The runtime writes version 2:
+
+     BLPPProfHdr
+     BLPPFuncIndex, one per function ID
+     the paths of each function, at the offset given by its index entry
+
+   so a reader can go straight to the paths of one function. The paths of
+   a function are encoded either as
+     BLPP_ENC_VARINT: uiNumPaths (path ID delta, count) pairs of LEB128
+                      varints, sorted by path ID; the first delta is from 0
+     BLPP_ENC_DENSE:  uiNumPaths 64 bit counts, indexed by path ID and
+                      possibly 0 (-blppmmap, which updates them in place)
+   A v1 profile starts with the header of function 0, so it can't be
+   mistaken for a v2 one. Fields are in the byte order of the machine the
+   profile was written on.
+*/
+#define BLPP_PROF_MAGIC   (0x32505042) /* "BPP2" */
+#define BLPP_PROF_VERSION (2)
+
+#define BLPP_ENC_VARINT   (0)
+#define BLPP_ENC_DENSE    (1)
+
+/* How the path IDs of a function were numbered, in the bits of uiEncoding
+   above BLPP_ENC_MASK and in BLPPFuncDesc.uiFlags. Functions with too many
+   paths to number have their paths cut at some merge points, like at back
+   edges, or have path IDs reduced modulo a power of two, in which case IDs
+   can't be decoded into paths.
+*/
+#define BLPP_ENC_MASK       (0xFFFF)
+#define BLPP_FUNC_TRUNCATED (1 << 16)
+#define BLPP_FUNC_HASHED    (1 << 17)
+/* Not instrumented (selective builds): the function keeps its ID, but has
+   no paths in the profile
+*/
+#define BLPP_FUNC_UNINSTRUMENTED (1 << 18)
+/* How an instrumented function counts its paths, when -blppbudget or
+   -blppedgeonly chose it.
+   Functions without a strategy were instrumented as the build options say,
+   so they were sampled iff the profile was.
+*/
+#define BLPP_FUNC_STRATEGY_MASK (7 << 20)
+#define BLPP_STRATEGY_DENSE     (1 << 20) /* Counter array, every path */
+#define BLPP_STRATEGY_TABLE     (2 << 20) /* Path table, every path */
+#define BLPP_STRATEGY_SAMPLED   (3 << 20) /* One in uiSampleRate paths */
+/* Edge counts only (-blppedgeonly): "path" i counts the executions of CFG
+   edge i of BLPP::ChooseEdgeCounters, for the edges it counts
+*/
+#define BLPP_STRATEGY_EDGE      (4 << 20)
+
+/* This function returns the rate the counts of a function are scaled up by,
+   in a profile sampled at uiSampleRate.
+*/
+static inline uint32_t blpp_func_rate(uint32_t uiFlags, uint32_t uiSampleRate) {
+	uint32_t uiStrategy = uiFlags & BLPP_FUNC_STRATEGY_MASK;
+
+	if ((0 == uiStrategy) || (BLPP_STRATEGY_SAMPLED == uiStrategy)) {
+		return uiSampleRate;
+	}
+	return 1;
+}
+
+typedef struct BLPPProfHdr {
+	uint32_t uiMagic;
+	uint32_t uiVersion;
+	uint32_t uiHdrSize;     /* sizeof(BLPPProfHdr); the index follows */
+	uint32_t uiNumFuncs;
+	uint32_t uiSampleRate;  /* 1 unless the build was sampled */
+	uint32_t uiFlags;
+	uint64_t uLBuildID;     /* Identifies the instrumented program, or 0 */
+} BLPPProfHdr;
+
+typedef struct BLPPFuncIndex {
+	uint64_t uLOffset;      /* of the paths, from the start of the file */
+	uint64_t uLSize;        /* of the paths, in bytes */
+	uint32_t uiNumPaths;
+	uint32_t uiEncoding;    /* BLPP_ENC_*, with BLPP_FUNC_* flags */
+} BLPPFuncIndex;
+
+/* This function appends a LEB128 varint to a buffer of at least 10 bytes.
+	 Return Value:
+	   Number of bytes written
+*/
+static inline unsigned int blpp_put_varint(uint8_t *pucBuf, uint64_t uLValue) {
+	unsigned int uiLen = 0;
+
+	while (uLValue >= 0x80) {
+		pucBuf[uiLen++] = (uint8_t) (uLValue | 0x80);
+		uLValue >>= 7;
+	}
+	pucBuf[uiLen++] = (uint8_t) uLValue;
+	return uiLen;
+}
+
+/* This function reads a LEB128 varint.
+	 Return Value:
+	   The byte after the varint, or NULL if it runs past pucEnd
+*/
+static inline const uint8_t *blpp_get_varint(const uint8_t *pucBuf,
+																						 const uint8_t *pucEnd,
+																						 uint64_t *puLValue) {
+	uint64_t uLValue = 0;
+	unsigned int uiShift = 0;
+
+	while ((pucBuf < pucEnd) && (uiShift < 64)) {
+		uint8_t ucByte = *pucBuf++;
+		uLValue |= (uint64_t) (ucByte & 0x7F) << uiShift;
+		if (!(ucByte & 0x80)) {
+			*puLValue = uLValue;
+			return pucBuf;
+		}
+		uiShift += 7;
+	}
+	return NULL;
+}
+
+/* v1 profiles of sampled builds (-blppsamplerate) end with this trailer. Only
+   one in uiSampleRate paths was counted, so readers scale counts up by it.
+   The last 8 bytes of an unsampled profile can't be mistaken for it: they
+   are either the padding of a BLPPProfInfo or the path count of the dummy
+   header, which are 0.
+*/
+typedef struct BLPPSampleTrailer {
+	uint32_t uiMagic;
+	uint32_t uiSampleRate;
+} BLPPSampleTrailer;
+
+#define BLPP_SAMPLE_MAGIC (0x53505042) /* "BPPS" */
+
+/* Every instrumented module describes its functions in a static table,
+   registered by a global constructor calling __blpp_register_module. The
+   runtime gives each module a range of function IDs, so that modules linked
+   into one program don't share IDs: function i of a module has ID
+   *puiIDBase + i in the profile and in calls to the runtime. The layout of
+   these structures is known to the instrumentation pass.
+*/
+#define BLPP_MODULE_VERSION   (1)
+
+/* How a function counts its paths */
+#define BLPP_COUNTERS_CALL    (0) /* __record_path_sum or a path table */
+#define BLPP_COUNTERS_DENSE   (1) /* vCountersP is a uint64_t array */
+#define BLPP_COUNTERS_MAPPED  (2) /* vCountersP is a uint64_t* to the array */
+#define BLPP_COUNTERS_THREAD  (3) /* Per-thread arrays (-blppthreaded) */
+
+typedef struct BLPPFuncDesc {
+	const char *pcName;
+	void *vCountersP;       /* NULL unless BLPP_COUNTERS_(DENSE|MAPPED) */
+	uint32_t uiFuncID;      /* Within the module */
+	uint32_t uiNumPaths;
+	uint32_t uiCounters;    /* BLPP_COUNTERS_* */
+	uint32_t uiFlags;       /* BLPP_FUNC_* */
+} BLPPFuncDesc;
+
+typedef struct BLPPModuleDesc {
+	uint32_t uiVersion;     /* BLPP_MODULE_VERSION */
+	uint32_t uiNumFuncs;
+	uint64_t uLBuildID;
+	uint32_t uiSampleRate;  /* 1 unless the module was sampled */
+	uint32_t uiFlags;
+	uint32_t *puiIDBase;    /* Set by the runtime */
+	BLPPFuncDesc *bfdFuncsP;
+	struct BLPPModuleDesc *bmdNextP; /* Used by the runtime */
+} BLPPModuleDesc;
+
+/* Multiplier of the path table hash. The instrumentation pass inlines the
+   path table lookup, so it must agree with the runtime on the hash.
+*/
+#define BLPP_HASH_MUL (0x9E3779B97F4A7C15ULL)
+
 #endif
 
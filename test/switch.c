@@ -0,0 +1,60 @@
+#include <stdio.h>
+
+/* Inputs for switch instrumentation: dense() gets a table of path sum
+   increments, sparse() a block per instrumented case. Instrument, run with
+   a few inputs, and decode the profile with BLPPDump, which checks every
+   recorded path ID with BLPP::RegeneratePath:
+
+   clang -O1 -emit-llvm -c switch.c -o switch.bc
+   opt -load LLVMPathProfiler.so -ppinstrument switch.bc -o switch.ins.bc
+   ...
+   echo 0 1 2 3 4 5 6 7 8 9 | ./switch.ins
+   opt -load BLPPDump.so -blppdump -blppdata prof.res switch.bc
+
+   This is not an automated test. RegeneratePath only shows that each path
+   ID decodes to a path of the CFG; that the counts match those of a build
+   with -blppswitchtable=0, whose instrumented cases each get a block, is
+   unverified.
+*/
+int dense(int n)
+{
+  int r = 0;
+  switch (n)
+  {
+    case 0: r = 1; break;
+    case 1: r = 7; break;
+    case 2: 
+    case 3: r = n * 3; break;
+    case 5: return -1;
+    case 6: r = n + 2; break;
+    default: r = 4;
+  }
+  return r;
+}
+
+int sparse(int n)
+{
+  int i, r = 0;
+  for (i = 0; i < n; i++)
+  {
+    switch (i * 997)
+    {
+      case 0: r += 1; break;
+      case 997: r += 2; continue;
+      case 99700: r -= 3; break;
+      case 4985: return r;
+      default: r ^= i;
+    }
+    r++;
+  }
+  return r;
+}
+
+int main()
+{
+  int n, sum = 0;
+  while (1 == scanf("%d", &n))
+    sum += dense(n) + sparse(n);
+  printf("%d\n", sum);
+  return 0;
+}